@@ -0,0 +1,11 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include "usb.h"
+#include "progress.h"
+
+int backupDevice(const UsbDevice *dev, const char *archive, ProgressSlot *progress);
+long long backupImageSize(const char *archive);
+int restoreDevice(const char *archive, const UsbDevice *dev, ProgressSlot *progress);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+struct BufferPool;
+
+typedef struct IoBuffer {
+    char *data;                 // page aligned, usable with O_DIRECT
+    size_t cap;
+    size_t len;
+    long long offset;           // position in the image
+    atomic_int refs;            // one per consumer still holding it
+    struct BufferPool *pool;
+    struct IoBuffer *next;
+} IoBuffer;
+
+typedef struct {
+    int count;
+    size_t bufSize;
+    int hugepages;
+    int inUse;
+    int peakInUse;
+    unsigned long long acquires;
+    unsigned long long stalls;
+    double stallSeconds;
+} PoolStats;
+
+typedef struct BufferPool {
+    IoBuffer *bufs;
+    int count;
+    size_t bufSize;
+    char *arena;
+    size_t arenaSize;
+    int hugepages;
+
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    IoBuffer *freeList;
+    int freeCount;
+    int peakInUse;
+
+    unsigned long long acquires;
+    unsigned long long stalls;
+    unsigned long long stallNs;
+} BufferPool;
+
+int poolCreate(BufferPool *pool, int count, size_t bufSize, int hugepages);
+void poolDestroy(BufferPool *pool);
+IoBuffer *poolAcquire(BufferPool *pool);
+void bufferShare(IoBuffer *buf, int consumers);
+void bufferRelease(IoBuffer *buf);
+void poolStats(BufferPool *pool, PoolStats *stats);
+void printPoolStats(const PoolStats *stats);
+
+// Bounded hand-off queue; passes buffer pointers, never the data
+typedef struct {
+    IoBuffer **items;
+    int cap;
+    int head;
+    int len;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} BufQueue;
+
+int queueInit(BufQueue *q, int cap);
+void queueDestroy(BufQueue *q);
+void queuePush(BufQueue *q, IoBuffer *buf);
+IoBuffer *queuePop(BufQueue *q);
+int queueLength(BufQueue *q);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,18 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "usb.h"
+#include "progress.h"
+
+typedef struct {
+    long long size;             // bytes of the image compared
+    int chunks;
+    int changed;                // chunks that differed on the first pass
+    int runs;                   // writes after merging neighbouring chunks
+    long long rewritten;
+} DeltaStats;
+
+int deltaWriteImage(const char *iso, UsbDevice *dev, ProgressSlot *progress, DeltaStats *stats);
+void printDeltaStats(const DeltaStats *stats);
+
+#endif
\ No newline at end of file
@@ -2,10 +2,14 @@
 #define DEVICES_H
 
 #include "usb.h"
+#include "iso.h"
+#include "footprint.h"
 #include <string.h>
 
 int getUsbDevices(UsbDevice *list, int max);
+int readUsbDevice(const char *name, UsbDevice *dev);
 int findUsbByName(const char *name, UsbDevice *devOut);
-int hasEnoughSpace(const char *isoPath, UsbDevice *dev);
+int hasEnoughSpace(const char *isoPath, UsbDevice *dev, IsoType type);
+int layoutHasEnoughSpace(const IsoLayout *layout, UsbDevice *dev);
 
 #endif
\ No newline at end of file
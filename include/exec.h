@@ -1,7 +1,15 @@
 #ifndef EXEC_H
 #define EXEC_H
 
+#include <sys/types.h>
+#include <pthread.h>
+
 int run(char *const argv[]);
 int run_checked(char *const argv[]);
+pid_t run_async(char *const argv[], int ioprioLevel);
+int run_wait(pid_t pid, const char *name);
+void abortCommands(pthread_t owner);
+void resetAbort();
+void setQuietChildren(int quiet);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef FAT_H
+#define FAT_H
+
+#include "usb.h"
+
+#define FAT_CLUSTER_CHOICES 4 // 4, 8, 16 and 32 KiB
+
+typedef struct {
+    long long files;
+    long long dirs;
+    long long bytes;
+    long long slack[FAT_CLUSTER_CHOICES]; // bytes lost to cluster rounding per choice
+} TreeStats;
+
+typedef struct {
+    unsigned sectorSize;
+    unsigned clusterSize;
+    unsigned reservedSectors;
+    unsigned fatSectors;
+    long long clusters;
+    long long dataOffset;   // from the start of the disk
+    long long alignment;
+    long long slack;
+} FatGeometry;
+
+int clusterSizeForChoice(int choice);
+void treeStatsAddFile(TreeStats *stats, long long size);
+int scanTreeStats(const char *root, TreeStats *stats);
+int chooseFatCluster(long long sectors, unsigned sectorSize, const TreeStats *stats);
+unsigned fatSectorsForChoice(long long sectors, unsigned sectorSize, int choice, long long *clusters);
+int planFatGeometry(const char *srcRoot, UsbDevice *dev, FatGeometry *geo);
+void printFatGeometry(const FatGeometry *geo, const TreeStats *stats);
+
+#endif
\ No newline at end of file
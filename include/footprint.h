@@ -0,0 +1,55 @@
+#ifndef FOOTPRINT_H
+#define FOOTPRINT_H
+
+#include "usb.h"
+#include "iso.h"
+#include "fat.h"
+
+typedef enum {
+    STRATEGY_RAW,
+    STRATEGY_COPY,
+    STRATEGY_COUNT
+} Strategy;
+
+typedef struct {
+    int possible;           // the strategy applies to this image and target
+    long long needed;       // bytes it occupies on the target
+    long long available;    // bytes it has to work with
+    double seconds;         // expected job time at typical stick speeds
+} StrategyEstimate;
+
+typedef struct {
+    StrategyEstimate strategy[STRATEGY_COUNT];
+    int chosen;             // what create_bootable will run, -1 if neither applies
+    int format;             // directory tree walked for the copy figures, -1 if estimated from size
+    long long files;
+    long long dirs;
+    long long dataBytes;
+    long long slack;
+    long long dirBytes;
+    unsigned clusterSize;
+    int wimParts;           // install.wim pieces after the FAT32 split, 0 if copied whole
+} Footprint;
+
+// What the estimate needs from the image alone, so a long-running process can keep it per image
+typedef struct IsoLayout {
+    long long size;
+    IsoType type;
+    int hybrid;
+    int format;             // directory tree walked, -1 if it could not be read
+    TreeStats stats;
+    int *slots;             // 32-byte directory entries per directory id
+    int slotCap;
+    int wimParts;
+} IsoLayout;
+
+int inspectIsoLayout(const char *iso, IsoType type, IsoLayout *layout);
+int copyIsoLayout(IsoLayout *dst, const IsoLayout *src);
+void freeIsoLayout(IsoLayout *layout);
+
+int estimateFootprint(const char *iso, const UsbDevice *dev, IsoType type, Footprint *fp);
+int estimateLayoutFootprint(const IsoLayout *layout, const UsbDevice *dev, Footprint *fp);
+int footprintFits(const Footprint *fp);
+void printFootprint(const UsbDevice *dev, const Footprint *fp);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef GRAPEUSB_H
+#define GRAPEUSB_H
+
+// Public interface of libgrapeusb; nothing here depends on the engine's own headers
+
+typedef struct GrapeJob GrapeJob;
+struct IsoLayout;
+
+typedef enum {
+    GRAPE_JOB_RUNNING,
+    GRAPE_JOB_DONE,
+    GRAPE_JOB_FAILED,
+    GRAPE_JOB_CANCELLED
+} GrapeJobState;
+
+typedef struct {
+    GrapeJobState state;
+    const char *phase;                  // "starting", "writing", "verifying", ...
+    unsigned long long total;           // bytes, 0 until the job knows
+    unsigned long long bytesRead;
+    unsigned long long bytesWritten;
+    unsigned long long bytesFlushed;
+    unsigned long long bytesVerified;
+    unsigned queueDepth;
+    double elapsed;                     // seconds since the job started
+    double rate;                        // average bytes written per second
+    unsigned long long latencyP50;      // write latency in microseconds, raw writes only
+    unsigned long long latencyP99;
+    unsigned long long latencyMax;
+    const char *latencySource;          // "direct" for O_DIRECT chunk writes, "flush" for periodic flushes
+    int targetGone;                     // the device was unplugged mid-job
+    double rateDefault;                 // bytes/s reaching the device with the kernel's queue settings
+    double rateTuned;                   // and after switching to the throughput profile; 0 until measured
+} GrapeMetrics;
+
+typedef void (*GrapeProgressFn)(GrapeJob *job, const GrapeMetrics *metrics, void *user);
+
+typedef struct {
+    const char *iso;
+    const char *device;                 // sdX, /dev/sdX, file:PATH[:SIZE], loop:PATH[:SIZE] or null
+    int refresh;                        // update the stick in place instead of erasing it
+    int skipProbe;                      // skip the counterfeit capacity check
+    int fixedIo;                        // no adaptive chunk size and write depth
+    int keepQueue;                      // leave the device's block queue settings alone
+    const char *backupPath;             // optional: image the device to this new file before the job changes it
+    const char *writeMethod;            // "buffered", "direct" or "splice"; NULL for buffered
+    const struct IsoLayout *layout;     // optional: the engine's inspection of iso, copied; saves reading the image again
+    GrapeProgressFn onProgress;         // optional, called from a job-owned thread
+    unsigned intervalMs;                // between callbacks, 0 for 500 ms
+    void *user;
+} GrapeJobConfig;
+
+typedef struct {
+    char name[64];
+    char path[128];
+    char size[32];
+    char model[128];
+} GrapeDevice;
+
+typedef struct {
+    int valid;                          // has ISO9660 or UDF descriptors
+    int windows;
+    int hybrid;                         // bootable when written raw
+    long long size;
+} GrapeIsoInfo;
+
+int grapeListDevices(GrapeDevice *list, int max);
+int grapeInspectIso(const char *path, GrapeIsoInfo *info);
+
+GrapeJob *grapeJobStart(const GrapeJobConfig *config);
+void grapeJobPoll(GrapeJob *job, GrapeMetrics *metrics);
+GrapeJobState grapeJobWait(GrapeJob *job);
+void grapeJobCancel(GrapeJob *job);
+const char *grapeJobError(GrapeJob *job);     // after grapeJobWait, NULL on success
+void grapeJobFree(GrapeJob *job);
+
+#endif
\ No newline at end of file
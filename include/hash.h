@@ -0,0 +1,20 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming XXH64, used to compare image and device contents without a second image read
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char tail[32];
+    size_t tailLen;
+} HashState;
+
+void hashInit(HashState *h);
+void hashUpdate(HashState *h, const void *data, size_t len);
+uint64_t hashFinal(const HashState *h);
+uint64_t hashBuffer(const void *data, size_t len);
+
+#endif
\ No newline at end of file
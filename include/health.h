@@ -0,0 +1,30 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#define LATENCY_BUCKETS 32 // bucket i holds [2^i, 2^(i+1)) microseconds
+
+typedef struct {
+    unsigned long long buckets[LATENCY_BUCKETS];
+    unsigned long long count;
+    unsigned long long maxUs;
+    unsigned long long sumUs;
+    int flushes;            // samples time periodic flushes, not O_DIRECT chunk writes
+} LatencyHist;
+
+typedef struct {
+    long long reported;     // what sysfs claims
+    long long lastGood;     // highest sample that read back intact
+    long long firstBad;     // lowest sample that did not, -1 if none
+    int samples;
+    int bad;
+} ProbeResult;
+
+void latencyRecord(LatencyHist *h, unsigned long long us);
+const char *latencySource(const LatencyHist *h);
+unsigned long long latencyPercentile(const LatencyHist *h, double p);
+int latencyReport(const char *label, const LatencyHist *h);
+
+int probeCapacity(const char *devPath, ProbeResult *res);
+void printProbeResult(const char *devPath, const ProbeResult *res);
+
+#endif
\ No newline at end of file
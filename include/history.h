@@ -0,0 +1,13 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "usb.h"
+#include "progress.h"
+
+#define HISTORY_PATH "/var/lib/grapeusb/history.jsonl"
+
+int historyRecord(const char *iso, const char *strategy, const UsbDevice *dev, ProgressSlot *progress,
+                  double seconds, int ok);
+int historyReport(const char *path);
+
+#endif
\ No newline at end of file
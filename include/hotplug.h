@@ -0,0 +1,30 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "usb.h"
+#include "progress.h"
+
+#define MAX_DEVICES 16
+
+int deviceTableInit();
+int deviceTableFd();
+int deviceTableProcess();
+int deviceTableSnapshot(UsbDevice *list, int max);
+
+typedef struct {
+    pthread_t thread;
+    pthread_t owner;        // whose commands get killed on removal
+    int fd;
+    int running;
+    atomic_int stop;
+    char name[64];
+    ProgressSlot *slot;
+} TargetWatch;
+
+int startTargetWatch(TargetWatch *w, const char *name, ProgressSlot *slot);
+void stopTargetWatch(TargetWatch *w);
+
+#endif
\ No newline at end of file
@@ -7,10 +7,12 @@ typedef enum {
     ISO_LINUX
 } IsoType;
 
-int mountISO(const char *iso);
-void unmountISO();
+int mountISO(const char *iso, const char *dir);
+void unmountISO(const char *dir);
 IsoType detectISOType(const char *iso);
 int validateISOArgument(const char* iso, IsoType* type);
 int isValidISO(const char *iso);
+void startIsoValidation(const char *iso);
+int finishIsoValidation(IsoType *type);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,61 @@
+#ifndef ISOCACHE_H
+#define ISOCACHE_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "iso.h"
+#include "footprint.h"
+
+#define ISO_CACHE_SIZE 16
+
+typedef enum {
+    PIN_NONE,
+    PIN_LOADING,
+    PIN_READY,
+    PIN_FAILED,
+    PIN_DROPPED             // let go of while loading, the loader frees it
+} PinState;
+
+// Outlives its entry when unpinned mid-load, so nobody has to wait for the loader
+typedef struct {
+    char path[4096];
+    long long size;
+    void *map;              // locked in memory once ready
+    atomic_int state;
+} IsoPin;
+
+struct IsoProbe;
+
+// What a long-running process remembers about one image; stale once size or mtime change
+typedef struct {
+    char path[4096];
+    dev_t dev;
+    ino_t ino;
+    long long size;
+    long long mtime;
+    struct IsoProbe *probe; // inspection still running; valid, type, hybrid and layout are unset
+    int valid;
+    IsoType type;
+    int hybrid;
+    IsoLayout layout;       // what a job needs from the image, valid images only
+    int uses;
+    double lastUsed;
+    IsoPin *pin;            // NULL when not pinned
+} IsoEntry;
+
+void isoCacheSetBudget(long long bytes);
+long long isoCacheBudget();
+long long isoCachePinned();
+IsoEntry *isoCacheLookup(const char *path);
+int isoCacheInspecting(const IsoEntry *e);
+int isoCacheFd();
+int isoCacheCollect();
+int isoCacheUse(IsoEntry *e);
+int isoCachePin(IsoEntry *e);
+void isoCacheUnpin(IsoEntry *e);
+PinState isoCachePinState(const IsoEntry *e);
+int isoCacheList(IsoEntry **list, int max);
+void isoCacheClear();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,25 @@
+#ifndef ISOTREE_H
+#define ISOTREE_H
+
+typedef enum {
+    ISOTREE_ISO9660,
+    ISOTREE_JOLIET,
+    ISOTREE_UDF
+} IsoTreeFormat;
+
+typedef struct {
+    const char *path;       // relative to the image root, non-ASCII folded to '_'
+    int nameChars;          // length of the last component, as the original name counts it
+    int dir;
+    int parent;             // id of the containing directory, 0 is the root
+    int id;                 // directories only: the parent id their children carry
+    long long size;
+} IsoTreeEntry;
+
+// Returning nonzero stops the walk
+typedef int (*IsoTreeFn)(const IsoTreeEntry *e, void *ctx);
+
+int walkIsoTree(const char *iso, IsoTreeFn fn, void *ctx);
+const char *isoTreeFormatName(int format);
+
+#endif
\ No newline at end of file
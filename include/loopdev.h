@@ -0,0 +1,12 @@
+#ifndef LOOPDEV_H
+#define LOOPDEV_H
+
+#include <stddef.h>
+
+int loopAttachFd(const char *file, unsigned flags, unsigned blockSize, char *devPath, size_t len);
+int loopAttach(const char *file, unsigned flags, unsigned blockSize, char *devPath, size_t len);
+int loopDetach(const char *devPath);
+int loopSetReadAhead(int loopFd, unsigned kb);
+int loopUsesDirectIO(const char *devPath);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,16 @@
+#ifndef MOUNTS_H
+#define MOUNTS_H
+
+// Where one job mounts the ISO and the stick; nothing is shared between jobs
+typedef struct {
+    char root[64];
+    char iso[80];
+    char usb[80];
+} JobMounts;
+
+int enterPrivateMounts();
+void sweepJobMounts();
+int createJobMounts(JobMounts *m);
+void removeJobMounts(JobMounts *m);
+
+#endif
\ No newline at end of file
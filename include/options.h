@@ -0,0 +1,30 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "write.h"
+
+typedef struct {
+    const char *iso;
+    const char *device;
+    int ioprioClass;                // 0 leaves the inherited priority alone
+    int ioprioLevel;
+    unsigned long long bwlimit;     // bytes per second, 0 = unlimited
+    WriteMethod writeMethod;        // raw writes only
+    int skipProbe;
+    int refresh;                    // update an existing stick in place instead of erasing it
+    int fixedIo;                    // no adaptive tuning: 4 MiB chunks, one write in flight
+    int keepQueue;                  // leave the target's block queue settings as they are
+    const char *backupPath;         // image the stick here before anything on it is changed
+    const char *restorePath;        // write this backup to the device instead of an ISO
+    const char *tracePath;          // Chrome trace-event JSON written on exit
+    long long benchBytes;           // > 0 runs the write method benchmark instead of the menu
+    const char *historyPath;        // set by the history subcommand: report on this job history
+} Options;
+
+// Per thread, so library jobs can each run with their own settings
+extern __thread Options options;
+
+int parseOptions(int argc, char *argv[]);
+void printUsage(const char *prog);
+
+#endif
\ No newline at end of file
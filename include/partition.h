@@ -0,0 +1,10 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include "usb.h"
+
+int wipeSignatures(const UsbDevice *dev);
+int partitionStick(UsbDevice *dev);
+long long gptPartitionBytes(long long devSize, long long sectorSize);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdatomic.h>
+
+#include "health.h"
+
+#define MAX_PROGRESS_SLOTS 8
+#define MAX_PHASE_TIMES    12
+
+typedef struct {
+    const char *name;
+    double seconds;
+} PhaseTime;
+
+// One per target device. I/O stages only ever do relaxed atomic adds on these.
+typedef struct {
+    char label[64];
+    char sysfsName[64];             // sampled from /sys/class/block/<name>/stat while kernelTracked
+    unsigned long long sysfsBase;
+    atomic_int kernelTracked;
+    atomic_ullong total;
+    atomic_ullong bytesRead;
+    atomic_ullong bytesWritten;
+    atomic_ullong bytesFlushed;
+    atomic_ullong bytesVerified;
+    atomic_uint queueDepth;
+    _Atomic(const char *) phase;
+    int traceTrack;
+    atomic_int stopRequested;       // cancelled, or the target went away; every I/O stage checks it
+    atomic_int targetGone;
+    LatencyHist latency;            // per-chunk write latency, owned by the target's writer
+    atomic_ullong rateDefault;      // bytes/s reaching the device with the kernel's queue settings
+    atomic_ullong rateTuned;        // and with the tuned ones; 0 until measured
+    PhaseTime phaseTimes[MAX_PHASE_TIMES];  // time spent in each finished phase, kept by progressPhase
+    int phaseCount;
+    double phaseStarted;
+} ProgressSlot;
+
+void progressInit(ProgressSlot *slot, const char *label, unsigned long long total);
+void progressPhase(ProgressSlot *slot, const char *phase);
+void progressAdd(atomic_ullong *counter, unsigned long long bytes);
+int readBlockStat(const char *name, unsigned long long *sectors, unsigned *inflight);
+void progressTrackKernel(ProgressSlot *slot, const char *devName);
+void progressUntrackKernel(ProgressSlot *slot);
+void progressSample(ProgressSlot *slot);
+void progressRequestStop(ProgressSlot *slot);
+int progressStopRequested(ProgressSlot *slot);
+void progressSetDisplay(int enabled);
+
+int progressRegister(ProgressSlot *slot);
+void progressUnregister(ProgressSlot *slot);
+void progressStart();
+void progressStop();
+
+#endif
\ No newline at end of file
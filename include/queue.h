@@ -0,0 +1,35 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "progress.h"
+
+#define QUEUE_SETTINGS 4
+
+typedef struct {
+    char path[128];
+    char saved[64];
+    atomic_int changed;     // cleared by whichever restore gets there first
+} QueueSetting;
+
+// Throughput-oriented queue settings for one target, put back when the job ends
+typedef struct {
+    pthread_t thread;
+    int running;
+    atomic_int stop;
+    char name[64];
+    int priorities;         // I/O priorities are in use, so the profile keeps a scheduler that honours them
+    int verdict;            // 1 kept the write profile, -1 went back to the defaults, 0 undecided
+    ProgressSlot *slot;
+    QueueSetting settings[QUEUE_SETTINGS];
+} QueueTune;
+
+int startQueueTune(QueueTune *q, const char *name, ProgressSlot *slot, int priorities);
+void stopQueueTune(QueueTune *q);
+void queueRestoreOnExit();
+int queueHonoursPriority(const char *path, char *scheduler, size_t len, int *bfqAvailable);
+void queueWarnPriority(const char *path, const char *what, int tuned);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#include "progress.h"
+
+typedef struct {
+    long long unchanged;
+    long long unchangedBytes;
+    long long replaced;
+    long long added;
+    long long deleted;
+    long long hashedBytes;      // read from both sides to prove files equal
+    long long writtenBytes;
+} RefreshStats;
+
+int refreshTree(const char *src, const char *dst, const char *const *skip,
+                ProgressSlot *progress, RefreshStats *stats);
+int copyTree(const char *src, const char *dst, const char *const *skip,
+             ProgressSlot *progress, RefreshStats *stats);
+int flushTree(const char *dst);
+void printRefreshStats(const RefreshStats *stats);
+
+#endif
\ No newline at end of file
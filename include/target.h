@@ -0,0 +1,24 @@
+#ifndef TARGET_H
+#define TARGET_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "usb.h"
+
+// What the write path needs from a backend; picked by UsbDevice.kind
+typedef struct {
+    const char *prefix;
+    int (*open)(const UsbDevice *dev, int flags);
+    int (*write)(int fd, const char *buf, size_t len, off_t off);
+    int (*flush)(int fd);
+    int readable;           // can be read back for verification
+    int blockDevice;        // has sysfs entries and partitions
+} TargetOps;
+
+const TargetOps *targetOps(const UsbDevice *dev);
+int parseTarget(const char *spec, long long imageSize, UsbDevice *dev);
+int prepareTarget(UsbDevice *dev);
+void releaseTarget(UsbDevice *dev);
+
+#endif
\ No newline at end of file
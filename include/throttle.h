@@ -0,0 +1,13 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+
+void throttleSetup(int ioprioClass, int ioprioLevel, unsigned long long bytesPerSec);
+void throttleSetRate(unsigned long long bytesPerSec);
+unsigned long long throttleRate();
+void throttleRead(size_t bytes);
+void throttleWrite(size_t bytes);
+void throttleReport();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,16 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Span timestamps are microseconds since traceOpen(); traceNow() is 0 while tracing is off
+int traceOpen(const char *path);
+int traceEnabled();
+unsigned long long traceNow();
+void traceSpan(const char *cat, const char *name, unsigned long long start, long long bytes);
+void traceSpanOn(int track, const char *cat, const char *name, unsigned long long start, long long bytes);
+int traceTrack(const char *name);
+int traceExecTrack(int pid);
+void tracePhase(int track, const char *phase);
+void traceThreadName(const char *name);
+void traceFlush();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define TUNE_MAX_DEPTH 8
+#define TUNE_MAX_EVENTS 64
+
+typedef struct {
+    double at;              // seconds since the write started
+    unsigned chunk;
+    int depth;
+    double rate;            // MB/s over the window that triggered the change
+    const char *reason;
+} TuneEvent;
+
+typedef struct {
+    int active;             // set by tunerInit; a zeroed tuner reports nothing
+    pthread_mutex_t lock;
+    atomic_uint chunk;      // bytes per read and write
+    atomic_int depth;       // writes in flight per target
+    unsigned minChunk;
+    unsigned maxChunk;
+    double start;
+    double windowStart;
+    long long windowBytes;
+    double windowLatency;
+    int windowOps;
+    double lastRate;
+    int axis;               // knob the next increase moves: 0 depth, 1 chunk
+    int lastAxis;           // knob the last increase moved, -1 if none
+    int plateaus;
+    TuneEvent events[TUNE_MAX_EVENTS];
+    int eventCount;
+    int dropped;
+} Tuner;
+
+void tunerInit(Tuner *t, unsigned minChunk, unsigned maxChunk);
+void tunerDestroy(Tuner *t);
+unsigned tunerChunk(Tuner *t);
+int tunerDepth(Tuner *t);
+void tunerRecord(Tuner *t, long long bytes, double latency);
+void tunerReport(const Tuner *t);
+
+#endif
\ No newline at end of file
@@ -2,18 +2,30 @@
 #define USB_H
 
 #include "iso.h"
+#include "progress.h"
+
+typedef enum {
+    TARGET_BLOCK,       // a real removable disk
+    TARGET_FILE,        // sparse image file
+    TARGET_LOOP,        // image file attached to a loop device
+    TARGET_NULL         // discards everything, counts bytes
+} TargetKind;
 
 typedef struct {
+    TargetKind kind;
+    long long capacity;     // set for non-block targets
     char name[64];
     char size[32];
     char model[128];
     char dev_path[128];
     char part_path[128];
+    char image[128];        // backing file of file: and loop: targets
 } UsbDevice;
 
-int formatUSB(UsbDevice *dev);
-int mountUSB(UsbDevice *dev);
-int unmountUSB();
-int create_bootable(const char *iso, UsbDevice *dev, IsoType type);
+int formatUSB(UsbDevice *dev, const char *srcRoot);
+int mountUSB(UsbDevice *dev, const char *dir);
+int unmountUSB(const char *dir, int lazy);
+int create_bootable(const char *iso, UsbDevice *dev, IsoType type, int hybrid, ProgressSlot *progress);
+int restoreStick(const char *archive, UsbDevice *dev, ProgressSlot *progress);
 
 #endif
\ No newline at end of file
@@ -3,15 +3,24 @@
 
 #include "iso.h"
 #include "devices.h"
+#include "refresh.h"
+#include "mounts.h"
+
+#include <sys/types.h>
 
 int fileExists(const char *path);
 void checkRoot();
 void printTime();
 void flushInput();
 int getCharInput();
-int splitWimIfNeeded();
-int copyFiles(IsoType type);
+int splitWimIfNeeded(const JobMounts *m);
+int copyFiles(IsoType type, const JobMounts *m, ProgressSlot *progress);
+int refreshFiles(IsoType type, const JobMounts *m, ProgressSlot *progress, RefreshStats *stats);
 void formatPartPath(UsbDevice *dev);
+int readSysfsLL(const char *path, long long *value);
+int readFull(int fd, char *buf, size_t len, off_t off);
+int writeFull(int fd, const char *buf, size_t len, off_t off);
+const char *resolveCommand(const char *cmd);
 int commandExists(const char *cmd);
 int checkDependencies(IsoType iso);
 
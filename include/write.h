@@ -0,0 +1,25 @@
+#ifndef WRITE_H
+#define WRITE_H
+
+#include "usb.h"
+#include "progress.h"
+#include "bufpool.h"
+#include "tune.h"
+
+typedef enum {
+    WRITE_BUFFERED,
+    WRITE_DIRECT,
+    WRITE_SPLICE,
+    WRITE_METHOD_COUNT
+} WriteMethod;
+
+int isHybridISO(const char *iso);
+const char *writeMethodName(WriteMethod method);
+int parseWriteMethod(const char *name, WriteMethod *method);
+int writeImages(const char *iso, UsbDevice *devs, ProgressSlot *progress, int count,
+                WriteMethod method, Tuner *tuner, PoolStats *stats);
+int writeImage(const char *iso, UsbDevice *dev, ProgressSlot *progress, WriteMethod method,
+               Tuner *tuner, PoolStats *stats);
+int benchWriteMethods(const char *iso, UsbDevice *dev, long long bytes);
+
+#endif
\ No newline at end of file
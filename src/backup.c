@@ -0,0 +1,791 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "backup.h"
+#include "target.h"
+#include "utils.h"
+#include "trace.h"
+
+#define CHUNK_SIZE      (4 * 1024 * 1024)
+#define ZSTD_LEVEL      3
+#define MAX_WORKERS     8
+
+// zstd seekable format (contrib/seekable_format): every chunk is its own frame, and a trailing
+// skippable frame lists their sizes. Plain zstd -d still decompresses the whole archive.
+#define ZSTD_MAGIC      0xFD2FB528u
+#define SKIPPABLE_MAGIC 0x184D2A5Eu
+#define SEEKABLE_MAGIC  0x8F92EAB1u
+#define SEEK_FOOTER     9
+
+// Loaded at run time, so neither building nor running needs zstd installed
+typedef struct {
+    void *(*createCCtx)(void);
+    size_t (*freeCCtx)(void *cctx);
+    size_t (*compressCCtx)(void *cctx, void *dst, size_t cap, const void *src, size_t len, int level);
+    size_t (*decompress)(void *dst, size_t cap, const void *src, size_t len);
+    size_t (*compressBound)(size_t len);
+    unsigned (*isError)(size_t code);
+} Zstd;
+
+static Zstd zstd;
+static int zstdLoaded = 0;
+static pthread_once_t zstdOnce = PTHREAD_ONCE_INIT;
+
+typedef enum { SLOT_FREE, SLOT_READ, SLOT_BUSY, SLOT_DONE } SlotState;
+
+typedef struct {
+    SlotState state;
+    long long index;
+    char *in;
+    size_t inLen;
+    char *out;              // the zero frame, the input itself (raw) or outBuf
+    char *outBuf;
+    size_t outLen;
+    int zero;
+} Chunk;
+
+typedef struct {
+    Chunk *slots;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    long long chunks;
+    long long nextCompress;
+    long long nextWrite;
+    int failed;
+    int compressed;         // zstd archive rather than a sparse raw image
+    int outFd;
+    long long outPos;
+    uint32_t *frameSizes;   // compressed size of every chunk, for the seek table
+    char *zeroFrame;
+    size_t zeroFrameLen;
+    ProgressSlot *progress;
+} Backup;
+
+static void loadZstd()
+{
+    void *lib = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+
+    if (!lib)
+        return;
+
+    zstd.createCCtx = (void *(*)(void))dlsym(lib, "ZSTD_createCCtx");
+    zstd.freeCCtx = (size_t (*)(void *))dlsym(lib, "ZSTD_freeCCtx");
+    zstd.compressCCtx = (size_t (*)(void *, void *, size_t, const void *, size_t, int))dlsym(lib, "ZSTD_compressCCtx");
+    zstd.decompress = (size_t (*)(void *, size_t, const void *, size_t))dlsym(lib, "ZSTD_decompress");
+    zstd.compressBound = (size_t (*)(size_t))dlsym(lib, "ZSTD_compressBound");
+    zstd.isError = (unsigned (*)(size_t))dlsym(lib, "ZSTD_isError");
+
+    if (zstd.createCCtx && zstd.freeCCtx && zstd.compressCCtx && zstd.decompress &&
+        zstd.compressBound && zstd.isError)
+        zstdLoaded = 1;
+    else
+        dlclose(lib);
+}
+
+static int haveZstd()
+{
+    pthread_once(&zstdOnce, loadZstd);
+    return zstdLoaded;
+}
+
+static void putLe32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t getLe32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int isZero(const char *buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+static long long targetSize(int fd)
+{
+    struct stat st;
+    unsigned long long size;
+
+    if (fstat(fd, &st) != 0)
+        return -1;
+
+    if (S_ISREG(st.st_mode))
+        return st.st_size;
+
+    return ioctl(fd, BLKGETSIZE64, &size) == 0 ? (long long)size : -1;
+}
+
+static void *compressWorker(void *arg)
+{
+    Backup *b = arg;
+    void *cctx = b->compressed ? zstd.createCCtx() : NULL;
+
+    traceThreadName("backup compressor");
+
+    pthread_mutex_lock(&b->lock);
+
+    while (!b->failed && b->nextCompress < b->chunks)
+    {
+        Chunk *c = &b->slots[b->nextCompress % b->count];
+
+        if (c->state != SLOT_READ || c->index != b->nextCompress)
+        {
+            pthread_cond_wait(&b->changed, &b->lock);
+            continue;
+        }
+
+        c->state = SLOT_BUSY;
+        b->nextCompress++;
+        pthread_mutex_unlock(&b->lock);
+
+        int ok = 1;
+
+        // Every zero chunk of full size shares one frame, compressed once up front
+        if (!b->compressed)
+        {
+            c->out = c->in;
+            c->outLen = c->inLen;
+        }
+        else if (c->zero && c->inLen == CHUNK_SIZE)
+        {
+            c->out = b->zeroFrame;
+            c->outLen = b->zeroFrameLen;
+        }
+        else
+        {
+            unsigned long long traced = traceNow();
+            size_t n = cctx ? zstd.compressCCtx(cctx, c->outBuf, zstd.compressBound(CHUNK_SIZE),
+                                                c->in, c->inLen, ZSTD_LEVEL) : 0;
+
+            ok = cctx && !zstd.isError(n);
+            c->out = c->outBuf;
+            c->outLen = n;
+            traceSpan("cpu", "compress", traced, c->inLen);
+        }
+
+        pthread_mutex_lock(&b->lock);
+
+        if (!ok)
+            b->failed = 1;
+
+        c->state = SLOT_DONE;
+        pthread_cond_broadcast(&b->changed);
+    }
+
+    pthread_mutex_unlock(&b->lock);
+
+    if (cctx)
+        zstd.freeCCtx(cctx);
+
+    return NULL;
+}
+
+// Appends frames in chunk order; a raw image gets holes where the stick was zero
+static void *archiveWriter(void *arg)
+{
+    Backup *b = arg;
+
+    traceThreadName("backup writer");
+
+    pthread_mutex_lock(&b->lock);
+
+    while (!b->failed && b->nextWrite < b->chunks)
+    {
+        Chunk *c = &b->slots[b->nextWrite % b->count];
+
+        if (c->state != SLOT_DONE || c->index != b->nextWrite)
+        {
+            pthread_cond_wait(&b->changed, &b->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&b->lock);
+
+        int res = 0;
+        unsigned long long traced = traceNow();
+
+        if (b->compressed)
+        {
+            res = writeFull(b->outFd, c->out, c->outLen, b->outPos);
+            b->frameSizes[c->index] = c->outLen;
+            b->outPos += c->outLen;
+        }
+        else if (!c->zero)
+            res = writeFull(b->outFd, c->out, c->outLen, c->index * (long long)CHUNK_SIZE);
+
+        traceSpan("io", "archive write", traced, c->outLen);
+
+        pthread_mutex_lock(&b->lock);
+
+        if (res != 0)
+        {
+            perror("Failed to write backup");
+            b->failed = 1;
+        }
+
+        c->state = SLOT_FREE;
+        b->nextWrite++;
+        pthread_cond_broadcast(&b->changed);
+    }
+
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+static int writeSeekTable(Backup *b, long long size)
+{
+    size_t entries = b->chunks * 8;
+    size_t len = 8 + entries + SEEK_FOOTER;
+    unsigned char *table = malloc(len);
+
+    if (!table)
+        return -1;
+
+    putLe32(table, SKIPPABLE_MAGIC);
+    putLe32(table + 4, len - 8);
+
+    for (long long i = 0; i < b->chunks; i++)
+    {
+        long long chunk = size - i * CHUNK_SIZE < CHUNK_SIZE ? size - i * CHUNK_SIZE : CHUNK_SIZE;
+
+        putLe32(table + 8 + i * 8, b->frameSizes[i]);
+        putLe32(table + 12 + i * 8, chunk);
+    }
+
+    // No per-frame checksums; the frames carry none either
+    putLe32(table + 8 + entries, b->chunks);
+    table[8 + entries + 4] = 0;
+    putLe32(table + 8 + entries + 5, SEEKABLE_MAGIC);
+
+    int res = writeFull(b->outFd, (char *)table, len, b->outPos);
+    free(table);
+
+    return res;
+}
+
+static void freeSlots(Backup *b)
+{
+    for (int i = 0; i < b->count; i++)
+    {
+        free(b->slots[i].in);
+        free(b->slots[i].outBuf);
+    }
+
+    free(b->slots);
+}
+
+static int allocSlots(Backup *b, int count)
+{
+    b->slots = calloc(count, sizeof(*b->slots));
+
+    if (!b->slots)
+        return -1;
+
+    b->count = count;
+
+    for (int i = 0; i < count; i++)
+    {
+        // Aligned for O_DIRECT reads from the stick
+        if (posix_memalign((void **)&b->slots[i].in, 4096, CHUNK_SIZE) != 0)
+            return -1;
+
+        if (b->compressed && !(b->slots[i].outBuf = malloc(zstd.compressBound(CHUNK_SIZE))))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int makeZeroFrame(Backup *b)
+{
+    char *zeros = calloc(1, CHUNK_SIZE);
+    void *cctx = zstd.createCCtx();
+    size_t cap = zstd.compressBound(CHUNK_SIZE);
+
+    b->zeroFrame = malloc(cap);
+
+    size_t n = zeros && cctx && b->zeroFrame ?
+               zstd.compressCCtx(cctx, b->zeroFrame, cap, zeros, CHUNK_SIZE, ZSTD_LEVEL) : 0;
+
+    if (cctx)
+        zstd.freeCCtx(cctx);
+    free(zeros);
+
+    if (n == 0 || zstd.isError(n))
+        return -1;
+
+    b->zeroFrameLen = n;
+    return 0;
+}
+
+static int openSource(const UsbDevice *dev)
+{
+    // Bypassing the page cache keeps a whole stick's worth of data from evicting everything else
+    int fd = open(dev->dev_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+
+    if (fd < 0 && errno == EINVAL)
+        fd = open(dev->dev_path, O_RDONLY | O_CLOEXEC);
+
+    return fd;
+}
+
+// Reads the whole device once, in order, while the compressors and the writer keep up behind
+int backupDevice(const UsbDevice *dev, const char *archive, ProgressSlot *progress)
+{
+    unsigned long long traced = traceNow();
+    Backup b = {0};
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_WORKERS)
+        threads = MAX_WORKERS;
+
+    b.compressed = haveZstd();
+    b.progress = progress;
+
+    int inFd = openSource(dev);
+
+    if (inFd < 0)
+    {
+        perror("Failed to open device for backup");
+        return -1;
+    }
+
+    long long size = targetSize(inFd);
+
+    // Never overwrite an earlier backup
+    b.outFd = open(archive, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+    if (size <= 0 || b.outFd < 0)
+    {
+        perror(size <= 0 ? "Failed to get device size" : "Failed to create backup file");
+        close(inFd);
+
+        if (b.outFd >= 0)
+            close(b.outFd);
+
+        return -1;
+    }
+
+    b.chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    b.frameSizes = calloc(b.chunks, sizeof(*b.frameSizes));
+
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.changed, NULL);
+
+    int res = 0;
+
+    if (!b.frameSizes || allocSlots(&b, threads * 2) != 0 || (b.compressed && makeZeroFrame(&b) != 0))
+    {
+        fprintf(stderr, "Failed to set up backup buffers\n");
+        res = -1;
+    }
+
+    pthread_t workers[MAX_WORKERS], writer;
+    int started = 0, writerStarted = 0;
+
+    if (res == 0)
+        writerStarted = pthread_create(&writer, NULL, archiveWriter, &b) == 0;
+
+    for (int i = 0; res == 0 && writerStarted && i < threads; i++)
+    {
+        if (pthread_create(&workers[i], NULL, compressWorker, &b) == 0)
+            started++;
+    }
+
+    if (res == 0 && (!writerStarted || started == 0))
+        res = -1;
+
+    if (res == 0)
+    {
+        printf("Backing up %s (%.1f GiB) to %s, %s\n", dev->dev_path, size / 1073741824.0, archive,
+               b.compressed ? "zstd seekable" : "sparse raw image (libzstd not found)");
+
+        progressPhase(progress, "backing up");
+        atomic_store(&progress->total, size);
+    }
+
+    long long zeroChunks = 0;
+
+    for (long long i = 0; res == 0 && i < b.chunks; i++)
+    {
+        Chunk *c = &b.slots[i % b.count];
+
+        pthread_mutex_lock(&b.lock);
+
+        while (!b.failed && c->state != SLOT_FREE)
+            pthread_cond_wait(&b.changed, &b.lock);
+
+        pthread_mutex_unlock(&b.lock);
+
+        if (b.failed || progressStopRequested(progress))
+        {
+            res = -1;
+            break;
+        }
+
+        long long off = i * CHUNK_SIZE;
+        size_t len = size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE;
+        unsigned long long readTraced = traceNow();
+
+        if (readFull(inFd, c->in, len, off) != 0)
+        {
+            perror("Backup read failed");
+            res = -1;
+            break;
+        }
+
+        traceSpan("io", "backup read", readTraced, len);
+        progressAdd(&progress->bytesRead, len);
+
+        c->index = i;
+        c->inLen = len;
+        c->zero = isZero(c->in, len);
+        zeroChunks += c->zero;
+
+        pthread_mutex_lock(&b.lock);
+        c->state = SLOT_READ;
+        pthread_cond_broadcast(&b.changed);
+        pthread_mutex_unlock(&b.lock);
+    }
+
+    pthread_mutex_lock(&b.lock);
+
+    if (res != 0)
+        b.failed = 1;
+
+    pthread_cond_broadcast(&b.changed);
+    pthread_mutex_unlock(&b.lock);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    if (writerStarted)
+        pthread_join(writer, NULL);
+
+    if (b.failed)
+        res = -1;
+
+    if (res == 0)
+    {
+        if (b.compressed)
+            res = writeSeekTable(&b, size);
+        else
+            res = ftruncate(b.outFd, size);
+    }
+
+    if (res == 0 && fdatasync(b.outFd) != 0)
+        res = -1;
+
+    close(inFd);
+    close(b.outFd);
+
+    if (res != 0)
+    {
+        fprintf(stderr, "Backup of %s failed, removing %s\n", dev->dev_path, archive);
+        unlink(archive);
+    }
+    else
+        printf("Backup done: %lld of %lld chunks were empty, archive is %.1f MiB\n",
+               zeroChunks, b.chunks, (b.compressed ? b.outPos : (size - zeroChunks * CHUNK_SIZE)) / 1048576.0);
+
+    traceSpan("job", res == 0 ? "backup" : "backup (failed)", traced, size);
+
+    if (b.slots)
+        freeSlots(&b);
+    free(b.frameSizes);
+    free(b.zeroFrame);
+    pthread_cond_destroy(&b.changed);
+    pthread_mutex_destroy(&b.lock);
+
+    return res;
+}
+
+// Zero ranges are handed to the device to clear itself where it can
+static int writeZeros(const TargetOps *ops, int fd, const char *buf, size_t len, long long off)
+{
+    uint64_t range[2] = {off, len};
+
+    if (ops->blockDevice && ioctl(fd, BLKZEROOUT, range) == 0)
+        return 0;
+
+    return ops->write(fd, buf, len, off);
+}
+
+// Returns the seek table entries (compressed, decompressed size pairs) and the image size they add up to
+static unsigned char *readSeekTable(int fd, long long archiveSize, long long *frames, long long *size)
+{
+    unsigned char footer[SEEK_FOOTER];
+
+    if (archiveSize < SEEK_FOOTER || readFull(fd, (char *)footer, SEEK_FOOTER, archiveSize - SEEK_FOOTER) != 0 ||
+        getLe32(footer + 5) != SEEKABLE_MAGIC || (footer[4] & 0x80))
+    {
+        fprintf(stderr, "Backup has no seek table, or one with checksums this tool does not write\n");
+        return NULL;
+    }
+
+    *frames = getLe32(footer);
+
+    long long tableLen = 8 + *frames * 8 + SEEK_FOOTER;
+    unsigned char *table = malloc(*frames * 8 + 1);
+
+    if (!table || tableLen > archiveSize ||
+        readFull(fd, (char *)table, *frames * 8, archiveSize - SEEK_FOOTER - *frames * 8) != 0)
+    {
+        fprintf(stderr, "Backup seek table unreadable\n");
+        free(table);
+        return NULL;
+    }
+
+    *size = 0;
+
+    for (long long i = 0; i < *frames; i++)
+        *size += getLe32(table + i * 8 + 4);
+
+    return table;
+}
+
+static int isCompressed(int fd, long long archiveSize)
+{
+    unsigned char magic[4];
+    return archiveSize >= 4 && readFull(fd, (char *)magic, 4, 0) == 0 && getLe32(magic) == ZSTD_MAGIC;
+}
+
+// Size of the device the backup was taken from, -1 if the file is not a usable backup
+long long backupImageSize(const char *archive)
+{
+    int fd = open(archive, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    long long frames, size = -1;
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+
+        return -1;
+    }
+
+    if (!isCompressed(fd, st.st_size))
+        size = st.st_size;
+    else
+    {
+        unsigned char *table = readSeekTable(fd, st.st_size, &frames, &size);
+
+        if (!table)
+            size = -1;
+
+        free(table);
+    }
+
+    close(fd);
+    return size;
+}
+
+static int restoreCompressed(int inFd, long long archiveSize, const TargetOps *ops, int outFd,
+                             long long capacity, ProgressSlot *progress)
+{
+    long long frames, size;
+    unsigned char *table = readSeekTable(inFd, archiveSize, &frames, &size);
+
+    if (!table)
+        return -1;
+
+    if (size > capacity)
+    {
+        fprintf(stderr, "Backup holds %lld bytes, the target only %lld\n", size, capacity);
+        free(table);
+        return -1;
+    }
+
+    atomic_store(&progress->total, size);
+
+    char *in = malloc(zstd.compressBound(CHUNK_SIZE));
+    char *out = NULL;
+    long long inPos = 0, outPos = 0;
+    int res = in && posix_memalign((void **)&out, 4096, CHUNK_SIZE) == 0 ? 0 : -1;
+
+    for (long long i = 0; res == 0 && i < frames; i++)
+    {
+        uint32_t frameLen = getLe32(table + i * 8);
+        uint32_t chunk = getLe32(table + i * 8 + 4);
+
+        if (progressStopRequested(progress) || frameLen > zstd.compressBound(CHUNK_SIZE) || chunk > CHUNK_SIZE ||
+            readFull(inFd, in, frameLen, inPos) != 0)
+        {
+            res = -1;
+            break;
+        }
+
+        size_t n = zstd.decompress(out, CHUNK_SIZE, in, frameLen);
+
+        if (zstd.isError(n) || n != chunk)
+        {
+            fprintf(stderr, "Backup frame %lld is damaged\n", i);
+            res = -1;
+            break;
+        }
+
+        progressAdd(&progress->bytesRead, frameLen);
+
+        if ((isZero(out, n) ? writeZeros(ops, outFd, out, n, outPos) : ops->write(outFd, out, n, outPos)) != 0)
+        {
+            perror("Restore write failed");
+            res = -1;
+            break;
+        }
+
+        progressAdd(&progress->bytesWritten, n);
+        inPos += frameLen;
+        outPos += n;
+    }
+
+    free(out);
+    free(in);
+    free(table);
+
+    return res;
+}
+
+// A sparse raw image: only the data extents are read, holes are cleared on the target
+static int restoreRaw(int inFd, long long size, const TargetOps *ops, int outFd, long long capacity,
+                      ProgressSlot *progress)
+{
+    if (size > capacity)
+    {
+        fprintf(stderr, "Backup holds %lld bytes, the target only %lld\n", size, capacity);
+        return -1;
+    }
+
+    atomic_store(&progress->total, size);
+
+    char *buf = NULL;
+    char *zeros = calloc(1, CHUNK_SIZE);
+    int res = zeros && posix_memalign((void **)&buf, 4096, CHUNK_SIZE) == 0 ? 0 : -1;
+
+    for (long long off = 0; res == 0 && off < size; )
+    {
+        long long data = lseek(inFd, off, SEEK_DATA);
+
+        if (data < 0)
+            data = size;
+
+        // The hole up to the next data extent
+        while (res == 0 && off < data)
+        {
+            size_t len = data - off < CHUNK_SIZE ? data - off : CHUNK_SIZE;
+
+            res = writeZeros(ops, outFd, zeros, len, off);
+            progressAdd(&progress->bytesWritten, len);
+            off += len;
+        }
+
+        long long hole = off < size ? lseek(inFd, off, SEEK_HOLE) : size;
+
+        if (hole < 0)
+            hole = size;
+
+        while (res == 0 && off < hole)
+        {
+            size_t len = hole - off < CHUNK_SIZE ? hole - off : CHUNK_SIZE;
+
+            if (progressStopRequested(progress) || readFull(inFd, buf, len, off) != 0 ||
+                ops->write(outFd, buf, len, off) != 0)
+                res = -1;
+
+            progressAdd(&progress->bytesRead, len);
+            progressAdd(&progress->bytesWritten, len);
+            off += len;
+        }
+    }
+
+    free(buf);
+    free(zeros);
+
+    return res;
+}
+
+// Writes an archive made by backupDevice back, whichever of the two formats it is in
+int restoreDevice(const char *archive, const UsbDevice *dev, ProgressSlot *progress)
+{
+    unsigned long long traced = traceNow();
+    const TargetOps *ops = targetOps(dev);
+    int inFd = open(archive, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (inFd < 0 || fstat(inFd, &st) != 0)
+    {
+        perror("Failed to open backup");
+
+        if (inFd >= 0)
+            close(inFd);
+
+        return -1;
+    }
+
+    int compressed = isCompressed(inFd, st.st_size);
+
+    if (compressed && !haveZstd())
+    {
+        fprintf(stderr, "%s is zstd compressed, but libzstd.so.1 is not installed\n", archive);
+        close(inFd);
+        return -1;
+    }
+
+    int outFd = ops->open(dev, O_WRONLY);
+
+    if (outFd < 0)
+    {
+        perror("Failed to open target for restore");
+        close(inFd);
+        return -1;
+    }
+
+    long long capacity = targetSize(outFd);
+
+    // file: targets grow as needed
+    if (dev->kind == TARGET_FILE || dev->kind == TARGET_NULL)
+        capacity = LLONG_MAX;
+
+    printf("Restoring %s to %s\n", archive, dev->dev_path);
+    progressPhase(progress, "restoring");
+
+    int res = compressed ? restoreCompressed(inFd, st.st_size, ops, outFd, capacity, progress) :
+                           restoreRaw(inFd, st.st_size, ops, outFd, capacity, progress);
+
+    if (res == 0)
+    {
+        progressPhase(progress, "flushing");
+        res = ops->flush(outFd);
+    }
+
+    close(outFd);
+    close(inFd);
+
+    progressPhase(progress, res == 0 ? "done" : "failed");
+    traceSpan("job", res == 0 ? "restore" : "restore (failed)", traced, st.st_size);
+
+    if (res != 0)
+        fprintf(stderr, "Restore of %s to %s failed\n", archive, dev->dev_path);
+
+    return res;
+}
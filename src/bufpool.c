@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "bufpool.h"
+#include "trace.h"
+
+#define HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+static unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// One arena per job: every buffer is a slice of it, so nothing is allocated on the data path
+int poolCreate(BufferPool *pool, int count, size_t bufSize, int hugepages)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    size_t size = (size_t)count * bufSize;
+    char *arena = MAP_FAILED;
+
+    if (hugepages)
+    {
+        size_t huge = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+        arena = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (arena != MAP_FAILED)
+            size = huge;
+    }
+
+    if (arena == MAP_FAILED)
+    {
+        hugepages = 0;
+        arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (arena == MAP_FAILED)
+        {
+            perror("Buffer pool allocation failed");
+            return -1;
+        }
+
+        // Transparent hugepages are the next best thing to a hugetlb pool
+        madvise(arena, size, MADV_HUGEPAGE);
+    }
+
+    pool->bufs = calloc(count, sizeof(IoBuffer));
+
+    if (!pool->bufs)
+    {
+        munmap(arena, size);
+        return -1;
+    }
+
+    pool->arena = arena;
+    pool->arenaSize = size;
+    pool->count = count;
+    pool->bufSize = bufSize;
+    pool->hugepages = hugepages;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+        IoBuffer *buf = &pool->bufs[i];
+
+        buf->data = arena + (size_t)i * bufSize;
+        buf->cap = bufSize;
+        buf->pool = pool;
+        buf->next = pool->freeList;
+        pool->freeList = buf;
+    }
+
+    pool->freeCount = count;
+    return 0;
+}
+
+void poolDestroy(BufferPool *pool)
+{
+    if (!pool->bufs)
+        return;
+
+    munmap(pool->arena, pool->arenaSize);
+    free(pool->bufs);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->available);
+    pool->bufs = NULL;
+}
+
+// Blocks until a buffer is free; the wait is counted as a stall
+IoBuffer *poolAcquire(BufferPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    pool->acquires++;
+
+    if (!pool->freeList)
+    {
+        unsigned long long start = nowNs();
+        unsigned long long traced = traceNow();
+
+        pool->stalls++;
+
+        while (!pool->freeList)
+            pthread_cond_wait(&pool->available, &pool->lock);
+
+        pool->stallNs += nowNs() - start;
+
+        if (traced)
+            traceSpan("pool", "buffer stall", traced, -1);
+    }
+
+    IoBuffer *buf = pool->freeList;
+    pool->freeList = buf->next;
+    pool->freeCount--;
+
+    if (pool->count - pool->freeCount > pool->peakInUse)
+        pool->peakInUse = pool->count - pool->freeCount;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    buf->next = NULL;
+    buf->len = 0;
+    atomic_store(&buf->refs, 1);
+
+    return buf;
+}
+
+// Hands the buffer to several consumers; each one calls bufferRelease() when done
+void bufferShare(IoBuffer *buf, int consumers)
+{
+    atomic_store(&buf->refs, consumers);
+}
+
+void bufferRelease(IoBuffer *buf)
+{
+    if (atomic_fetch_sub(&buf->refs, 1) != 1)
+        return;
+
+    BufferPool *pool = buf->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    buf->next = pool->freeList;
+    pool->freeList = buf;
+    pool->freeCount++;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void poolStats(BufferPool *pool, PoolStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    stats->count = pool->count;
+    stats->bufSize = pool->bufSize;
+    stats->hugepages = pool->hugepages;
+    stats->inUse = pool->count - pool->freeCount;
+    stats->peakInUse = pool->peakInUse;
+    stats->acquires = pool->acquires;
+    stats->stalls = pool->stalls;
+    stats->stallSeconds = pool->stallNs / 1e9;
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void printPoolStats(const PoolStats *stats)
+{
+    printf("Buffer pool: %d x %zu KiB%s, peak %d in use, %llu of %llu acquires stalled (%.2f s)\n",
+           stats->count, stats->bufSize / 1024, stats->hugepages ? " (hugepages)" : "",
+           stats->peakInUse, stats->stalls, stats->acquires, stats->stallSeconds);
+}
+
+int queueInit(BufQueue *q, int cap)
+{
+    memset(q, 0, sizeof(*q));
+
+    q->items = calloc(cap, sizeof(IoBuffer *));
+
+    if (!q->items)
+        return -1;
+
+    q->cap = cap;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+
+    return 0;
+}
+
+void queueDestroy(BufQueue *q)
+{
+    free(q->items);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notEmpty);
+    pthread_cond_destroy(&q->notFull);
+}
+
+// NULL is a valid item and marks the end of the stream
+void queuePush(BufQueue *q, IoBuffer *buf)
+{
+    pthread_mutex_lock(&q->lock);
+
+    while (q->len == q->cap)
+        pthread_cond_wait(&q->notFull, &q->lock);
+
+    q->items[(q->head + q->len) % q->cap] = buf;
+    q->len++;
+
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+IoBuffer *queuePop(BufQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+
+    while (q->len == 0)
+        pthread_cond_wait(&q->notEmpty, &q->lock);
+
+    IoBuffer *buf = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->len--;
+
+    pthread_cond_signal(&q->notFull);
+    pthread_mutex_unlock(&q->lock);
+
+    return buf;
+}
+
+int queueLength(BufQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    int len = q->len;
+    pthread_mutex_unlock(&q->lock);
+
+    return len;
+}
\ No newline at end of file
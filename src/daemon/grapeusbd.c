@@ -0,0 +1,689 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "grapeusb.h"
+#include "hotplug.h"
+#include "isocache.h"
+#include "mounts.h"
+#include "utils.h"
+
+#define DEFAULT_SOCKET "/run/grapeusb/grapeusbd.sock"
+#define MAX_CLIENTS 16
+#define MAX_JOBS 16
+#define LINE_MAX_LEN 4608
+#define WATCH_INTERVAL_MS 500
+#define OUT_MAX 131072      // replies queued for a client that is slow to read them
+
+typedef struct {
+    int fd;
+    char buf[LINE_MAX_LEN];
+    size_t len;
+    char out[OUT_MAX];
+    size_t outLen;
+    int watchJob;           // job id streamed to this client, 0 if none
+    int waiting;            // the command at the head of buf waits for an ISO inspection
+} Client;
+
+typedef struct {
+    int id;
+    GrapeJob *job;
+    char iso[4096];
+    char device[256];
+} Job;
+
+static Client clients[MAX_CLIENTS];
+static Job jobs[MAX_JOBS];
+static int nextJobId = 1;
+static volatile sig_atomic_t stopping = 0;
+
+static const char *stateNames[] = {"running", "done", "failed", "cancelled"};
+static const char *pinNames[] = {"none", "loading", "pinned", "failed", "dropped"};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// sdb and /dev/sdb name the same stick
+static const char *deviceKey(const char *device)
+{
+    return strncmp(device, "/dev/", 5) == 0 ? device + 5 : device;
+}
+
+static void onStop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+static void printDaemonUsage(const char *prog)
+{
+    printf("Usage: %s [options]\n\n", prog);
+    printf("Options:\n");
+    printf("  --socket=PATH      listen on PATH (default %s)\n", DEFAULT_SOCKET);
+    printf("  --pin-budget=MB    memory for pinning frequently used ISOs (default 0, off)\n");
+}
+
+static int openSocket(const char *path)
+{
+    struct sockaddr_un addr = {0};
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+    {
+        perror("socket failed");
+        return -1;
+    }
+
+    // Jobs erase disks, so only root may talk to the daemon
+    unlink(path);
+    mode_t old = umask(0077);
+    int res = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old);
+
+    if (res != 0 || listen(fd, MAX_CLIENTS) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void closeClient(Client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+// Writes what the socket takes without blocking; the rest waits for POLLOUT
+static void flushClient(Client *c)
+{
+    size_t sent = 0;
+
+    while (sent < c->outLen)
+    {
+        ssize_t n = write(c->fd, c->out + sent, c->outLen - sent);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (n <= 0)
+        {
+            closeClient(c);
+            return;
+        }
+
+        sent += n;
+    }
+
+    c->outLen -= sent;
+    memmove(c->out, c->out + sent, c->outLen);
+}
+
+// Queues a reply; a client that lets OUT_MAX pile up is dropped rather than stalling the loop
+static void reply(Client *c, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (c->fd < 0)
+        return;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(c->out + c->outLen, sizeof(c->out) - c->outLen, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t)n >= sizeof(c->out) - c->outLen)
+    {
+        fprintf(stderr, "Client is not reading its replies, dropping it\n");
+        closeClient(c);
+        return;
+    }
+
+    c->outLen += n;
+}
+
+static Job *findJob(int id)
+{
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        if (jobs[i].job && jobs[i].id == id)
+            return &jobs[i];
+    }
+
+    return NULL;
+}
+
+// A free slot, or the oldest finished job, which is forgotten
+static Job *allocJob()
+{
+    Job *oldest = NULL;
+
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        if (!jobs[i].job)
+            return &jobs[i];
+
+        GrapeMetrics m;
+        grapeJobPoll(jobs[i].job, &m);
+
+        if (m.state != GRAPE_JOB_RUNNING && (!oldest || jobs[i].id < oldest->id))
+            oldest = &jobs[i];
+    }
+
+    if (oldest)
+    {
+        grapeJobFree(oldest->job);
+        oldest->job = NULL;
+    }
+
+    return oldest;
+}
+
+static void sendJobStatus(Client *c, Job *j)
+{
+    GrapeMetrics m;
+    grapeJobPoll(j->job, &m);
+
+    reply(c, "job=%d state=%s phase=%s total=%llu read=%llu written=%llu flushed=%llu verified=%llu "
+                "elapsed=%.1f rate=%.0f default-rate=%.0f tuned-rate=%.0f p99us=%llu p99-of=%s device=%s\n",
+            j->id, stateNames[m.state], m.phase, m.total, m.bytesRead, m.bytesWritten, m.bytesFlushed,
+            m.bytesVerified, m.elapsed, m.rate, m.rateDefault, m.rateTuned, m.latencyP99, m.latencySource,
+            j->device);
+
+    if (m.state != GRAPE_JOB_RUNNING && grapeJobError(j->job))
+        reply(c, "job=%d error=%s\n", j->id, grapeJobError(j->job));
+}
+
+static void cmdDevices(Client *c)
+{
+    UsbDevice list[MAX_DEVICES];
+    int n = deviceTableSnapshot(list, MAX_DEVICES);
+
+    for (int i = 0; i < n; i++)
+        reply(c, "device=%s path=%s size=%s model=%s\n",
+                list[i].name, list[i].dev_path, list[i].size, list[i].model);
+
+    reply(c, "ok %d\n", n);
+}
+
+static void sendIso(Client *c, IsoEntry *e)
+{
+    if (isoCacheInspecting(e))
+    {
+        reply(c, "iso=%s inspecting=1 size=%lld uses=%d pin=%s\n",
+                e->path, e->size, e->uses, pinNames[isoCachePinState(e)]);
+        return;
+    }
+
+    reply(c, "iso=%s valid=%d type=%s hybrid=%d size=%lld uses=%d pin=%s\n",
+            e->path, e->valid, e->type == ISO_WINDOWS ? "windows" : e->type == ISO_LINUX ? "linux" : "unknown",
+            e->hybrid, e->size, e->uses, pinNames[isoCachePinState(e)]);
+}
+
+static void cmdIsos(Client *c)
+{
+    IsoEntry *list[ISO_CACHE_SIZE];
+    int n = isoCacheList(list, ISO_CACHE_SIZE);
+
+    for (int i = 0; i < n; i++)
+        sendIso(c, list[i]);
+
+    reply(c, "ok %d pinned=%lld budget=%lld\n", n, isoCachePinned(), isoCacheBudget());
+}
+
+// start [refresh] [skip-probe] [no-tune] [keep-queue] [method=M] [backup=FILE] DEVICE ISO, the ISO path taking the rest of the line;
+// returns 1 when the image is still being inspected and the command has to run again later
+static int cmdStart(Client *c, char *args)
+{
+    GrapeJobConfig config = {0};
+    char *tok;
+
+    while ((tok = strsep(&args, " ")) != NULL)
+    {
+        if (*tok == '\0')
+            continue;
+        else if (strcmp(tok, "refresh") == 0)
+            config.refresh = 1;
+        else if (strcmp(tok, "skip-probe") == 0)
+            config.skipProbe = 1;
+        else if (strcmp(tok, "no-tune") == 0)
+            config.fixedIo = 1;
+        else if (strcmp(tok, "keep-queue") == 0)
+            config.keepQueue = 1;
+        else if (strncmp(tok, "method=", 7) == 0)
+            config.writeMethod = tok + 7;
+        else if (strncmp(tok, "backup=", 7) == 0)
+            config.backupPath = tok + 7;
+        else
+        {
+            config.device = tok;
+            break;
+        }
+    }
+
+    config.iso = args;
+
+    if (!config.device || !config.iso || *config.iso == '\0')
+    {
+        reply(c, "error usage: start [refresh] [skip-probe] [no-tune] [keep-queue] [method=M] [backup=FILE] DEVICE ISO\n");
+        return 0;
+    }
+
+    IsoEntry *e = isoCacheLookup(config.iso);
+
+    if (e && isoCacheInspecting(e))
+        return 1;
+
+    if (!e || !e->valid)
+    {
+        reply(c, "error not a valid ISO image: %s\n", config.iso);
+        return 0;
+    }
+
+    // Two running jobs on one stick would only destroy each other's work
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        GrapeMetrics m;
+
+        if (!jobs[i].job || strcmp(jobs[i].device, deviceKey(config.device)) != 0)
+            continue;
+
+        grapeJobPoll(jobs[i].job, &m);
+
+        if (m.state == GRAPE_JOB_RUNNING)
+        {
+            reply(c, "error %s is busy with job %d\n", config.device, jobs[i].id);
+            return 0;
+        }
+    }
+
+    Job *j = allocJob();
+
+    if (!j)
+    {
+        reply(c, "error too many running jobs\n");
+        return 0;
+    }
+
+    isoCacheUse(e);
+
+    // The job gets its own copy, the entry may be refreshed while it runs
+    config.layout = &e->layout;
+    j->job = grapeJobStart(&config);
+
+    if (!j->job)
+    {
+        reply(c, "error failed to start job: %s\n", strerror(errno));
+        return 0;
+    }
+
+    j->id = nextJobId++;
+    snprintf(j->iso, sizeof(j->iso), "%s", config.iso);
+    snprintf(j->device, sizeof(j->device), "%s", deviceKey(config.device));
+
+    reply(c, "ok job=%d\n", j->id);
+    return 0;
+}
+
+// Returns 1 when the command waits for an ISO inspection; nothing has been replied then
+static int handleLine(Client *c, char *line)
+{
+    char *args = line;
+    char *cmd = strsep(&args, " ");
+
+    if (strcmp(cmd, "devices") == 0)
+        cmdDevices(c);
+    else if (strcmp(cmd, "isos") == 0)
+        cmdIsos(c);
+    else if (strcmp(cmd, "inspect") == 0 || strcmp(cmd, "pin") == 0 || strcmp(cmd, "unpin") == 0)
+    {
+        IsoEntry *e = args ? isoCacheLookup(args) : NULL;
+
+        if (e && isoCacheInspecting(e))
+            return 1;
+
+        if (!e)
+            reply(c, "error no such file\n");
+        else if (cmd[0] == 'p' && isoCachePin(e) != 0)
+            reply(c, "error %lld bytes do not fit the pin budget of %lld\n", e->size, isoCacheBudget());
+        else
+        {
+            if (cmd[0] == 'u')
+                isoCacheUnpin(e);
+
+            sendIso(c, e);
+            reply(c, "ok\n");
+        }
+    }
+    else if (strcmp(cmd, "start") == 0)
+        return cmdStart(c, args);
+    else if (strcmp(cmd, "jobs") == 0)
+    {
+        int n = 0;
+
+        for (int i = 0; i < MAX_JOBS; i++)
+        {
+            if (jobs[i].job)
+            {
+                sendJobStatus(c, &jobs[i]);
+                n++;
+            }
+        }
+
+        reply(c, "ok %d\n", n);
+    }
+    else if (strcmp(cmd, "status") == 0 || strcmp(cmd, "watch") == 0 || strcmp(cmd, "cancel") == 0)
+    {
+        Job *j = findJob(args ? atoi(args) : 0);
+
+        if (!j)
+            reply(c, "error no such job\n");
+        else if (cmd[0] == 'w')
+        {
+            // Streamed from the main loop until the job ends
+            c->watchJob = j->id;
+            sendJobStatus(c, j);
+        }
+        else
+        {
+            if (cmd[0] == 'c')
+                grapeJobCancel(j->job);
+
+            sendJobStatus(c, j);
+            reply(c, "ok\n");
+        }
+    }
+    else if (strcmp(cmd, "quit") == 0)
+        stopping = 1;
+    else
+        reply(c, "error commands: devices, isos, inspect|pin|unpin ISO, start ..., jobs, status|watch|cancel ID, quit\n");
+
+    return 0;
+}
+
+// Runs the complete lines in order; one that has to wait stays at the head of buf for the next try
+static void handleLines(Client *c)
+{
+    char *nl;
+
+    while (c->fd >= 0 && !c->waiting && (nl = strchr(c->buf, '\n')) != NULL)
+    {
+        char line[LINE_MAX_LEN];
+        size_t len = nl - c->buf;
+
+        // Parsing cuts the line up, so it works on a copy
+        memcpy(line, c->buf, len);
+        line[len] = '\0';
+
+        if (len > 0 && line[len - 1] == '\r')
+            line[len - 1] = '\0';
+
+        if (line[0] != '\0' && handleLine(c, line))
+        {
+            c->waiting = 1;
+            break;
+        }
+
+        c->len -= len + 1;
+        memmove(c->buf, nl + 1, c->len + 1);
+    }
+}
+
+static void readClient(Client *c)
+{
+    ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+
+    if (n <= 0)
+    {
+        closeClient(c);
+        return;
+    }
+
+    c->len += n;
+    c->buf[c->len] = '\0';
+
+    handleLines(c);
+
+    if (c->fd >= 0 && !c->waiting && c->len == sizeof(c->buf) - 1)
+    {
+        reply(c, "error line too long\n");
+        flushClient(c);
+
+        if (c->fd >= 0)
+            closeClient(c);
+    }
+}
+
+static void updateWatchers()
+{
+    static double last = 0;
+    double t = now();
+
+    if (t - last < WATCH_INTERVAL_MS / 1000.0)
+        return;
+
+    last = t;
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        Client *c = &clients[i];
+        Job *j = c->fd >= 0 && c->watchJob ? findJob(c->watchJob) : NULL;
+
+        if (!j)
+            continue;
+
+        GrapeMetrics m;
+        grapeJobPoll(j->job, &m);
+
+        // A watcher still behind on the last update skips this one
+        if (c->outLen > 0 && m.state == GRAPE_JOB_RUNNING)
+            continue;
+
+        sendJobStatus(c, j);
+
+        if (m.state != GRAPE_JOB_RUNNING)
+        {
+            reply(c, "ok\n");
+            c->watchJob = 0;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socketPath = DEFAULT_SOCKET;
+    long long budgetMb = 0;
+
+    static struct option longOpts[] = {
+        {"socket", required_argument, NULL, 's'},
+        {"pin-budget", required_argument, NULL, 'p'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "s:p:h", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                socketPath = optarg;
+                break;
+            case 'p':
+                budgetMb = atoll(optarg);
+                break;
+            default:
+                printDaemonUsage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    checkRoot();
+
+    // Same as the CLI: job mounts stay private and die with the daemon
+    enterPrivateMounts();
+    sweepJobMounts();
+
+    isoCacheSetBudget(budgetMb * 1048576);
+
+    // Warm everything a job would otherwise look up on its way to the first write
+    deviceTableInit();
+
+    const char *tools[] = {"mkfs.vfat", "mount", "wimlib-imagex", NULL};
+
+    for (int i = 0; tools[i]; i++)
+        resolveCommand(tools[i]);
+
+    struct sigaction sa = {0};
+    sa.sa_handler = onStop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    mkdir("/run/grapeusb", 0700);
+    int listenFd = openSocket(socketPath);
+
+    if (listenFd < 0)
+        return 1;
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    printf("grapeusbd listening on %s, pin budget %lld MiB\n", socketPath, budgetMb);
+    fflush(stdout);
+
+    while (!stopping)
+    {
+        struct pollfd pfds[MAX_CLIENTS + 3];
+        int n = 0;
+
+        pfds[n++] = (struct pollfd){listenFd, POLLIN, 0};
+        pfds[n++] = (struct pollfd){deviceTableFd(), POLLIN, 0};
+        pfds[n++] = (struct pollfd){isoCacheFd(), POLLIN, 0};
+
+        // A client waiting for an inspection is not read from, so its commands stay in order
+        for (int i = 0; i < MAX_CLIENTS; i++)
+            pfds[n++] = (struct pollfd){clients[i].fd, (clients[i].waiting ? 0 : POLLIN) | (clients[i].outLen ? POLLOUT : 0), 0};
+
+        int ready = poll(pfds, n, WATCH_INTERVAL_MS);
+
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll failed");
+            break;
+        }
+
+        if (ready > 0 && (pfds[1].revents & POLLIN))
+            deviceTableProcess();
+
+        // Inspections run on their own threads; whoever waited on one tries again
+        if (ready > 0 && (pfds[2].revents & POLLIN))
+        {
+            isoCacheCollect();
+
+            for (int i = 0; i < MAX_CLIENTS; i++)
+            {
+                if (clients[i].fd >= 0 && clients[i].waiting)
+                {
+                    clients[i].waiting = 0;
+                    handleLines(&clients[i]);
+                }
+            }
+        }
+
+        for (int i = 0; ready > 0 && i < MAX_CLIENTS; i++)
+        {
+            if (pfds[i + 3].revents & (POLLIN | POLLHUP | POLLERR))
+                readClient(&clients[i]);
+            else if (pfds[i + 3].revents & POLLOUT)
+                flushClient(&clients[i]);
+        }
+
+        if (ready > 0 && (pfds[0].revents & POLLIN))
+        {
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+            for (int i = 0; fd >= 0 && i < MAX_CLIENTS; i++)
+            {
+                if (clients[i].fd < 0)
+                {
+                    clients[i].fd = fd;
+                    clients[i].len = 0;
+                    clients[i].outLen = 0;
+                    clients[i].watchJob = 0;
+                    clients[i].waiting = 0;
+                    fd = -1;
+                }
+            }
+
+            if (fd >= 0)
+            {
+                dprintf(fd, "error too many clients\n");
+                close(fd);
+            }
+        }
+
+        updateWatchers();
+
+        // Replies go out as far as each socket takes them, POLLOUT picks up the rest
+        for (int i = 0; i < MAX_CLIENTS; i++)
+        {
+            if (clients[i].fd >= 0 && clients[i].outLen > 0)
+                flushClient(&clients[i]);
+        }
+    }
+
+    printf("grapeusbd stopping, cancelling running jobs\n");
+
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        if (jobs[i].job)
+        {
+            grapeJobCancel(jobs[i].job);
+            grapeJobFree(jobs[i].job);
+        }
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (clients[i].fd >= 0)
+            close(clients[i].fd);
+    }
+
+    isoCacheClear();
+    close(listenFd);
+    unlink(socketPath);
+
+    return 0;
+}
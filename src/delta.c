@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "throttle.h"
+#include "target.h"
+#include "delta.h"
+#include "trace.h"
+
+#define DELTA_CHUNK   (1024 * 1024)
+#define DELTA_MAX_RUN (8 * 1024 * 1024)
+#define DIRECT_ALIGN  4096
+#define MAX_COMPARERS 8
+
+typedef struct {
+    int isoFd;
+    int devFd;
+    long long size;
+    int chunks;
+    unsigned char *changed;     // one flag per chunk
+    atomic_int next;
+    atomic_int failed;
+    atomic_int differing;
+    atomic_ullong *counter;
+    ProgressSlot *progress;
+} CompareJob;
+
+// O_DIRECT reads must cover whole blocks, so the tail may be asked for more than exists
+static int readAtLeast(int fd, char *buf, size_t want, size_t need, off_t off)
+{
+    size_t done = 0;
+
+    while (done < need)
+    {
+        ssize_t n = pread(fd, buf + done, want - done, off + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        done += n;
+    }
+
+    return 0;
+}
+
+static void *compareWorker(void *arg)
+{
+    CompareJob *job = arg;
+    char *image = NULL;
+    char *device = NULL;
+    int i;
+
+    if (posix_memalign((void **)&image, DIRECT_ALIGN, DELTA_CHUNK) != 0 ||
+        posix_memalign((void **)&device, DIRECT_ALIGN, DELTA_CHUNK) != 0)
+    {
+        atomic_store(&job->failed, 1);
+        free(image);
+        return NULL;
+    }
+
+    traceThreadName("delta compare");
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->chunks && !atomic_load(&job->failed))
+    {
+        long long off = (long long)i * DELTA_CHUNK;
+        size_t len = job->size - off < DELTA_CHUNK ? (size_t)(job->size - off) : DELTA_CHUNK;
+        size_t aligned = (len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+
+        if (progressStopRequested(job->progress))
+        {
+            atomic_store(&job->failed, 1);
+            break;
+        }
+
+        throttleRead(2 * len);
+
+        unsigned long long traced = traceNow();
+
+        if (readFull(job->isoFd, image, len, off) != 0 ||
+            readAtLeast(job->devFd, device, aligned, len, off) != 0)
+        {
+            perror("Compare read failed");
+            atomic_store(&job->failed, 1);
+            break;
+        }
+
+        traceSpan("io", "compare chunk", traced, len);
+
+        job->changed[i] = memcmp(image, device, len) != 0;
+
+        if (job->changed[i])
+            atomic_fetch_add(&job->differing, 1);
+
+        progressAdd(job->counter, len);
+    }
+
+    free(image);
+    free(device);
+
+    return NULL;
+}
+
+// Compares every chunk of the image against the device; returns how many differ
+static int compareChunks(CompareJob *job, atomic_ullong *counter)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus < 2 ? 2 : cpus > MAX_COMPARERS ? MAX_COMPARERS : (int)cpus;
+    pthread_t threads[MAX_COMPARERS];
+    int started = 0;
+
+    atomic_store(&job->next, 0);
+    atomic_store(&job->differing, 0);
+    job->counter = counter;
+
+    // Several reads in flight keep the stick's queue busy; each is a full chunk
+    while (started < workers && pthread_create(&threads[started], NULL, compareWorker, job) == 0)
+        started++;
+
+    if (started == 0)
+        compareWorker(job);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    return atomic_load(&job->failed) ? -1 : atomic_load(&job->differing);
+}
+
+// Rewrites the flagged chunks in ascending order, merging neighbours into larger writes
+static int writeChanged(CompareJob *job, const TargetOps *ops, int fd, ProgressSlot *progress, DeltaStats *stats)
+{
+    char *buf = malloc(DELTA_MAX_RUN);
+
+    if (!buf)
+        return -1;
+
+    int res = 0;
+
+    for (int i = 0; i < job->chunks && res == 0; i++)
+    {
+        if (!job->changed[i])
+            continue;
+
+        int first = i;
+
+        while (i + 1 < job->chunks && job->changed[i + 1] && (i + 2 - first) * DELTA_CHUNK <= DELTA_MAX_RUN)
+            i++;
+
+        long long off = (long long)first * DELTA_CHUNK;
+        long long end = (long long)(i + 1) * DELTA_CHUNK;
+
+        if (end > job->size)
+            end = job->size;
+
+        size_t len = end - off;
+
+        throttleRead(len);
+
+        if (progressStopRequested(progress) || readFull(job->isoFd, buf, len, off) != 0)
+        {
+            res = -1;
+            break;
+        }
+
+        throttleWrite(len);
+
+        unsigned long long traced = traceNow();
+
+        if (ops->write(fd, buf, len, off) != 0)
+        {
+            perror("Device write failed");
+            res = -1;
+            break;
+        }
+
+        traceSpan("io", "rewrite run", traced, len);
+
+        progressAdd(&progress->bytesWritten, len);
+        stats->rewritten += len;
+        stats->runs++;
+    }
+
+    free(buf);
+    return res;
+}
+
+// Reads both sides, rewrites only chunks that differ, then reads everything back once more
+int deltaWriteImage(const char *iso, UsbDevice *dev, ProgressSlot *progress, DeltaStats *stats)
+{
+    const TargetOps *ops = targetOps(dev);
+    CompareJob job = {.isoFd = -1, .devFd = -1, .progress = progress};
+    int writeFd = -1;
+    int res = -1;
+    struct stat st;
+
+    memset(stats, 0, sizeof(*stats));
+
+    job.isoFd = open(iso, O_RDONLY | O_CLOEXEC);
+
+    if (job.isoFd < 0 || fstat(job.isoFd, &st) != 0)
+    {
+        perror("Failed to open image");
+        goto out;
+    }
+
+    writeFd = ops->open(dev, O_RDWR);
+
+    if (writeFd < 0)
+    {
+        perror("Failed to open device");
+        goto out;
+    }
+
+    // What matters is what the flash holds, not what the page cache remembers
+    job.devFd = open(dev->dev_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+
+    if (job.devFd < 0)
+    {
+        job.devFd = open(dev->dev_path, O_RDONLY | O_CLOEXEC);
+        posix_fadvise(writeFd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    if (job.devFd < 0)
+    {
+        perror("Failed to open device for reading");
+        goto out;
+    }
+
+    job.size = st.st_size;
+    job.chunks = (int)((job.size + DELTA_CHUNK - 1) / DELTA_CHUNK);
+    job.changed = calloc(job.chunks ? job.chunks : 1, 1);
+
+    if (!job.changed)
+        goto out;
+
+    stats->size = job.size;
+    stats->chunks = job.chunks;
+    atomic_store(&progress->total, job.size);
+
+    progressPhase(progress, "comparing");
+
+    int changed = compareChunks(&job, &progress->bytesRead);
+
+    if (changed < 0)
+        goto out;
+
+    stats->changed = changed;
+
+    if (changed > 0)
+    {
+        progressPhase(progress, "writing");
+
+        if (writeChanged(&job, ops, writeFd, progress, stats) != 0)
+            goto out;
+
+        progressPhase(progress, "flushing");
+
+        if (ops->flush(writeFd) != 0)
+        {
+            perror("Device flush failed");
+            goto out;
+        }
+
+        progressAdd(&progress->bytesFlushed, stats->rewritten);
+    }
+
+    // The verify pass covers the whole image, not just what was rewritten
+    progressPhase(progress, "verifying");
+    posix_fadvise(job.devFd, 0, job.size, POSIX_FADV_DONTNEED);
+
+    int remaining = compareChunks(&job, &progress->bytesVerified);
+
+    if (remaining != 0)
+    {
+        if (remaining > 0)
+            fprintf(stderr, "Verify failed on %s: %d chunks still differ from the image\n",
+                    dev->dev_path, remaining);
+        goto out;
+    }
+
+    progressPhase(progress, "done");
+    res = 0;
+
+out:
+    if (res != 0)
+        progressPhase(progress, "failed");
+
+    if (job.devFd >= 0)
+        close(job.devFd);
+    if (writeFd >= 0)
+        close(writeFd);
+    if (job.isoFd >= 0)
+        close(job.isoFd);
+
+    free(job.changed);
+
+    return res;
+}
+
+void printDeltaStats(const DeltaStats *stats)
+{
+    printf("Delta: %d of %d MiB chunks differed, rewrote %.1f MiB of %.1f MiB (%.1f%%) in %d writes\n",
+           stats->changed, stats->chunks, stats->rewritten / 1048576.0, stats->size / 1048576.0,
+           stats->size ? stats->rewritten * 100.0 / stats->size : 0.0, stats->runs);
+}
\ No newline at end of file
@@ -1,216 +1,165 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <string.h>
 
-#include "jsmn.h"
 #include "utils.h"
 #include "devices.h"
+#include "footprint.h"
 
-int hasEnoughSpace(const char *isoPath, UsbDevice *dev) 
+// Only the strategy create_bootable will pick has to fit; the report shows the others too
+int hasEnoughSpace(const char *isoPath, UsbDevice *dev, IsoType type)
 {
-    struct stat st;
+    Footprint fp;
 
-    if (stat(isoPath, &st) != 0) 
-    {
-        perror("stat ISO failed");
-        return 0;
-    }
-
-    long long isoSize = st.st_size;
-    
-    char sysfs_path[256];
-    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/class/block/%s/size", dev->name);
-    
-    FILE *f = fopen(sysfs_path, "r");
-    
-    if (!f)
-    {
-        perror("Failed to read device size");
+    if (estimateFootprint(isoPath, dev, type, &fp) != 0)
         return 0;
-    }
 
-    long long blocks;
-    fscanf(f, "%lld", &blocks);
-    fclose(f);
+    printFootprint(dev, &fp);
+    return footprintFits(&fp);
+}
 
-    long long devSize = blocks * 512;
+int layoutHasEnoughSpace(const IsoLayout *layout, UsbDevice *dev)
+{
+    Footprint fp;
 
-    printf("ISO size: %lld bytes, USB size: %lld bytes\n", isoSize, devSize);
+    if (estimateLayoutFootprint(layout, dev, &fp) != 0)
+        return 0;
 
-    return devSize > isoSize;
+    printFootprint(dev, &fp);
+    return footprintFits(&fp);
 }
 
-int getUsbDevices(UsbDevice *list, int max)
+static void formatSize(long long bytes, char *out, size_t len)
 {
-    int pipefd[2];
+    const char units[] = "BKMGTP";
+    double value = bytes;
+    int u = 0;
 
-    if (pipe(pipefd) == -1)
+    while (value >= 1024 && u < 5)
     {
-        perror("pipe failed");
-        return 0;
+        value /= 1024;
+        u++;
     }
 
-    pid_t pid = fork();
+    if (u == 0 || value >= 100 || value == (long long)value)
+        snprintf(out, len, "%.0f%c", value, units[u]);
+    else
+        snprintf(out, len, "%.1f%c", value, units[u]);
+}
 
-    if (pid == 0) // child process goes to lsblk
-    { 
-        dup2(pipefd[1], STDOUT_FILENO); // now lsblk goes from console to pipe
-        close(pipefd[0]);
-        close(pipefd[1]);
+static void readSysfsString(const char *path, char *out, size_t len)
+{
+    out[0] = '\0';
 
-        execlp("lsblk", "lsblk", "-J", "-d", "-o",
-               "NAME,RM,SIZE,MODEL,TYPE,MOUNTPOINT", NULL);
+    FILE *f = fopen(path, "r");
 
-        perror("execlp");
-        exit(1);
-    }
+    if (!f)
+        return;
 
-    close(pipefd[1]);
+    if (fgets(out, len, f))
+    {
+        size_t n = strlen(out);
 
-    char buffer[8192];
-    ssize_t total = 0;
-    ssize_t n = 0;
+        while (n > 0 && (out[n - 1] == '\n' || out[n - 1] == ' '))
+            out[--n] = '\0';
+    }
 
-    while((n = read(pipefd[0], buffer + total, sizeof(buffer) - 1 - total)) > 0)
-        total += n;
+    fclose(f);
+}
 
-    if ((unsigned)total >= sizeof(buffer) - 1)
-    {
-        fprintf(stderr, "Output too large, buffer overflow\n");
-        close(pipefd[0]);
-        waitpid(pid, NULL, 0);
-        return 0;
-    }
+// A disk is a system disk if it or any of its partitions is mounted at / or /boot
+static int isSystemDisk(const char *name)
+{
+    FILE *f = fopen("/proc/self/mounts", "r");
 
-    close(pipefd[0]);
-    waitpid(pid, NULL, 0);
+    if (!f)
+        return 1;
 
-    if (total <= 0)
-        return 0;
+    char src[256], target[256];
+    size_t len = strlen(name);
+    int system = 0;
 
-    buffer[total] = '\0';
+    while (fscanf(f, "%255s %255s %*[^\n]", src, target) == 2)
+    {
+        if (strcmp(target, "/") != 0 && strcmp(target, "/boot") != 0)
+            continue;
 
-    jsmn_parser parser;
-    jsmntok_t tokens[256];
+        if (strncmp(src, "/dev/", 5) == 0 && strncmp(src + 5, name, len) == 0)
+            system = 1;
+    }
 
-    jsmn_init(&parser);
-    int token_count = jsmn_parse(&parser, buffer, total, tokens, 256);
+    fclose(f);
+    return system;
+}
 
-    if (token_count < 0)
-        return 0;
+// Fills a UsbDevice straight from sysfs; returns 0 if the name is not a removable disk
+int readUsbDevice(const char *name, UsbDevice *dev)
+{
+    char path[256];
+    long long removable, sectors;
 
-    int i;
+    snprintf(path, sizeof(path), "/sys/class/block/%s/partition", name);
+    if (access(path, F_OK) == 0)
+        return 0;
 
-    for (i = 1; i < token_count; i++)
-    {
-        if (tokens[i].type == JSMN_STRING &&
-            (tokens[i].end - tokens[i].start) == 12 &&
-            strncmp(buffer + tokens[i].start, "blockdevices", 12) == 0)
-            {
-                break;
-            }
-    }
-    
-    if (i == token_count)
+    snprintf(path, sizeof(path), "/sys/class/block/%s/removable", name);
+    if (readSysfsLL(path, &removable) != 0 || removable != 1)
         return 0;
 
-    jsmntok_t *arr = &tokens[i + 1];
+    snprintf(path, sizeof(path), "/sys/class/block/%s/size", name);
+    if (readSysfsLL(path, &sectors) != 0 || sectors == 0)
+        return 0;
 
-    if (arr->type != JSMN_ARRAY)
+    if (isSystemDisk(name))
         return 0;
 
-    int index = i + 2;
-    int count = 0;
+    memset(dev, 0, sizeof(*dev));
+    snprintf(dev->name, sizeof(dev->name), "%s", name);
+    formatSize(sectors * 512, dev->size, sizeof(dev->size));
 
-    for (int d = 0; d < arr->size && count < max; d++) 
-    {
-        jsmntok_t *obj = &tokens[index];
-        
-        if (obj->type != JSMN_OBJECT)
-            break;
-        
-        char name[64] = "", size[32] = "", model[128] = "", type[32] = "", mountpoint[256] = "";
-        int rm = 0;
-        
-        int obj_size = obj->size; 
-        int j = index + 1;
-
-        for (int k = 0; k < obj_size; k++) 
-        {
-            if (tokens[j].type != JSMN_STRING)
-            {
-                j += 2;
-                continue;
-            }
-
-            int key_len = tokens[j].end - tokens[j].start;
-            char *key = &buffer[tokens[j].start];
-
-            jsmntok_t *val = &tokens[j + 1];
-            int val_len = val->end - val->start;
-            char *val_ptr = &buffer[val->start];
-
-            if (key_len == 4 && strncmp(key, "name", key_len) == 0)
-                snprintf(name, sizeof(name), "%.*s", val_len, val_ptr);
-            else if (key_len == 4 && strncmp(key, "size", key_len) == 0)
-                snprintf(size, sizeof(size), "%.*s", val_len, val_ptr);
-            else if (key_len == 5 && strncmp(key, "model", key_len) == 0)
-                snprintf(model, sizeof(model), "%.*s", val_len, val_ptr);
-            else if (key_len == 4 && strncmp(key, "type", key_len) == 0)
-                snprintf(type, sizeof(type), "%.*s", val_len, val_ptr);
-            else if (key_len == 2 && strncmp(key, "rm", key_len) == 0) 
-            {
-                if (val_len == 4 && strncmp(val_ptr, "true", 4) == 0)
-                    rm = 1;
-                else if (val_len == 1 && strncmp(val_ptr, "1", 1) == 0)
-                    rm = 1;
-                else
-                    rm = 0;
-            }
-
-            else if (key_len == 10 && strncmp(key, "mountpoint", key_len) == 0)
-                snprintf(mountpoint, sizeof(mountpoint), "%.*s", val_len, val_ptr);
-
-            j += 2; 
-        }
-
-        int is_system = (strcmp(mountpoint, "/") == 0 || 
-                        strcmp(mountpoint, "/boot") == 0);
-
-        if (strcmp(type, "disk") == 0 && rm == 1 && !is_system) 
-        {
-            snprintf(list[count].name, sizeof(list[count].name), "%s", name);
-            snprintf(list[count].size, sizeof(list[count].size), "%s", size);
-            snprintf(list[count].model, sizeof(list[count].model), "%s", model);
-            count++;
-        }
-        
-        index = j;
-    }
+    snprintf(path, sizeof(path), "/sys/class/block/%s/device/model", name);
+    readSysfsString(path, dev->model, sizeof(dev->model));
 
-    return count;
+    return 1;
 }
 
 int findUsbByName(const char *name, UsbDevice *devOut) 
 {
-    UsbDevice list[16];
-    int n = getUsbDevices(list, 16);
+    if (strncmp(name, "/dev/", 5) == 0)
+        name += 5;
+
+    if (strchr(name, '/') || !readUsbDevice(name, devOut))
+        return 0;
+
+    formatPartPath(devOut);
+    return 1;
+}
+
+int getUsbDevices(UsbDevice *list, int max)
+{
+    DIR *dir = opendir("/sys/class/block");
 
-    for (int i = 0; i < n; i++) 
+    if (!dir)
     {
-        char full_path[128];
-        snprintf(full_path, sizeof(full_path), "/dev/%s", list[i].name);
+        perror("Failed to list block devices");
+        return 0;
+    }
+
+    struct dirent *ent;
+    int count = 0;
 
-        if (strcmp(list[i].name, name) == 0 || strcmp(full_path, name) == 0)
-        {
-            *devOut = list[i];
+    while ((ent = readdir(dir)) != NULL && count < max)
+    {
+        if (ent->d_name[0] == '.')
+            continue;
 
-            formatPartPath(devOut);
-            return 1;           
-        }
+        if (readUsbDevice(ent->d_name, &list[count]))
+            count++;
     }
-    return 0;
+
+    closedir(dir);
+    return count;
 }
\ No newline at end of file
@@ -2,49 +2,191 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "exec.h"
+#include "utils.h"
+#include "trace.h"
 
-int run(char *const argv[])
+#define MAX_CHILDREN 16
+#define MAX_ABORTED 16
+
+static pid_t children[MAX_CHILDREN];
+static pthread_t childOwner[MAX_CHILDREN];
+static unsigned long long childStart[MAX_CHILDREN];
+static pthread_t abortedOwners[MAX_ABORTED];
+static int abortedCount = 0;
+static int quietChildren = 0;
+static pthread_mutex_t childLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Callers hold childLock; returns when replace's slot was started, for the trace
+static unsigned long long trackChild(pid_t pid, pid_t replace)
+{
+    for (int i = 0; i < MAX_CHILDREN; i++)
+    {
+        if (children[i] == replace)
+        {
+            unsigned long long started = childStart[i];
+
+            children[i] = pid;
+            childOwner[i] = pthread_self();
+            childStart[i] = traceNow();
+
+            return started;
+        }
+    }
+
+    return 0;
+}
+
+// Callers hold childLock
+static int abortedIndex(pthread_t owner)
+{
+    for (int i = 0; i < abortedCount; i++)
+    {
+        if (pthread_equal(abortedOwners[i], owner))
+            return i;
+    }
+
+    return -1;
+}
+
+// Kills the commands started by owner's job; that thread starts nothing new until resetAbort()
+void abortCommands(pthread_t owner)
 {
+    pthread_mutex_lock(&childLock);
+
+    if (abortedIndex(owner) < 0 && abortedCount < MAX_ABORTED)
+        abortedOwners[abortedCount++] = owner;
+
+    for (int i = 0; i < MAX_CHILDREN; i++)
+    {
+        if (children[i] > 0 && pthread_equal(childOwner[i], owner))
+            kill(children[i], SIGKILL);
+    }
+
+    pthread_mutex_unlock(&childLock);
+}
+
+// While a progress view owns the terminal, commands keep only their stderr
+void setQuietChildren(int quiet)
+{
+    quietChildren = quiet;
+}
+
+void resetAbort()
+{
+    pthread_mutex_lock(&childLock);
+
+    int idx = abortedIndex(pthread_self());
+
+    if (idx >= 0)
+        abortedOwners[idx] = abortedOwners[--abortedCount];
+
+    pthread_mutex_unlock(&childLock);
+}
+
+pid_t run_async(char *const argv[], int ioprioLevel)
+{
+    const char *path = resolveCommand(argv[0]);
+
+    pthread_mutex_lock(&childLock);
+
+    if (abortedIndex(pthread_self()) >= 0)
+    {
+        pthread_mutex_unlock(&childLock);
+        fprintf(stderr, "Aborted, not starting: %s\n", argv[0]);
+        return -1;
+    }
+
     pid_t pid = fork();
     if (pid == 0)
     {
-        execvp(argv[0], argv);
+        // Concurrent jobs share the device through best-effort priority levels,
+        // unless the whole run was put in the idle class
+        int current = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+
+        if (ioprioLevel >= 0 && (current < 0 || IOPRIO_PRIO_CLASS(current) != IOPRIO_CLASS_IDLE))
+            syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                    IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, ioprioLevel));
+
+        if (quietChildren)
+        {
+            int null = open("/dev/null", O_WRONLY);
+
+            if (null >= 0)
+                dup2(null, STDOUT_FILENO);
+        }
+
+        if (path)
+            execv(path, argv);
+        else
+            execvp(argv[0], argv);
         perror("execvp failed");
         exit(127);
     }
     else if (pid > 0)
     {
-        int status;
-        if (waitpid(pid, &status, 0) == -1)
-        {
-            perror("waitpid failed");
-            return -1;
-        }
+        trackChild(pid, 0);
+    }
 
-        if (WIFEXITED(status))
-        {
-            int exitCode = WEXITSTATUS(status);
-            if (exitCode != 0)
-                fprintf(stderr, "Command failed with exit code %d: %s\n", exitCode, argv[0]);
+    pthread_mutex_unlock(&childLock);
 
-            return exitCode;
-        }
-        else if (WIFSIGNALED(status))
-        {
-            fprintf(stderr, "Command killed by signal %d: %s\n", WTERMSIG(status), argv[0]);
-            return -1;
-        }
+    if (pid < 0)
+        perror("fork failed");
+
+    return pid;
+}
+
+int run_wait(pid_t pid, const char *name)
+{
+    int status;
+    int res = waitpid(pid, &status, 0);
+
+    pthread_mutex_lock(&childLock);
+    unsigned long long started = trackChild(0, pid);
+    pthread_mutex_unlock(&childLock);
+
+    // Commands waited on together would overlap on one row, so each gets its own, keyed by pid
+    if (started)
+        traceSpanOn(traceExecTrack(pid), "exec", name, started, -1);
 
+    if (res == -1)
+    {
+        perror("waitpid failed");
         return -1;
     }
-    else
+
+    if (WIFEXITED(status))
     {
-        perror("fork failed");
+        int exitCode = WEXITSTATUS(status);
+        if (exitCode != 0)
+            fprintf(stderr, "Command failed with exit code %d: %s\n", exitCode, name);
+
+        return exitCode;
+    }
+    else if (WIFSIGNALED(status))
+    {
+        fprintf(stderr, "Command killed by signal %d: %s\n", WTERMSIG(status), name);
         return -1;
     }
+
+    return -1;
+}
+
+int run(char *const argv[])
+{
+    pid_t pid = run_async(argv, -1);
+
+    if (pid < 0)
+        return -1;
+
+    return run_wait(pid, argv[0]);
 }
 
 int run_checked(char *const argv[])
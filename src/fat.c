@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "fat.h"
+
+#define FAT32_MIN_CLUSTERS 65525
+#define FAT32_MAX_RESERVED 65535
+#define DEFAULT_ALLOC_UNIT (4LL * 1024 * 1024)
+#define MAX_ALLOC_UNIT     (16LL * 1024 * 1024)
+
+int clusterSizeForChoice(int choice)
+{
+    return 4096 << choice;
+}
+
+void treeStatsAddFile(TreeStats *stats, long long size)
+{
+    stats->files++;
+    stats->bytes += size;
+
+    for (int c = 0; c < FAT_CLUSTER_CHOICES; c++)
+    {
+        long long cluster = clusterSizeForChoice(c);
+        long long rem = size % cluster;
+
+        // empty files take no cluster at all
+        if (rem != 0)
+            stats->slack[c] += cluster - rem;
+    }
+}
+
+static int scanDir(int dirfd, TreeStats *stats)
+{
+    DIR *dir = fdopendir(dirfd);
+
+    if (!dir)
+    {
+        close(dirfd);
+        return -1;
+    }
+
+    struct dirent *ent;
+    int res = 0;
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        struct stat st;
+
+        if (fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+        {
+            stats->dirs++;
+
+            int sub = openat(dirfd, ent->d_name, O_RDONLY | O_DIRECTORY);
+
+            if (sub < 0 || scanDir(sub, stats) != 0)
+                res = -1;
+        }
+        else if (S_ISREG(st.st_mode))
+            treeStatsAddFile(stats, st.st_size);
+    }
+
+    closedir(dir);
+    return res;
+}
+
+int scanTreeStats(const char *root, TreeStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    int fd = open(root, O_RDONLY | O_DIRECTORY);
+
+    if (fd < 0)
+    {
+        perror("Failed to open source tree");
+        return -1;
+    }
+
+    return scanDir(fd, stats);
+}
+
+static long long allocationUnit(const UsbDevice *dev)
+{
+    char path[256];
+    long long unit = 0;
+    long long value;
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/queue/discard_granularity", dev->name);
+    if (readSysfsLL(path, &value) == 0 && value > unit)
+        unit = value;
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/queue/optimal_io_size", dev->name);
+    if (readSysfsLL(path, &value) == 0 && value > unit)
+        unit = value;
+
+    // USB sticks rarely report anything useful; 4 MiB covers the common erase blocks
+    if (unit < DEFAULT_ALLOC_UNIT || (unit & (unit - 1)) != 0)
+        unit = DEFAULT_ALLOC_UNIT;
+
+    if (unit > MAX_ALLOC_UNIT)
+        unit = MAX_ALLOC_UNIT;
+
+    return unit;
+}
+
+// Mirrors the FAT32 sizing done by mkfs.fat when structure alignment is off (-a)
+static unsigned fatSectorsFor(long long sectors, unsigned reserved, unsigned spc,
+                              unsigned sectorSize, long long *clusters)
+{
+    long long fatdata = sectors - reserved;
+    long long clust = (fatdata * sectorSize + 2 * 8) / ((long long)spc * sectorSize + 2 * 4);
+    unsigned fat = (unsigned)(((clust + 2) * 4 + sectorSize - 1) / sectorSize);
+
+    *clusters = (fatdata - 2LL * fat) / spc;
+    return fat;
+}
+
+// Bigger clusters mean fewer FAT updates, as long as the rounding waste stays small;
+// returns -1 if no cluster size leaves FAT32 enough clusters
+int chooseFatCluster(long long sectors, unsigned sectorSize, const TreeStats *stats)
+{
+    long long budget = stats->bytes / 100;
+    if (budget < 16LL * 1024 * 1024)
+        budget = 16LL * 1024 * 1024;
+
+    int chosen = -1;
+
+    for (int c = FAT_CLUSTER_CHOICES - 1; c >= 0; c--)
+    {
+        unsigned spc = clusterSizeForChoice(c) / sectorSize;
+        long long clusters;
+
+        if (spc == 0)
+            continue;
+
+        fatSectorsFor(sectors, 32, spc, sectorSize, &clusters);
+
+        if (clusters < FAT32_MIN_CLUSTERS)
+            continue;
+
+        chosen = c;
+
+        if (stats->slack[c] <= budget)
+            break;
+    }
+
+    return chosen;
+}
+
+// Sectors per FAT with the default reserved area, and the data clusters left after both copies
+unsigned fatSectorsForChoice(long long sectors, unsigned sectorSize, int choice, long long *clusters)
+{
+    return fatSectorsFor(sectors, 32, clusterSizeForChoice(choice) / sectorSize, sectorSize, clusters);
+}
+
+int planFatGeometry(const char *srcRoot, UsbDevice *dev, FatGeometry *geo)
+{
+    char path[256];
+    const char *part = strrchr(dev->part_path, '/');
+    part = part ? part + 1 : dev->part_path;
+
+    long long sectorSize, partStart, partSectors;
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/queue/logical_block_size", dev->name);
+    if (readSysfsLL(path, &sectorSize) != 0 || sectorSize <= 0)
+        sectorSize = 512;
+
+    // sysfs always reports start and size in 512-byte units
+    snprintf(path, sizeof(path), "/sys/class/block/%s/start", part);
+    if (readSysfsLL(path, &partStart) != 0)
+        return -1;
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/size", part);
+    if (readSysfsLL(path, &partSectors) != 0)
+        return -1;
+
+    TreeStats stats;
+
+    if (scanTreeStats(srcRoot, &stats) != 0)
+        return -1;
+
+    long long sectors = partSectors * 512 / sectorSize;
+    long long align = allocationUnit(dev);
+    int chosen = chooseFatCluster(sectors, sectorSize, &stats);
+
+    if (chosen < 0)
+    {
+        fprintf(stderr, "Partition too small for FAT32\n");
+        return -1;
+    }
+
+    unsigned spc = clusterSizeForChoice(chosen) / sectorSize;
+    unsigned reserved = 32;
+    long long clusters = 0;
+    unsigned fat = 0;
+
+    // Pad the reserved area until the data region starts on an allocation unit boundary
+    for (int i = 0; i < 16; i++)
+    {
+        fat = fatSectorsFor(sectors, reserved, spc, sectorSize, &clusters);
+
+        long long dataStart = partStart * 512 + ((long long)reserved + 2LL * fat) * sectorSize;
+        long long pad = (align - dataStart % align) % align;
+
+        if (pad == 0)
+            break;
+
+        reserved += pad / sectorSize;
+    }
+
+    if (reserved > FAT32_MAX_RESERVED)
+    {
+        fprintf(stderr, "Cannot align FAT32 data region to %lld bytes\n", align);
+        return -1;
+    }
+
+    geo->sectorSize = sectorSize;
+    geo->clusterSize = clusterSizeForChoice(chosen);
+    geo->reservedSectors = reserved;
+    geo->fatSectors = fat;
+    geo->clusters = clusters;
+    geo->dataOffset = partStart * 512 + ((long long)reserved + 2LL * fat) * sectorSize;
+    geo->alignment = align;
+    geo->slack = stats.slack[chosen];
+
+    printFatGeometry(geo, &stats);
+    return 0;
+}
+
+void printFatGeometry(const FatGeometry *geo, const TreeStats *stats)
+{
+    printf("FAT32 geometry: %u KiB clusters, %u reserved sectors, 2 x %u FAT sectors\n",
+           geo->clusterSize / 1024, geo->reservedSectors, geo->fatSectors);
+    printf("Data region at %lld KiB (%s to %lld KiB)\n",
+           geo->dataOffset / 1024,
+           geo->dataOffset % geo->alignment == 0 ? "aligned" : "NOT aligned",
+           geo->alignment / 1024);
+    printf("Expected slack: %.1f MiB over %lld files (%.1f MiB of data)\n",
+           geo->slack / 1048576.0, stats->files, stats->bytes / 1048576.0);
+}
\ No newline at end of file
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "footprint.h"
+#include "isotree.h"
+#include "fat.h"
+#include "target.h"
+#include "write.h"
+#include "utils.h"
+#include "partition.h"
+
+// Typical USB 3 stick; file: and null: targets are bounded by the page cache instead
+#define STICK_WRITE_BPS (30LL << 20)
+#define STICK_READ_BPS  (90LL << 20)
+#define FAST_BPS        (1000LL << 20)
+#define FILE_COST       0.004   // FAT metadata updates per file on a stick
+#define FORMAT_COST     2.0
+
+// What FAT32 can hold in one file, and the part size wimlib-imagex split is given
+#define FAT32_MAX_FILE  4294967295LL
+#define WIM_PART_BYTES  (3800LL << 20)
+#define WIM_PART_EXTRA  (1LL << 20)     // header and lookup table repeated in every part
+
+static int addSlots(IsoLayout *t, int dir, int slots)
+{
+    if (dir >= t->slotCap)
+    {
+        int cap = t->slotCap ? t->slotCap : 64;
+
+        while (cap <= dir)
+            cap *= 2;
+
+        int *grown = realloc(t->slots, cap * sizeof(*grown));
+
+        if (!grown)
+            return -1;
+
+        memset(grown + t->slotCap, 0, (cap - t->slotCap) * sizeof(*grown));
+        t->slots = grown;
+        t->slotCap = cap;
+    }
+
+    t->slots[dir] += slots;
+    return 0;
+}
+
+// An 8.3 upper-case name needs one entry, anything else adds long-name entries of 13 characters
+static int entrySlots(const char *name, int chars)
+{
+    const char *dot = strrchr(name, '.');
+    int base = dot ? (int)(dot - name) : chars;
+    int ext = dot ? chars - base - 1 : 0;
+    int shortOk = base >= 1 && base <= 8 && ext <= 3 && chars == (int)strlen(name);
+
+    for (const char *p = name; shortOk && *p; p++)
+    {
+        if ((*p >= 'a' && *p <= 'z') || *p == ' ' || *p == '+' || (*p == '.' && p != dot))
+            shortOk = 0;
+    }
+
+    return shortOk ? 1 : 1 + (chars + 12) / 13;
+}
+
+static int onEntry(const IsoTreeEntry *e, void *ctx)
+{
+    IsoLayout *t = ctx;
+    const char *name = strrchr(e->path, '/');
+    name = name ? name + 1 : e->path;
+
+    if (t->type == ISO_WINDOWS && strcasecmp(e->path, "sources/install.esd") == 0)
+        return 0;
+
+    if (e->dir)
+    {
+        t->stats.dirs++;
+        return addSlots(t, e->parent, entrySlots(name, e->nameChars));
+    }
+
+    // Too big for FAT32, so it lands as install.swm, install2.swm, ...
+    if (t->type == ISO_WINDOWS && strcasecmp(e->path, "sources/install.wim") == 0 &&
+        e->size > FAT32_MAX_FILE)
+    {
+        int parts = (e->size + WIM_PART_BYTES - 1) / WIM_PART_BYTES;
+
+        for (int i = 0; i < parts; i++)
+            treeStatsAddFile(&t->stats, e->size / parts + WIM_PART_EXTRA);
+
+        t->wimParts = parts;
+        return addSlots(t, e->parent, parts * 2);
+    }
+
+    treeStatsAddFile(&t->stats, e->size);
+    return addSlots(t, e->parent, entrySlots(name, e->nameChars));
+}
+
+// Every directory takes whole clusters for its entries plus "." and ".."
+static long long dirBytesFor(const IsoLayout *t, long long cluster)
+{
+    long long total = 0;
+    int dirs = t->stats.dirs + 1;
+
+    for (int i = 0; i < dirs; i++)
+    {
+        long long bytes = ((i < t->slotCap ? t->slots[i] : 0) + 2) * 32LL;
+        total += (bytes + cluster - 1) / cluster * cluster;
+    }
+
+    return total;
+}
+
+static long long sysfsBytes(const char *name, const char *attr, long long unit)
+{
+    char path[256];
+    long long value;
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/%s", name, attr);
+
+    return readSysfsLL(path, &value) == 0 ? value * unit : -1;
+}
+
+static void estimateRaw(long long isoSize, const UsbDevice *dev, long long devSize,
+                        long long block, long long bps, StrategyEstimate *s)
+{
+    const TargetOps *ops = targetOps(dev);
+
+    s->needed = (isoSize + block - 1) / block * block;
+    s->available = devSize;
+    s->seconds = (double)s->needed / bps;
+
+    // Writes are verified by reading the whole image back
+    if (ops->readable)
+        s->seconds += (double)s->needed / (bps == FAST_BPS ? FAST_BPS : STICK_READ_BPS);
+}
+
+static void estimateCopy(const IsoLayout *t, const UsbDevice *dev, long long devSize, Footprint *fp)
+{
+    StrategyEstimate *s = &fp->strategy[STRATEGY_COPY];
+    long long sectorSize = sysfsBytes(dev->name, "queue/logical_block_size", 1);
+
+    if (sectorSize <= 0)
+        sectorSize = 512;
+
+    // Whatever partition is there now goes: the copy gets the one partitionStick lays out over the disk
+    long long partBytes = gptPartitionBytes(devSize, sectorSize);
+    long long sectors = partBytes / sectorSize;
+    int choice = chooseFatCluster(sectors, sectorSize, &t->stats);
+
+    s->available = partBytes;
+    fp->format = t->format;
+    fp->files = t->stats.files;
+    fp->dirs = t->stats.dirs;
+    fp->dataBytes = t->stats.bytes;
+    fp->wimParts = t->wimParts;
+
+    if (choice < 0)
+    {
+        // Too small for FAT32 at all, however little the tree holds
+        s->needed = t->stats.bytes > partBytes ? t->stats.bytes : partBytes + 1;
+    }
+    else
+    {
+        long long clusters;
+        fatSectorsForChoice(sectors, sectorSize, choice, &clusters);
+
+        fp->clusterSize = clusterSizeForChoice(choice);
+        fp->slack = t->stats.slack[choice];
+        fp->dirBytes = dirBytesFor(t, fp->clusterSize);
+
+        // Whatever the data region cannot hold pushes the total past the partition
+        long long data = t->stats.bytes + fp->slack + fp->dirBytes;
+        long long room = clusters * fp->clusterSize;
+
+        s->needed = partBytes - room + data;
+    }
+
+    long long bps = dev->kind == TARGET_FILE || dev->kind == TARGET_NULL ? FAST_BPS : STICK_WRITE_BPS;
+
+    s->seconds = FORMAT_COST + (double)(t->stats.bytes + fp->dirBytes) / bps +
+                 (t->stats.files + t->stats.dirs) * FILE_COST;
+}
+
+// Reads everything about the image the estimate needs, whatever the target
+int inspectIsoLayout(const char *iso, IsoType type, IsoLayout *layout)
+{
+    struct stat st;
+
+    memset(layout, 0, sizeof(*layout));
+
+    if (stat(iso, &st) != 0)
+    {
+        perror("stat ISO failed");
+        return -1;
+    }
+
+    layout->size = st.st_size;
+    layout->type = type;
+    layout->hybrid = type == ISO_LINUX && isHybridISO(iso);
+    layout->format = walkIsoTree(iso, onEntry, layout);
+
+    // Unreadable trees fall back to treating the whole image as one file
+    if (layout->format < 0)
+    {
+        free(layout->slots);
+        memset(&layout->stats, 0, sizeof(layout->stats));
+        layout->slots = NULL;
+        layout->slotCap = 0;
+        layout->wimParts = 0;
+        treeStatsAddFile(&layout->stats, st.st_size);
+    }
+
+    return 0;
+}
+
+int copyIsoLayout(IsoLayout *dst, const IsoLayout *src)
+{
+    *dst = *src;
+    dst->slots = NULL;
+
+    if (src->slotCap > 0)
+    {
+        dst->slots = malloc(src->slotCap * sizeof(*dst->slots));
+
+        if (!dst->slots)
+            return -1;
+
+        memcpy(dst->slots, src->slots, src->slotCap * sizeof(*dst->slots));
+    }
+
+    return 0;
+}
+
+void freeIsoLayout(IsoLayout *layout)
+{
+    free(layout->slots);
+    layout->slots = NULL;
+    layout->slotCap = 0;
+}
+
+// Works out what each strategy would put on the target, before anything on it is touched
+int estimateFootprint(const char *iso, const UsbDevice *dev, IsoType type, Footprint *fp)
+{
+    IsoLayout layout;
+
+    if (inspectIsoLayout(iso, type, &layout) != 0)
+    {
+        memset(fp, 0, sizeof(*fp));
+        fp->chosen = -1;
+        fp->format = -1;
+        return -1;
+    }
+
+    int res = estimateLayoutFootprint(&layout, dev, fp);
+
+    freeIsoLayout(&layout);
+    return res;
+}
+
+int estimateLayoutFootprint(const IsoLayout *layout, const UsbDevice *dev, Footprint *fp)
+{
+    memset(fp, 0, sizeof(*fp));
+    fp->chosen = -1;
+    fp->format = -1;
+
+    const TargetOps *ops = targetOps(dev);
+    int fast = dev->kind == TARGET_FILE || dev->kind == TARGET_NULL;
+    long long devSize = fast ? dev->capacity : sysfsBytes(dev->name, "size", 512);
+    long long block = fast ? 1 : sysfsBytes(dev->name, "queue/logical_block_size", 1);
+
+    if (devSize < 0)
+    {
+        perror("Failed to read device size");
+        return -1;
+    }
+
+    if (block <= 0)
+        block = 512;
+
+    int hybrid = layout->hybrid;
+
+    // Same order as create_bootable: hybrid images go raw, everything else needs a partition
+    fp->strategy[STRATEGY_RAW].possible = hybrid;
+    fp->strategy[STRATEGY_COPY].possible = ops->blockDevice;
+
+    if (hybrid)
+        fp->chosen = STRATEGY_RAW;
+    else if (ops->blockDevice)
+        fp->chosen = STRATEGY_COPY;
+
+    estimateRaw(layout->size, dev, devSize, block, fast ? FAST_BPS : STICK_WRITE_BPS,
+                &fp->strategy[STRATEGY_RAW]);
+
+    if (ops->blockDevice)
+        estimateCopy(layout, dev, devSize, fp);
+
+    return 0;
+}
+
+int footprintFits(const Footprint *fp)
+{
+    if (fp->chosen < 0)
+        return 0;
+
+    const StrategyEstimate *s = &fp->strategy[fp->chosen];
+    return s->needed <= s->available;
+}
+
+static void printStrategy(const char *name, const StrategyEstimate *s, int chosen)
+{
+    int secs = s->seconds + 0.5;
+
+    printf("  %-5s %-9s %8.2f of %8.2f GiB  ~%dm %02ds%s\n", name, chosen ? "(chosen)" : "",
+           s->needed / 1073741824.0, s->available / 1073741824.0, secs / 60, secs % 60,
+           s->needed > s->available ? "  DOES NOT FIT" : "");
+}
+
+void printFootprint(const UsbDevice *dev, const Footprint *fp)
+{
+    printf("Footprint on %s:\n", dev->dev_path);
+
+    if (fp->strategy[STRATEGY_RAW].possible)
+        printStrategy("raw", &fp->strategy[STRATEGY_RAW], fp->chosen == STRATEGY_RAW);
+
+    if (!fp->strategy[STRATEGY_COPY].possible)
+        return;
+
+    printStrategy("copy", &fp->strategy[STRATEGY_COPY], fp->chosen == STRATEGY_COPY);
+
+    if (fp->clusterSize == 0)
+        printf("  partition too small for FAT32\n");
+    else if (fp->format < 0)
+        printf("  copy figures estimated from the image size, its directory tree could not be read\n");
+    else
+        printf("  %lld files in %lld directories (%s), %u KiB clusters, %.1f MiB slack, %.1f MiB directories\n",
+               fp->files, fp->dirs, isoTreeFormatName(fp->format), fp->clusterSize / 1024,
+               fp->slack / 1048576.0, fp->dirBytes / 1048576.0);
+
+    if (fp->wimParts > 0)
+        printf("  install.wim is split into %d parts for FAT32\n", fp->wimParts);
+}
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "grapeusb.h"
+#include "utils.h"
+#include "hotplug.h"
+#include "options.h"
+#include "target.h"
+#include "exec.h"
+#include "write.h"
+#include "footprint.h"
+
+#define DEFAULT_INTERVAL_MS 500
+
+struct GrapeJob {
+    char iso[PATH_MAX];
+    char device[PATH_MAX];
+    char backup[PATH_MAX];
+    GrapeJobConfig config;      // string fields point at the copies above
+    IsoLayout layout;           // valid if config.layout is set
+    ProgressSlot progress;
+    pthread_t thread;
+    pthread_t monitor;
+    int monitored;
+    int joined;
+    atomic_int state;
+    atomic_int cancelled;
+    double start;
+    atomic_llong endMs;         // 0 while running
+    pthread_mutex_t lock;       // guards the finished wakeup
+    pthread_cond_t finished;
+    pthread_mutex_t joinLock;   // guards joined
+    char error[128];
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int grapeListDevices(GrapeDevice *list, int max)
+{
+    UsbDevice found[MAX_DEVICES];
+    int n = getUsbDevices(found, MAX_DEVICES);
+
+    for (int i = 0; i < n && i < max; i++)
+    {
+        snprintf(list[i].name, sizeof(list[i].name), "%s", found[i].name);
+        snprintf(list[i].path, sizeof(list[i].path), "%s", found[i].dev_path);
+        snprintf(list[i].size, sizeof(list[i].size), "%s", found[i].size);
+        snprintf(list[i].model, sizeof(list[i].model), "%s", found[i].model);
+    }
+
+    return n < max ? n : max;
+}
+
+int grapeInspectIso(const char *path, GrapeIsoInfo *info)
+{
+    struct stat st;
+
+    memset(info, 0, sizeof(*info));
+
+    if (stat(path, &st) != 0)
+        return -1;
+
+    info->size = st.st_size;
+    info->valid = isValidISO(path);
+
+    if (!info->valid)
+        return 0;
+
+    IsoType type = detectISOType(path);
+
+    info->windows = type == ISO_WINDOWS;
+    info->hybrid = type == ISO_LINUX && isHybridISO(path);
+
+    return 0;
+}
+
+static void setError(GrapeJob *job, const char *msg)
+{
+    snprintf(job->error, sizeof(job->error), "%s", msg);
+}
+
+// Runs on the job's own thread, so the thread-local options belong to this job alone
+static int runJob(GrapeJob *job)
+{
+    const GrapeJobConfig *c = &job->config;
+    IsoLayout own;
+
+    memset(&options, 0, sizeof(options));
+    options.iso = c->iso;
+    options.device = c->device;
+    options.refresh = c->refresh;
+    options.skipProbe = c->skipProbe;
+    options.fixedIo = c->fixedIo;
+    options.keepQueue = c->keepQueue;
+    options.backupPath = c->backupPath;
+
+    if (c->writeMethod && parseWriteMethod(c->writeMethod, &options.writeMethod) != 0)
+    {
+        setError(job, "Unknown write method");
+        return -1;
+    }
+
+    // The daemon hands over what its cache already knows, otherwise the image is read here
+    const IsoLayout *layout = c->layout ? &job->layout : &own;
+
+    if (!c->layout && (!isValidISO(c->iso) || inspectIsoLayout(c->iso, detectISOType(c->iso), &own) != 0))
+    {
+        setError(job, "Not a valid ISO image");
+        return -1;
+    }
+
+    UsbDevice dev = {0};
+    int spec = parseTarget(c->device, layout->size, &dev);
+    int res = -1;
+
+    if (spec < 0 || (spec == 0 && !findUsbByName(c->device, &dev)))
+        setError(job, "Target device not found");
+    // Raw writes run no external tools, only copy layouts need them
+    else if (!layout->hybrid && !checkDependencies(layout->type))
+        setError(job, "Required tools are missing");
+    else if (!options.refresh && !layoutHasEnoughSpace(layout, &dev))
+        setError(job, "Not enough space on the target");
+    else if ((res = create_bootable(c->iso, &dev, layout->type, layout->hybrid, &job->progress)) != 0)
+        setError(job, atomic_load(&job->progress.targetGone) ? "Target was removed" :
+                      atomic_load(&job->cancelled) ? "Cancelled" : "Creation failed");
+
+    if (spec > 0)
+        releaseTarget(&dev);
+
+    if (!c->layout)
+        freeIsoLayout(&own);
+
+    return res;
+}
+
+static void *jobWorker(void *arg)
+{
+    GrapeJob *job = arg;
+    int res = runJob(job);
+
+    GrapeJobState state = res == 0 ? GRAPE_JOB_DONE :
+                          atomic_load(&job->cancelled) ? GRAPE_JOB_CANCELLED : GRAPE_JOB_FAILED;
+
+    pthread_mutex_lock(&job->lock);
+    atomic_store(&job->endMs, (long long)((now() - job->start) * 1000) + 1);
+    atomic_store(&job->state, state);
+    pthread_cond_broadcast(&job->finished);
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+// Calls back every interval and once more with the final state
+static void *monitorWorker(void *arg)
+{
+    GrapeJob *job = arg;
+    unsigned interval = job->config.intervalMs ? job->config.intervalMs : DEFAULT_INTERVAL_MS;
+    GrapeMetrics m;
+
+    pthread_mutex_lock(&job->lock);
+
+    while (atomic_load(&job->state) == GRAPE_JOB_RUNNING)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+
+        deadline.tv_sec += interval / 1000;
+        deadline.tv_nsec += (interval % 1000) * 1000000L;
+
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&job->finished, &job->lock, &deadline);
+
+        if (atomic_load(&job->state) != GRAPE_JOB_RUNNING)
+            break;
+
+        pthread_mutex_unlock(&job->lock);
+        grapeJobPoll(job, &m);
+        job->config.onProgress(job, &m, job->config.user);
+        pthread_mutex_lock(&job->lock);
+    }
+
+    pthread_mutex_unlock(&job->lock);
+
+    grapeJobPoll(job, &m);
+    job->config.onProgress(job, &m, job->config.user);
+
+    return NULL;
+}
+
+GrapeJob *grapeJobStart(const GrapeJobConfig *config)
+{
+    if (!config || !config->iso || !config->device)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    GrapeJob *job = calloc(1, sizeof(*job));
+
+    if (!job)
+        return NULL;
+
+    // Embedders draw their own progress
+    progressSetDisplay(0);
+
+    snprintf(job->iso, sizeof(job->iso), "%s", config->iso);
+    snprintf(job->device, sizeof(job->device), "%s", config->device);
+
+    job->config = *config;
+    job->config.iso = job->iso;
+    job->config.device = job->device;
+
+    if (config->layout && copyIsoLayout(&job->layout, config->layout) != 0)
+    {
+        free(job);
+        return NULL;
+    }
+
+    if (config->backupPath)
+    {
+        snprintf(job->backup, sizeof(job->backup), "%s", config->backupPath);
+        job->config.backupPath = job->backup;
+    }
+
+    job->start = now();
+
+    const char *label = strrchr(job->device, '/');
+    progressInit(&job->progress, label ? label + 1 : job->device, 0);
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->finished, NULL);
+    pthread_mutex_init(&job->joinLock, NULL);
+
+    if (pthread_create(&job->thread, NULL, jobWorker, job) != 0)
+    {
+        pthread_mutex_destroy(&job->joinLock);
+        pthread_cond_destroy(&job->finished);
+        pthread_mutex_destroy(&job->lock);
+        freeIsoLayout(&job->layout);
+        free(job);
+        return NULL;
+    }
+
+    if (config->onProgress)
+        job->monitored = pthread_create(&job->monitor, NULL, monitorWorker, job) == 0;
+
+    return job;
+}
+
+// Counters are read while the job runs; the latency figures are a best-effort snapshot
+void grapeJobPoll(GrapeJob *job, GrapeMetrics *m)
+{
+    ProgressSlot *p = &job->progress;
+    long long endMs = atomic_load(&job->endMs);
+
+    progressSample(p);
+
+    memset(m, 0, sizeof(*m));
+    m->state = atomic_load(&job->state);
+    m->phase = atomic_load(&p->phase);
+    m->total = atomic_load(&p->total);
+    m->bytesRead = atomic_load(&p->bytesRead);
+    m->bytesWritten = atomic_load(&p->bytesWritten);
+    m->bytesFlushed = atomic_load(&p->bytesFlushed);
+    m->bytesVerified = atomic_load(&p->bytesVerified);
+    m->queueDepth = atomic_load(&p->queueDepth);
+    m->elapsed = endMs ? (endMs - 1) / 1000.0 : now() - job->start;
+    m->rate = m->elapsed > 0 ? m->bytesWritten / m->elapsed : 0;
+    m->latencyP50 = latencyPercentile(&p->latency, 0.50);
+    m->latencyP99 = latencyPercentile(&p->latency, 0.99);
+    m->latencyMax = p->latency.maxUs;
+    m->latencySource = latencySource(&p->latency);
+    m->targetGone = atomic_load(&p->targetGone);
+    m->rateDefault = atomic_load(&p->rateDefault);
+    m->rateTuned = atomic_load(&p->rateTuned);
+}
+
+GrapeJobState grapeJobWait(GrapeJob *job)
+{
+    pthread_mutex_lock(&job->joinLock);
+
+    if (!job->joined)
+    {
+        pthread_join(job->thread, NULL);
+
+        if (job->monitored)
+            pthread_join(job->monitor, NULL);
+
+        job->joined = 1;
+    }
+
+    pthread_mutex_unlock(&job->joinLock);
+
+    return atomic_load(&job->state);
+}
+
+// Every I/O stage of the job stops at its next chunk and its external tools are killed
+void grapeJobCancel(GrapeJob *job)
+{
+    if (atomic_load(&job->state) != GRAPE_JOB_RUNNING)
+        return;
+
+    atomic_store(&job->cancelled, 1);
+    progressRequestStop(&job->progress);
+    abortCommands(job->thread);
+}
+
+const char *grapeJobError(GrapeJob *job)
+{
+    return job->error[0] ? job->error : NULL;
+}
+
+void grapeJobFree(GrapeJob *job)
+{
+    if (!job)
+        return;
+
+    grapeJobWait(job);
+
+    pthread_mutex_destroy(&job->joinLock);
+    pthread_cond_destroy(&job->finished);
+    pthread_mutex_destroy(&job->lock);
+    freeIsoLayout(&job->layout);
+    free(job);
+}
@@ -0,0 +1,154 @@
+#include <string.h>
+
+#include "hash.h"
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * P1 + P4;
+}
+
+void hashInit(HashState *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->v[0] = P1 + P2;
+    h->v[1] = P2;
+    h->v[2] = 0;
+    h->v[3] = -P1;
+}
+
+static void consume(HashState *h, const unsigned char *p)
+{
+    h->v[0] = round64(h->v[0], read64(p));
+    h->v[1] = round64(h->v[1], read64(p + 8));
+    h->v[2] = round64(h->v[2], read64(p + 16));
+    h->v[3] = round64(h->v[3], read64(p + 24));
+}
+
+void hashUpdate(HashState *h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    h->total += len;
+
+    if (h->tailLen + len < 32)
+    {
+        memcpy(h->tail + h->tailLen, p, len);
+        h->tailLen += len;
+        return;
+    }
+
+    if (h->tailLen > 0)
+    {
+        size_t fill = 32 - h->tailLen;
+        memcpy(h->tail + h->tailLen, p, fill);
+        consume(h, h->tail);
+        p += fill;
+        len -= fill;
+        h->tailLen = 0;
+    }
+
+    while (len >= 32)
+    {
+        consume(h, p);
+        p += 32;
+        len -= 32;
+    }
+
+    memcpy(h->tail, p, len);
+    h->tailLen = len;
+}
+
+uint64_t hashFinal(const HashState *h)
+{
+    uint64_t acc;
+
+    if (h->total >= 32)
+    {
+        acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) + rotl(h->v[2], 12) + rotl(h->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            acc = merge64(acc, h->v[i]);
+    }
+    else
+    {
+        acc = h->v[2] + P5;
+    }
+
+    acc += h->total;
+
+    const unsigned char *p = h->tail;
+    size_t len = h->tailLen;
+
+    while (len >= 8)
+    {
+        acc ^= round64(0, read64(p));
+        acc = rotl(acc, 27) * P1 + P4;
+        p += 8;
+        len -= 8;
+    }
+
+    if (len >= 4)
+    {
+        acc ^= (uint64_t)read32(p) * P1;
+        acc = rotl(acc, 23) * P2 + P3;
+        p += 4;
+        len -= 4;
+    }
+
+    while (len > 0)
+    {
+        acc ^= (*p) * P5;
+        acc = rotl(acc, 11) * P1;
+        p++;
+        len--;
+    }
+
+    acc ^= acc >> 33;
+    acc *= P2;
+    acc ^= acc >> 29;
+    acc *= P3;
+    acc ^= acc >> 32;
+
+    return acc;
+}
+
+uint64_t hashBuffer(const void *data, size_t len)
+{
+    HashState h;
+
+    hashInit(&h);
+    hashUpdate(&h, data, len);
+    return hashFinal(&h);
+}
\ No newline at end of file
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "health.h"
+
+#define PROBE_BLOCK     4096
+#define PROBE_SAMPLES   64
+#define PROBE_MAGIC     "GRAPEPRB"
+
+// Tail latency this far above the median means the flash is struggling
+#define DEGRADED_TAIL_RATIO 16
+#define DEGRADED_TAIL_US    500000ULL
+#define DEGRADED_MAX_US     5000000ULL
+
+void latencyRecord(LatencyHist *h, unsigned long long us)
+{
+    int bucket = 0;
+
+    while (bucket < LATENCY_BUCKETS - 1 && (us >> (bucket + 1)) != 0)
+        bucket++;
+
+    h->buckets[bucket]++;
+    h->count++;
+    h->sumUs += us;
+
+    if (us > h->maxUs)
+        h->maxUs = us;
+}
+
+// Upper edge of the bucket holding the percentile, so within a factor of two
+unsigned long long latencyPercentile(const LatencyHist *h, double p)
+{
+    unsigned long long want = (unsigned long long)(h->count * p);
+    unsigned long long seen = 0;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+
+        if (seen > want)
+            return (2ULL << i) < h->maxUs ? (2ULL << i) : h->maxUs;
+    }
+
+    return h->maxUs;
+}
+
+const char *latencySource(const LatencyHist *h)
+{
+    return h->flushes ? "flush" : "direct";
+}
+
+// Prints the summary and returns 1 if the stick looks degraded
+int latencyReport(const char *label, const LatencyHist *h)
+{
+    if (h->count == 0)
+        return 0;
+
+    unsigned long long p50 = latencyPercentile(h, 0.50);
+    unsigned long long p99 = latencyPercentile(h, 0.99);
+    unsigned long long p999 = latencyPercentile(h, 0.999);
+
+    printf("%s %s over %llu %s: p50 %.1f ms, p99 %.1f ms, p99.9 %.1f ms, max %.1f ms\n",
+           label, h->flushes ? "flush latency" : "O_DIRECT write latency", h->count,
+           h->flushes ? "periodic flushes" : "chunks", p50 / 1000.0, p99 / 1000.0, p999 / 1000.0,
+           h->maxUs / 1000.0);
+
+    // A flush covers many chunks, so a slow but healthy stick can take seconds on each one
+    int degraded = (p99 >= p50 * DEGRADED_TAIL_RATIO && p99 >= DEGRADED_TAIL_US) ||
+                   (!h->flushes && h->maxUs >= DEGRADED_MAX_US);
+
+    if (degraded)
+        printf("\033[1;33mWarning: %s shows the tail latency of failing flash, consider replacing it\033[0m\n", label);
+
+    return degraded;
+}
+
+static uint64_t nextRandom(uint64_t *state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static void fillBlock(unsigned char *block, long long offset, uint64_t nonce)
+{
+    uint64_t state = nonce ^ (uint64_t)offset ^ 0x9E3779B97F4A7C15ULL;
+
+    for (int i = 0; i < PROBE_BLOCK; i += 8)
+    {
+        uint64_t v = nextRandom(&state);
+        memcpy(block + i, &v, 8);
+    }
+
+    memcpy(block, PROBE_MAGIC, 8);
+    memcpy(block + 8, &offset, 8);
+    memcpy(block + 16, &nonce, 8);
+}
+
+// Log-spaced near the start (where fakes keep their real flash) and evenly spread above it
+static int sampleOffsets(long long size, long long *offsets)
+{
+    int n = 0;
+    long long blocks = size / PROBE_BLOCK;
+
+    for (long long off = 1024 * 1024; off < size && n < PROBE_SAMPLES / 4; off *= 2)
+        offsets[n++] = off;
+
+    int even = PROBE_SAMPLES - n - 1;
+
+    for (int i = 1; i <= even; i++)
+        offsets[n++] = blocks * i / (even + 1) * PROBE_BLOCK;
+
+    offsets[n++] = (blocks - 1) * PROBE_BLOCK;
+
+    return n;
+}
+
+// Writes tagged blocks across the whole address space and reads them back.
+// Destroys the data at those offsets, so it only runs right before a full write.
+int probeCapacity(const char *devPath, ProbeResult *res)
+{
+    memset(res, 0, sizeof(*res));
+    res->firstBad = -1;
+
+    int fd = open(devPath, O_RDWR | O_DIRECT | O_EXCL);
+
+    if (fd < 0)
+    {
+        perror("Failed to open device for probing");
+        return -1;
+    }
+
+    unsigned long long size = 0;
+    unsigned char *block = NULL;
+    unsigned char *expect = NULL;
+    long long offsets[PROBE_SAMPLES];
+    int rc = -1;
+
+    if (ioctl(fd, BLKGETSIZE64, &size) != 0 ||
+        posix_memalign((void **)&block, PROBE_BLOCK, PROBE_BLOCK) != 0 ||
+        posix_memalign((void **)&expect, PROBE_BLOCK, PROBE_BLOCK) != 0)
+        goto out;
+
+    res->reported = size;
+    res->samples = sampleOffsets(size, offsets);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t nonce = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ (uint64_t)getpid();
+
+    for (int i = 0; i < res->samples; i++)
+    {
+        fillBlock(block, offsets[i], nonce);
+
+        if (pwrite(fd, block, PROBE_BLOCK, offsets[i]) != PROBE_BLOCK)
+        {
+            // A write past the real flash may fail outright, which is just as telling
+            if (res->firstBad < 0 || offsets[i] < res->firstBad)
+                res->firstBad = offsets[i];
+        }
+    }
+
+    // Make sure the read-back comes from the flash, not from any cache on the way
+    fsync(fd);
+    ioctl(fd, BLKFLSBUF, 0);
+
+    for (int i = 0; i < res->samples; i++)
+    {
+        fillBlock(expect, offsets[i], nonce);
+
+        int ok = pread(fd, block, PROBE_BLOCK, offsets[i]) == PROBE_BLOCK &&
+                 memcmp(block, expect, PROBE_BLOCK) == 0;
+
+        if (ok && offsets[i] > res->lastGood)
+            res->lastGood = offsets[i];
+
+        if (!ok)
+        {
+            res->bad++;
+
+            if (res->firstBad < 0 || offsets[i] < res->firstBad)
+                res->firstBad = offsets[i];
+        }
+    }
+
+    rc = 0;
+
+out:
+    free(block);
+    free(expect);
+    close(fd);
+
+    return rc;
+}
+
+void printProbeResult(const char *devPath, const ProbeResult *res)
+{
+    if (res->bad == 0 && res->firstBad < 0)
+    {
+        printf("Capacity probe: %d samples across %.1f GiB of %s read back intact\n",
+               res->samples, res->reported / 1073741824.0, devPath);
+        return;
+    }
+
+    printf("\033[1;31mCapacity probe: %d of %d samples on %s came back wrong!\033[0m\n",
+           res->bad, res->samples, devPath);
+    printf("Reported size %.1f GiB, first bad sample at %.1f GiB: this stick is likely counterfeit\n",
+           res->reported / 1073741824.0, res->firstBad / 1073741824.0);
+}
\ No newline at end of file
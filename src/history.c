@@ -0,0 +1,621 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define JSMN_STATIC
+#include "jsmn.h"
+
+#include "history.h"
+#include "target.h"
+#include "utils.h"
+
+#define RECORD_MAX       4096
+#define RECORD_TOKENS    128
+#define DEGRADED_RATIO   0.7     // last run below this share of the stick's earlier median
+#define DEGRADED_P99     2.0     // or its p99 write latency grown by this factor
+#define MIN_RUNS         3       // earlier runs needed before a stick is judged
+
+typedef struct {
+    char host[64];
+    char model[192];            // vendor and model
+    char serial[64];
+    char strategy[16];
+    double rate;                // bytes/s over the writing and copying phases
+    double p99;                 // microseconds, 0 if not measured
+    char latOf[8];              // what p99 timed, direct chunk writes or periodic flushes
+} HistoryRun;
+
+typedef struct {
+    char key[256];
+    double *rates;
+    int count;
+    int cap;
+} HistoryGroup;
+
+typedef struct {
+    HistoryGroup *items;
+    int count;
+    int cap;
+} GroupList;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} Json;
+
+static void readAttr(const char *dir, const char *attr, char *out, size_t len)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, attr);
+
+    out[0] = '\0';
+
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        return;
+
+    if (fgets(out, len, f))
+    {
+        size_t n = strlen(out);
+
+        while (n > 0 && (out[n - 1] == '\n' || out[n - 1] == ' '))
+            out[--n] = '\0';
+    }
+
+    fclose(f);
+}
+
+// The USB device sits a few levels above the SCSI disk and holds the serial and the link speed
+static int findUsbDevice(const char *name, char *out, size_t len)
+{
+    char path[PATH_MAX], real[PATH_MAX];
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/device", name);
+
+    if (!realpath(path, real))
+        return -1;
+
+    while (strcmp(real, "/sys/devices") != 0 && strlen(real) > 1)
+    {
+        char speed[PATH_MAX + 16], vendor[PATH_MAX + 16];
+        snprintf(speed, sizeof(speed), "%s/speed", real);
+        snprintf(vendor, sizeof(vendor), "%s/idVendor", real);
+
+        if (access(speed, R_OK) == 0 && access(vendor, R_OK) == 0)
+        {
+            snprintf(out, len, "%s", real);
+            return 0;
+        }
+
+        char *slash = strrchr(real, '/');
+        *slash = '\0';
+    }
+
+    return -1;
+}
+
+// Primary volume descriptor's volume identifier, which names the release better than the file does
+static void isoVolumeId(const char *iso, char *out, size_t len)
+{
+    char pvd[72];
+    int fd = open(iso, O_RDONLY | O_CLOEXEC);
+
+    out[0] = '\0';
+
+    if (fd < 0)
+        return;
+
+    if (readFull(fd, pvd, sizeof(pvd), 32768) == 0 && pvd[0] == 1 && memcmp(pvd + 1, "CD001", 5) == 0)
+    {
+        int n = 32;
+
+        while (n > 0 && (pvd[40 + n - 1] == ' ' || pvd[40 + n - 1] == '\0'))
+            n--;
+
+        snprintf(out, len, "%.*s", n, pvd + 40);
+    }
+
+    close(fd);
+}
+
+__attribute__((format(printf, 2, 3)))
+static void jsonPut(Json *j, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    int n = vsnprintf(j->buf + j->len, j->cap - j->len, fmt, ap);
+
+    va_end(ap);
+
+    if (n > 0)
+        j->len = j->len + n < j->cap ? j->len + n : j->cap - 1;
+}
+
+static void jsonString(Json *j, const char *key, const char *value)
+{
+    jsonPut(j, "%s\"%s\":\"", j->len > 1 ? "," : "", key);
+
+    for (const unsigned char *p = (const unsigned char *)value; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            jsonPut(j, "\\%c", *p);
+        else if (*p < 0x20)
+            jsonPut(j, "\\u%04x", *p);
+        else
+            jsonPut(j, "%c", *p);
+    }
+
+    jsonPut(j, "\"");
+}
+
+// Appends one line per finished job; several jobs may append at once, so the line goes in one locked write
+int historyRecord(const char *iso, const char *strategy, const UsbDevice *dev, ProgressSlot *progress,
+                  double seconds, int ok)
+{
+    char buf[RECORD_MAX], host[64], volume[40], usb[PATH_MAX], block[PATH_MAX];
+    char vendor[64] = "", model[128] = "", serial[64] = "", speed[16] = "";
+    struct stat st;
+    Json j = {buf, 0, sizeof(buf)};
+
+    if (gethostname(host, sizeof(host)) != 0)
+        host[0] = '\0';
+
+    host[sizeof(host) - 1] = '\0';
+    isoVolumeId(iso, volume, sizeof(volume));
+
+    if (dev->kind == TARGET_BLOCK)
+    {
+        snprintf(block, sizeof(block), "/sys/class/block/%s/device", dev->name);
+        readAttr(block, "vendor", vendor, sizeof(vendor));
+        readAttr(block, "model", model, sizeof(model));
+
+        if (findUsbDevice(dev->name, usb, sizeof(usb)) == 0)
+        {
+            readAttr(usb, "serial", serial, sizeof(serial));
+            readAttr(usb, "speed", speed, sizeof(speed));
+
+            if (vendor[0] == '\0')
+                readAttr(usb, "manufacturer", vendor, sizeof(vendor));
+        }
+    }
+
+    // Kernel-tracked copies only know their byte count once sampled
+    progressSample(progress);
+
+    char isoName[PATH_MAX];
+    snprintf(isoName, sizeof(isoName), "%s", iso);
+
+    jsonPut(&j, "{\"time\":%lld", (long long)time(NULL));
+    jsonString(&j, "host", host);
+    jsonString(&j, "iso", basename(isoName));
+    jsonPut(&j, ",\"isoSize\":%lld", stat(iso, &st) == 0 ? (long long)st.st_size : -1LL);
+    jsonString(&j, "volume", volume);
+    jsonString(&j, "strategy", strategy);
+    jsonString(&j, "target", dev->dev_path);
+    jsonString(&j, "vendor", vendor);
+    jsonString(&j, "model", model);
+    jsonString(&j, "serial", serial);
+    jsonPut(&j, ",\"speedMbps\":%d", atoi(speed));
+    jsonPut(&j, ",\"bytes\":%llu", atomic_load(&progress->bytesWritten));
+    jsonPut(&j, ",\"seconds\":%.3f,\"phases\":{", seconds);
+
+    for (int i = 0; i < progress->phaseCount; i++)
+        jsonPut(&j, "%s\"%s\":%.3f", i ? "," : "", progress->phaseTimes[i].name, progress->phaseTimes[i].seconds);
+
+    jsonPut(&j, "}");
+
+    const LatencyHist *lat = &progress->latency;
+
+    if (lat->count > 0)
+        jsonPut(&j, ",\"latOf\":\"%s\",\"latAvgUs\":%llu,\"latP99Us\":%llu", latencySource(lat),
+                lat->sumUs / lat->count, latencyPercentile(lat, 0.99));
+
+    jsonPut(&j, ",\"ok\":%s}\n", ok ? "true" : "false");
+
+    if (j.len == j.cap - 1)
+    {
+        fprintf(stderr, "History record too long, not saved\n");
+        return -1;
+    }
+
+    char dir[] = HISTORY_PATH;
+
+    if (mkdir(dirname(dir), 0755) != 0 && errno != EEXIST)
+    {
+        perror("Failed to create history directory");
+        return -1;
+    }
+
+    int fd = open(HISTORY_PATH, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        perror("Failed to open job history");
+        return -1;
+    }
+
+    flock(fd, LOCK_EX);
+
+    int res = write(fd, buf, j.len) == (ssize_t)j.len ? 0 : -1;
+
+    if (res != 0)
+        perror("Failed to write job history");
+
+    close(fd);
+    return res;
+}
+
+// Index of the token after t[i] and everything nested in it
+static int skipToken(const jsmntok_t *t, int i)
+{
+    int next = i + 1;
+
+    if (t[i].type == JSMN_OBJECT)
+    {
+        for (int k = 0; k < t[i].size; k++)
+            next = skipToken(t, skipToken(t, next));
+    }
+    else if (t[i].type == JSMN_ARRAY)
+    {
+        for (int k = 0; k < t[i].size; k++)
+            next = skipToken(t, next);
+    }
+
+    return next;
+}
+
+static int tokenIs(const char *js, const jsmntok_t *t, const char *s)
+{
+    return (int)strlen(s) == t->end - t->start && strncmp(js + t->start, s, t->end - t->start) == 0;
+}
+
+// Escapes are rare in these fields and left as they are
+static void tokenCopy(const char *js, const jsmntok_t *t, char *out, size_t len)
+{
+    snprintf(out, len, "%.*s", t->end - t->start, js + t->start);
+}
+
+static double tokenNumber(const char *js, const jsmntok_t *t)
+{
+    return strtod(js + t->start, NULL);
+}
+
+// Only successful runs that wrote something say anything about speed
+static int parseRun(const char *line, size_t len, HistoryRun *run)
+{
+    jsmn_parser parser;
+    jsmntok_t t[RECORD_TOKENS];
+    char vendor[64] = "", model[128] = "";
+    double bytes = 0, seconds = 0, busy = 0;
+    int ok = 0;
+
+    jsmn_init(&parser);
+
+    int n = jsmn_parse(&parser, line, len, t, RECORD_TOKENS);
+
+    if (n < 1 || t[0].type != JSMN_OBJECT)
+        return -1;
+
+    memset(run, 0, sizeof(*run));
+
+    for (int i = 1; i < n; i = skipToken(t, i + 1))
+    {
+        const jsmntok_t *key = &t[i], *value = &t[i + 1];
+
+        if (tokenIs(line, key, "host"))
+            tokenCopy(line, value, run->host, sizeof(run->host));
+        else if (tokenIs(line, key, "vendor"))
+            tokenCopy(line, value, vendor, sizeof(vendor));
+        else if (tokenIs(line, key, "model"))
+            tokenCopy(line, value, model, sizeof(model));
+        else if (tokenIs(line, key, "serial"))
+            tokenCopy(line, value, run->serial, sizeof(run->serial));
+        else if (tokenIs(line, key, "strategy"))
+            tokenCopy(line, value, run->strategy, sizeof(run->strategy));
+        else if (tokenIs(line, key, "bytes"))
+            bytes = tokenNumber(line, value);
+        else if (tokenIs(line, key, "seconds"))
+            seconds = tokenNumber(line, value);
+        else if (tokenIs(line, key, "latP99Us"))
+            run->p99 = tokenNumber(line, value);
+        else if (tokenIs(line, key, "latOf"))
+            tokenCopy(line, value, run->latOf, sizeof(run->latOf));
+        else if (tokenIs(line, key, "ok"))
+            ok = tokenIs(line, value, "true");
+        else if (tokenIs(line, key, "phases") && value->type == JSMN_OBJECT)
+        {
+            for (int k = 0, p = i + 2; k < value->size; k++, p = skipToken(t, p + 1))
+            {
+                if (tokenIs(line, &t[p], "writing") || tokenIs(line, &t[p], "copying"))
+                    busy += tokenNumber(line, &t[p + 1]);
+            }
+        }
+    }
+
+    if (!ok || bytes <= 0)
+        return -1;
+
+    // Probing, formatting and verifying are left out, so the figure is the stick's write speed
+    run->rate = bytes / (busy > 0 ? busy : seconds > 0 ? seconds : 1);
+
+    if (vendor[0] && model[0])
+        snprintf(run->model, sizeof(run->model), "%s %s", vendor, model);
+    else
+        snprintf(run->model, sizeof(run->model), "%s", vendor[0] ? vendor : model[0] ? model : "(image)");
+
+    return 0;
+}
+
+static int addToGroup(GroupList *list, const char *key, double rate)
+{
+    int i = 0;
+
+    while (i < list->count && strcmp(list->items[i].key, key) != 0)
+        i++;
+
+    if (i == list->count)
+    {
+        if (list->count == list->cap)
+        {
+            int cap = list->cap ? list->cap * 2 : 16;
+            HistoryGroup *items = realloc(list->items, cap * sizeof(*items));
+
+            if (!items)
+                return -1;
+
+            list->items = items;
+            list->cap = cap;
+        }
+
+        memset(&list->items[i], 0, sizeof(HistoryGroup));
+        snprintf(list->items[i].key, sizeof(list->items[i].key), "%s", key);
+        list->count++;
+    }
+
+    HistoryGroup *g = &list->items[i];
+
+    if (g->count == g->cap)
+    {
+        int cap = g->cap ? g->cap * 2 : 8;
+        double *rates = realloc(g->rates, cap * sizeof(*rates));
+
+        if (!rates)
+            return -1;
+
+        g->rates = rates;
+        g->cap = cap;
+    }
+
+    g->rates[g->count++] = rate;
+    return 0;
+}
+
+static double mean(const double *v, int n)
+{
+    double sum = 0;
+
+    for (int i = 0; i < n; i++)
+        sum += v[i];
+
+    return n ? sum / n : 0;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(const double *v, int n)
+{
+    double *sorted = malloc(n * sizeof(*sorted));
+
+    if (!sorted || n == 0)
+    {
+        free(sorted);
+        return 0;
+    }
+
+    memcpy(sorted, v, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compareDouble);
+
+    double m = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+
+    free(sorted);
+    return m;
+}
+
+// Trend is the newer half of the runs against the older half, in file order
+static void printGroups(const char *title, const GroupList *list)
+{
+    printf("%s\n", title);
+    printf("  %-40s %5s %9s %8s\n", "", "runs", "MB/s", "trend");
+
+    for (int i = 0; i < list->count; i++)
+    {
+        const HistoryGroup *g = &list->items[i];
+        int half = g->count / 2;
+        double older = mean(g->rates, half);
+        double newer = mean(g->rates + g->count - half, half);
+
+        printf("  %-40.40s %5d %9.1f ", g->key, g->count, mean(g->rates, g->count) / 1048576.0);
+
+        if (half > 0 && older > 0)
+            printf("%+7.0f%%\n", (newer - older) * 100 / older);
+        else
+            printf("%8s\n", "-");
+    }
+
+    printf("\n");
+}
+
+static void freeGroups(GroupList *list)
+{
+    for (int i = 0; i < list->count; i++)
+        free(list->items[i].rates);
+
+    free(list->items);
+}
+
+// A stick is judged against its own earlier runs with the same strategy, never against other sticks
+static int flagDegraded(const HistoryRun *runs, int count)
+{
+    int flagged = 0;
+
+    for (int last = count - 1; last >= 0; last--)
+    {
+        const HistoryRun *r = &runs[last];
+        int seenLater = 0;
+
+        if (r->serial[0] == '\0')
+            continue;
+
+        for (int k = last + 1; k < count && !seenLater; k++)
+        {
+            seenLater = strcmp(runs[k].serial, r->serial) == 0 && strcmp(runs[k].model, r->model) == 0 &&
+                        strcmp(runs[k].strategy, r->strategy) == 0;
+        }
+
+        // Only each stick's latest run is compared, against everything before it
+        if (seenLater)
+            continue;
+
+        double rates[256], p99s[256];
+        int n = 0, m = 0;
+
+        for (int k = 0; k < last && n < 256; k++)
+        {
+            if (strcmp(runs[k].serial, r->serial) != 0 || strcmp(runs[k].model, r->model) != 0 ||
+                strcmp(runs[k].strategy, r->strategy) != 0)
+                continue;
+
+            rates[n++] = runs[k].rate;
+
+            // Flush times and direct write times are not comparable
+            if (runs[k].p99 > 0 && strcmp(runs[k].latOf, r->latOf) == 0)
+                p99s[m++] = runs[k].p99;
+        }
+
+        if (n < MIN_RUNS)
+            continue;
+
+        double before = median(rates, n);
+        double p99Before = median(p99s, m);
+        int slower = r->rate < before * DEGRADED_RATIO;
+        int laggier = m >= MIN_RUNS && r->p99 > 0 && r->p99 > p99Before * DEGRADED_P99;
+
+        if (!slower && !laggier)
+            continue;
+
+        if (!flagged)
+            printf("\033[1;33mDegraded sticks\033[0m\n");
+
+        flagged++;
+
+        printf("  %s (serial %s, %s): %.1f MB/s last run, %.1f MB/s median of %d before (%+.0f%%)",
+               r->model, r->serial, r->strategy, r->rate / 1048576.0, before / 1048576.0, n,
+               (r->rate - before) * 100 / before);
+
+        if (laggier)
+            printf(", p99 %s latency %.1f ms against %.1f ms", r->latOf, r->p99 / 1000.0, p99Before / 1000.0);
+
+        printf("\n");
+    }
+
+    if (!flagged)
+        printf("No stick has slowed down across its runs\n");
+
+    return flagged;
+}
+
+int historyReport(const char *path)
+{
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+    {
+        if (errno == ENOENT)
+        {
+            printf("No jobs recorded yet in %s\n", path);
+            return 0;
+        }
+
+        perror(path);
+        return -1;
+    }
+
+    HistoryRun *runs = NULL;
+    int count = 0, cap = 0, skipped = 0;
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &lineCap, f)) > 0)
+    {
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            HistoryRun *grown = realloc(runs, cap * sizeof(*runs));
+
+            if (!grown)
+                break;
+
+            runs = grown;
+        }
+
+        if (parseRun(line, len, &runs[count]) == 0)
+            count++;
+        else
+            skipped++;
+    }
+
+    free(line);
+    fclose(f);
+
+    GroupList byModel = {0}, byHost = {0}, byStrategy = {0};
+
+    for (int i = 0; i < count; i++)
+    {
+        char key[256];
+
+        // Raw writes and file copies run at very different speeds, so models are split by strategy
+        snprintf(key, sizeof(key), "%s [%s]", runs[i].model, runs[i].strategy);
+        addToGroup(&byModel, key, runs[i].rate);
+        addToGroup(&byHost, runs[i].host, runs[i].rate);
+        addToGroup(&byStrategy, runs[i].strategy, runs[i].rate);
+    }
+
+    printf("%d successful jobs in %s", count, path);
+
+    if (skipped)
+        printf(" (%d failed or unreadable lines left out)", skipped);
+
+    printf("\n\n");
+
+    if (count > 0)
+    {
+        printGroups("By model", &byModel);
+        printGroups("By host", &byHost);
+        printGroups("By strategy", &byStrategy);
+        flagDegraded(runs, count);
+    }
+
+    freeGroups(&byModel);
+    freeGroups(&byHost);
+    freeGroups(&byStrategy);
+    free(runs);
+
+    return 0;
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "devices.h"
+#include "exec.h"
+#include "hotplug.h"
+
+typedef struct {
+    char action[16];
+    char subsystem[16];
+    char devtype[16];
+    char devname[64];
+    char devpath[256];
+} Uevent;
+
+static UsbDevice table[MAX_DEVICES];
+static int tableCount = 0;
+static int tableFd = -1;
+
+static int openUeventSocket()
+{
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0)
+    {
+        perror("uevent socket failed");
+        return -1;
+    }
+
+    struct sockaddr_nl addr = {0};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // kernel events, not the udev re-broadcast
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("uevent bind failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Returns 1 for a uevent, 0 when the socket is drained
+static int readUevent(int fd, Uevent *ev)
+{
+    char buf[4096];
+    struct sockaddr_nl src;
+    struct iovec iov = {buf, sizeof(buf) - 1};
+    struct msghdr msg = {0};
+
+    msg.msg_name = &src;
+    msg.msg_namelen = sizeof(src);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    while (1)
+    {
+        ssize_t n = recvmsg(fd, &msg, 0);
+
+        if (n <= 0)
+            return 0;
+
+        // Only trust messages coming from the kernel itself
+        if (src.nl_pid != 0)
+            continue;
+
+        buf[n] = '\0';
+        memset(ev, 0, sizeof(*ev));
+
+        // "action@devpath\0KEY=VALUE\0KEY=VALUE\0..."
+        for (char *p = buf + strlen(buf) + 1; p < buf + n; p += strlen(p) + 1)
+        {
+            if (strncmp(p, "ACTION=", 7) == 0)
+                snprintf(ev->action, sizeof(ev->action), "%s", p + 7);
+            else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+                snprintf(ev->subsystem, sizeof(ev->subsystem), "%s", p + 10);
+            else if (strncmp(p, "DEVTYPE=", 8) == 0)
+                snprintf(ev->devtype, sizeof(ev->devtype), "%s", p + 8);
+            else if (strncmp(p, "DEVNAME=", 8) == 0)
+                snprintf(ev->devname, sizeof(ev->devname), "%s", p + 8);
+            else if (strncmp(p, "DEVPATH=", 8) == 0)
+                snprintf(ev->devpath, sizeof(ev->devpath), "%s", p + 8);
+        }
+
+        if (strcmp(ev->subsystem, "block") == 0)
+            return 1;
+    }
+}
+
+static int findInTable(const char *name)
+{
+    for (int i = 0; i < tableCount; i++)
+    {
+        if (strcmp(table[i].name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+int deviceTableInit()
+{
+    if (tableFd >= 0)
+        return tableFd;
+
+    // Subscribe first so nothing plugged in during the scan is missed
+    tableFd = openUeventSocket();
+    tableCount = getUsbDevices(table, MAX_DEVICES);
+
+    return tableFd;
+}
+
+int deviceTableFd()
+{
+    return tableFd;
+}
+
+// Applies pending uevents; returns 1 if the table changed
+int deviceTableProcess()
+{
+    Uevent ev;
+    int changed = 0;
+
+    while (tableFd >= 0 && readUevent(tableFd, &ev))
+    {
+        if (strcmp(ev.devtype, "disk") != 0 || ev.devname[0] == '\0')
+            continue;
+
+        int idx = findInTable(ev.devname);
+        UsbDevice dev;
+
+        // "change" covers media insert/eject on card readers, re-read it like an add
+        int present = strcmp(ev.action, "remove") != 0 && readUsbDevice(ev.devname, &dev);
+
+        if (present && idx >= 0)
+        {
+            if (memcmp(&table[idx], &dev, sizeof(dev)) != 0)
+            {
+                table[idx] = dev;
+                changed = 1;
+            }
+        }
+        else if (present && tableCount < MAX_DEVICES)
+        {
+            table[tableCount++] = dev;
+            changed = 1;
+        }
+        else if (!present && idx >= 0)
+        {
+            table[idx] = table[--tableCount];
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+int deviceTableSnapshot(UsbDevice *list, int max)
+{
+    int n = tableCount < max ? tableCount : max;
+
+    memcpy(list, table, n * sizeof(UsbDevice));
+    return n;
+}
+
+static int eventHitsTarget(const TargetWatch *w, const Uevent *ev)
+{
+    char needle[80];
+    size_t len = strlen(ev->devpath);
+
+    // Partitions go first on unplug: /devices/.../block/sdb/sdb1
+    snprintf(needle, sizeof(needle), "/block/%s", w->name);
+    const char *hit = strstr(ev->devpath, needle);
+
+    if (!hit)
+        return 0;
+
+    hit += strlen(needle);
+    return hit == ev->devpath + len || *hit == '/';
+}
+
+static void *watchWorker(void *arg)
+{
+    TargetWatch *w = arg;
+    struct pollfd pfd = {w->fd, POLLIN, 0};
+
+    while (!atomic_load(&w->stop))
+    {
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+
+        Uevent ev;
+
+        while (readUevent(w->fd, &ev))
+        {
+            if (strcmp(ev.action, "remove") == 0 && eventHitsTarget(w, &ev) && !atomic_exchange(&w->slot->targetGone, 1))
+            {
+                fprintf(stderr, "\n\033[1;31mTarget %s was removed, aborting!\033[0m\n", w->name);
+                progressRequestStop(w->slot);
+                abortCommands(w->owner);
+            }
+        }
+    }
+
+    close(w->fd);
+    return NULL;
+}
+
+// Watches for the write target disappearing and stops the calling thread's job when it does
+int startTargetWatch(TargetWatch *w, const char *name, ProgressSlot *slot)
+{
+    atomic_store(&w->stop, 0);
+    w->running = 0;
+    w->slot = slot;
+    w->owner = pthread_self();
+    snprintf(w->name, sizeof(w->name), "%s", name);
+
+    w->fd = openUeventSocket();
+
+    if (w->fd < 0)
+        return -1;
+
+    if (pthread_create(&w->thread, NULL, watchWorker, w) != 0)
+    {
+        close(w->fd);
+        return -1;
+    }
+
+    w->running = 1;
+    return 0;
+}
+
+void stopTargetWatch(TargetWatch *w)
+{
+    if (!w->running)
+        return;
+
+    atomic_store(&w->stop, 1);
+    pthread_join(w->thread, NULL);
+    w->running = 0;
+}
\ No newline at end of file
@@ -1,49 +1,86 @@
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "utils.h"
-#include "exec.h"
 #include "iso.h"
+#include "loopdev.h"
+#include "trace.h"
 
-#define MNT_ISO_PATH "/mnt/grapeusb_iso"
+#define ISO_SECTOR 2048
+#define ISO_READAHEAD_KB 4096
 
 #include <sys/stat.h>
+#include <sys/mount.h>
 #include <unistd.h>
+#include <errno.h>
+#include <linux/loop.h>
 
-int mountISO(const char *iso)
+int mountISO(const char *iso, const char *dir)
 {
-    struct stat st;
+    // Direct I/O keeps the image out of the page cache twice (backing file and loop device),
+    // autoclear detaches the loop device once it is unmounted
+    unsigned long long traced = traceNow();
+    char loopPath[64];
+    int loopFd = loopAttachFd(iso, LO_FLAGS_READ_ONLY | LO_FLAGS_DIRECT_IO | LO_FLAGS_AUTOCLEAR,
+                              ISO_SECTOR, loopPath, sizeof(loopPath));
 
-    if (stat(MNT_ISO_PATH, &st) != 0)
-    {
-        if (mkdir(MNT_ISO_PATH, 0755) != 0)
-        {
-            perror("Failed to create ISO mount directory");
-            return -1;
-        }
-    }
+    if (loopFd < 0)
+        return -1;
+
+    // The copy reads files front to back, so a deep read-ahead pays off
+    loopSetReadAhead(loopFd, ISO_READAHEAD_KB);
+    traceSpan("mount", "loop attach", traced, -1);
+    traced = traceNow();
+
+    // Windows images keep their files in UDF and only a stub in ISO9660, so UDF goes first
+    const char *types[] = {"udf", "iso9660"};
+    int res = -1;
+
+    for (int i = 0; i < 2 && res != 0; i++)
+        res = mount(loopPath, dir, types[i], MS_RDONLY | MS_NODEV | MS_NOSUID, NULL);
+
+    traceSpan("mount", "mount iso", traced, -1);
+
+    if (res != 0)
+        perror("Failed to mount ISO");
+    else if (!loopUsesDirectIO(loopPath))
+        fprintf(stderr, "Note: %s does not support direct I/O, the ISO is read through the page cache\n", iso);
 
-    char *cmd[] = {
-        "mount",
-        "-o", "loop",
-        (char*)iso,
-        MNT_ISO_PATH,
-        NULL
-    };
+    // The mount holds its own reference; with it gone this close detaches the device
+    close(loopFd);
 
-    return run_checked(cmd);
+    return res;
 }
 
-void unmountISO()
+void unmountISO(const char *dir)
 {
-    char *cmd[] = {"umount", MNT_ISO_PATH, NULL};
-    run(cmd);
+    if (umount2(dir, 0) != 0 && errno != EINVAL && errno != ENOENT)
+        perror("Failed to unmount ISO");
 }
 
+// Looks for ISO9660 ("CD001") or UDF ("BEA01"/"NSR0x") volume descriptors from sector 16 on
 int isValidISO(const char *iso)
 {
-    char *blkid[] = {"blkid", "-o", "value", "-s", "TYPE", (char*)iso, NULL};
-    return run(blkid) == 0;
+    int fd = open(iso, O_RDONLY);
+
+    if (fd < 0)
+        return 0;
+
+    char desc[16][2048];
+    ssize_t n = pread(fd, desc, sizeof(desc), 16 * 2048);
+    close(fd);
+
+    for (int i = 0; i < 16 && (i + 1) * 2048 <= n; i++)
+    {
+        if (memcmp(desc[i] + 1, "CD001", 5) == 0 ||
+            memcmp(desc[i] + 1, "BEA01", 5) == 0 ||
+            memcmp(desc[i] + 1, "NSR0", 4) == 0)
+            return 1;
+    }
+
+    return 0;
 }
 
 IsoType detectISOType(const char *iso)
@@ -53,25 +90,44 @@ IsoType detectISOType(const char *iso)
     return ISO_LINUX;
 }
 
-int validateISOArgument(const char* iso, IsoType* type)
+enum {
+    ISO_OK,
+    ISO_MISSING,
+    ISO_INVALID,
+    ISO_UNSUPPORTED
+};
+
+static int checkISO(const char *iso, IsoType *type)
 {
-    if (!fileExists(iso)) {
-        fprintf(stderr, "ISO file does not exist: %s\n", iso);
-        return 1;
-    }
+    if (!fileExists(iso))
+        return ISO_MISSING;
 
     if (!isValidISO(iso))
-    {
-        fprintf(stderr, "ISO file is not valid: %s\n", iso);
-        return 1;
-    }
+        return ISO_INVALID;
 
     *type = detectISOType(iso);
     if (*type == ISO_UNKNOWN)
-    {
+        return ISO_UNSUPPORTED;
+
+    return ISO_OK;
+}
+
+static int reportISOCheck(const char *iso, int res)
+{
+    if (res == ISO_MISSING)
+        fprintf(stderr, "ISO file does not exist: %s\n", iso);
+    else if (res == ISO_INVALID)
+        fprintf(stderr, "ISO file is not valid: %s\n", iso);
+    else if (res == ISO_UNSUPPORTED)
         fprintf(stderr, "ISO file type is unsupported: %s\n", iso);
+
+    return res == ISO_OK ? 0 : 1;
+}
+
+int validateISOArgument(const char* iso, IsoType* type)
+{
+    if (reportISOCheck(iso, checkISO(iso, type)) != 0)
         return 1;
-    }
 
     if (*type == ISO_WINDOWS)
         printf("Detected Windows ISO\n");
@@ -81,3 +137,39 @@ int validateISOArgument(const char* iso, IsoType* type)
 
     return 0;
 }
+
+// Validation runs next to the menu and is only waited for once the ISO is needed
+static pthread_t validationThread;
+static int validationStarted = 0;
+static int validationResult = ISO_OK;
+static IsoType validatedType = ISO_UNKNOWN;
+static const char *validatedIso = NULL;
+
+static void *validationWorker(void *arg)
+{
+    (void)arg;
+    validationResult = checkISO(validatedIso, &validatedType);
+    return NULL;
+}
+
+void startIsoValidation(const char *iso)
+{
+    validatedIso = iso;
+
+    if (pthread_create(&validationThread, NULL, validationWorker, NULL) == 0)
+        validationStarted = 1;
+    else
+        validationWorker(NULL);
+}
+
+int finishIsoValidation(IsoType *type)
+{
+    if (validationStarted)
+    {
+        pthread_join(validationThread, NULL);
+        validationStarted = 0;
+    }
+
+    *type = validatedType;
+    return reportISOCheck(validatedIso, validationResult);
+}
\ No newline at end of file
@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "isocache.h"
+#include "write.h"
+#include "trace.h"
+
+// A second job with the same image is what makes pinning worth its memory
+#define PIN_AFTER_USES 2
+
+typedef enum {
+    PROBE_RUNNING,
+    PROBE_DONE,
+    PROBE_DROPPED           // its entry moved on, the worker frees it
+} ProbeState;
+
+// One inspection off the caller's thread; handed over like a pin, whoever leaves PROBE_RUNNING owns it
+typedef struct IsoProbe {
+    char path[4096];
+    int valid;
+    IsoType type;
+    IsoLayout layout;
+    atomic_int state;
+} IsoProbe;
+
+static IsoEntry cache[ISO_CACHE_SIZE];
+static int cacheCount = 0;
+static long long budget = 0;
+static atomic_llong draining;   // pins let go of while still loading
+static int wakeFd = -1;         // readable once a probe is done
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void isoCacheSetBudget(long long bytes)
+{
+    budget = bytes;
+}
+
+long long isoCacheBudget()
+{
+    return budget;
+}
+
+long long isoCachePinned()
+{
+    long long total = 0;
+
+    for (int i = 0; i < cacheCount; i++)
+    {
+        int state = isoCachePinState(&cache[i]);
+
+        if (state == PIN_LOADING || state == PIN_READY)
+            total += cache[i].size;
+    }
+
+    return total + atomic_load(&draining);
+}
+
+static void inspect(IsoProbe *p)
+{
+    p->valid = isValidISO(p->path);
+    p->type = p->valid ? detectISOType(p->path) : ISO_UNKNOWN;
+
+    // Jobs get the walked tree with the entry, so none of them reads the image for it again
+    if (p->valid && inspectIsoLayout(p->path, p->type, &p->layout) != 0)
+        p->valid = 0;
+}
+
+// Detached; reading a multi-GB image on slow media must not hold up the caller's loop
+static void *probeWorker(void *arg)
+{
+    IsoProbe *p = arg;
+    unsigned long long traced = traceNow();
+    int running = PROBE_RUNNING;
+    uint64_t one = 1;
+
+    traceThreadName("iso inspector");
+    inspect(p);
+    traceSpan("cache", "inspect iso", traced, -1);
+
+    if (atomic_compare_exchange_strong(&p->state, &running, PROBE_DONE))
+    {
+        if (write(wakeFd, &one, sizeof(one)) != sizeof(one))
+            perror("Failed to signal an inspection");
+
+        return NULL;
+    }
+
+    freeIsoLayout(&p->layout);
+    free(p);
+
+    return NULL;
+}
+
+// Lets go of a running inspection without waiting for it
+static void dropProbe(IsoEntry *e)
+{
+    IsoProbe *p = e->probe;
+    int running = PROBE_RUNNING;
+
+    if (!p)
+        return;
+
+    e->probe = NULL;
+
+    if (atomic_compare_exchange_strong(&p->state, &running, PROBE_DROPPED))
+        return;
+
+    freeIsoLayout(&p->layout);
+    free(p);
+}
+
+// Moves a finished inspection into its entry; returns 1 if there was one
+static int collectProbe(IsoEntry *e)
+{
+    IsoProbe *p = e->probe;
+
+    if (!p || atomic_load(&p->state) != PROBE_DONE)
+        return 0;
+
+    e->probe = NULL;
+    e->valid = p->valid;
+    e->type = p->type;
+    e->layout = p->layout;
+    e->hybrid = e->valid && e->layout.hybrid;
+    free(p);
+
+    return 1;
+}
+
+static void fillEntry(IsoEntry *e, const char *path, const struct stat *st)
+{
+    memset(e, 0, sizeof(*e));
+    snprintf(e->path, sizeof(e->path), "%s", path);
+
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->type = ISO_UNKNOWN;
+    e->lastUsed = now();
+
+    IsoProbe *p = calloc(1, sizeof(*p));
+    pthread_t thread;
+
+    if (!p)
+        return;
+
+    snprintf(p->path, sizeof(p->path), "%s", path);
+    atomic_store(&p->state, PROBE_RUNNING);
+    e->probe = p;
+
+    if (isoCacheFd() >= 0 && pthread_create(&thread, NULL, probeWorker, p) == 0)
+    {
+        pthread_detach(thread);
+        return;
+    }
+
+    // No thread to hand it to, so the caller waits this once
+    inspect(p);
+    atomic_store(&p->state, PROBE_DONE);
+    collectProbe(e);
+}
+
+static int sameFile(const IsoEntry *e, const struct stat *st)
+{
+    return e->dev == st->st_dev && e->ino == st->st_ino &&
+           e->size == st->st_size && e->mtime == st->st_mtime;
+}
+
+// Returns the cached inspection of path, redoing it when the file changed; NULL if it is gone
+IsoEntry *isoCacheLookup(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    IsoEntry *victim = NULL;
+
+    for (int i = 0; i < cacheCount; i++)
+    {
+        IsoEntry *e = &cache[i];
+
+        if (strcmp(e->path, path) == 0)
+        {
+            if (sameFile(e, &st))
+            {
+                collectProbe(e);
+                return e;
+            }
+
+            victim = e;
+            break;
+        }
+
+        if (!victim || e->lastUsed < victim->lastUsed)
+            victim = e;
+    }
+
+    if (cacheCount < ISO_CACHE_SIZE && (!victim || strcmp(victim->path, path) != 0))
+        victim = &cache[cacheCount++];
+    else
+    {
+        isoCacheUnpin(victim);
+        dropProbe(victim);
+        freeIsoLayout(&victim->layout);
+    }
+
+    fillEntry(victim, path, &st);
+    return victim;
+}
+
+// Until this is 0, the entry says nothing about the image's contents
+int isoCacheInspecting(const IsoEntry *e)
+{
+    return e->probe != NULL;
+}
+
+// Polled alongside the caller's other descriptors; isoCacheCollect() takes in what is done
+int isoCacheFd()
+{
+    if (wakeFd < 0)
+        wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    return wakeFd;
+}
+
+// Returns how many inspections finished since the last call
+int isoCacheCollect()
+{
+    uint64_t count;
+    int done = 0;
+
+    // Only drains the counter, the entries themselves say which are done
+    if (wakeFd >= 0)
+    {
+        ssize_t n = read(wakeFd, &count, sizeof(count));
+        (void)n;
+    }
+
+    for (int i = 0; i < cacheCount; i++)
+        done += collectProbe(&cache[i]);
+
+    return done;
+}
+
+static void releasePin(IsoPin *p)
+{
+    if (p->map)
+    {
+        munlock(p->map, p->size);
+        munmap(p->map, p->size);
+    }
+
+    free(p);
+}
+
+// Detached; whichever of the loader and isoCacheUnpin moves the state off PIN_LOADING owns the pin
+static void *pinWorker(void *arg)
+{
+    IsoPin *p = arg;
+    unsigned long long traced = traceNow();
+    int fd = open(p->path, O_RDONLY | O_CLOEXEC);
+    void *map = MAP_FAILED;
+
+    traceThreadName("iso pinner");
+
+    if (fd >= 0)
+    {
+        // MAP_POPULATE reads the whole image in; mlock then keeps the page cache from dropping it
+        map = mmap(NULL, p->size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+        close(fd);
+
+        if (map != MAP_FAILED && mlock(map, p->size) != 0)
+        {
+            munmap(map, p->size);
+            map = MAP_FAILED;
+        }
+    }
+
+    if (map == MAP_FAILED)
+        perror("Failed to pin ISO");
+    else
+    {
+        p->map = map;
+        traceSpan("cache", "pin iso", traced, p->size);
+    }
+
+    int loading = PIN_LOADING;
+
+    if (atomic_compare_exchange_strong(&p->state, &loading, map == MAP_FAILED ? PIN_FAILED : PIN_READY))
+        return NULL;
+
+    // Unpinned while loading, nobody else refers to it any more
+    atomic_fetch_sub(&draining, p->size);
+    releasePin(p);
+
+    return NULL;
+}
+
+// Loads the image into locked memory in the background, unpinning the least recently used
+// images if the budget needs the room; returns -1 if it can never fit
+int isoCachePin(IsoEntry *e)
+{
+    int state = isoCachePinState(e);
+
+    if (state == PIN_LOADING || state == PIN_READY)
+        return 0;
+
+    if (e->size <= 0 || e->size > budget)
+        return -1;
+
+    while (isoCachePinned() + e->size > budget)
+    {
+        IsoEntry *oldest = NULL;
+
+        for (int i = 0; i < cacheCount; i++)
+        {
+            if (isoCachePinState(&cache[i]) == PIN_READY &&
+                (!oldest || cache[i].lastUsed < oldest->lastUsed))
+                oldest = &cache[i];
+        }
+
+        // Images still loading cannot be dropped yet
+        if (!oldest)
+            return -1;
+
+        isoCacheUnpin(oldest);
+    }
+
+    // A failed attempt is forgotten before the next one
+    isoCacheUnpin(e);
+
+    IsoPin *p = calloc(1, sizeof(*p));
+    pthread_t thread;
+
+    if (!p)
+        return -1;
+
+    snprintf(p->path, sizeof(p->path), "%s", e->path);
+    p->size = e->size;
+    atomic_store(&p->state, PIN_LOADING);
+    e->pin = p;
+
+    if (pthread_create(&thread, NULL, pinWorker, p) != 0)
+    {
+        atomic_store(&p->state, PIN_FAILED);
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return 0;
+}
+
+// Never waits: a pin still loading is handed to its loader, which frees it when done
+void isoCacheUnpin(IsoEntry *e)
+{
+    IsoPin *p = e->pin;
+    int loading = PIN_LOADING;
+
+    if (!p)
+        return;
+
+    e->pin = NULL;
+
+    // Its memory still counts against the budget until the loader lets go
+    atomic_fetch_add(&draining, p->size);
+
+    if (atomic_compare_exchange_strong(&p->state, &loading, PIN_DROPPED))
+        return;
+
+    atomic_fetch_sub(&draining, p->size);
+    releasePin(p);
+}
+
+PinState isoCachePinState(const IsoEntry *e)
+{
+    return e->pin ? atomic_load(&e->pin->state) : PIN_NONE;
+}
+
+// Counts a job started from this image; frequently used images get pinned while the budget allows
+int isoCacheUse(IsoEntry *e)
+{
+    e->uses++;
+    e->lastUsed = now();
+
+    if (budget > 0 && e->uses >= PIN_AFTER_USES && isoCachePinState(e) == PIN_NONE)
+        isoCachePin(e);
+
+    return isoCachePinState(e);
+}
+
+int isoCacheList(IsoEntry **list, int max)
+{
+    int n = cacheCount < max ? cacheCount : max;
+
+    for (int i = 0; i < n; i++)
+        list[i] = &cache[i];
+
+    return n;
+}
+
+void isoCacheClear()
+{
+    for (int i = 0; i < cacheCount; i++)
+    {
+        isoCacheUnpin(&cache[i]);
+        dropProbe(&cache[i]);
+        freeIsoLayout(&cache[i].layout);
+    }
+
+    cacheCount = 0;
+}
@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "isotree.h"
+#include "utils.h"
+
+#define ISO_BLOCK       2048
+#define MAX_DEPTH       64
+#define MAX_ENTRIES     (1 << 20)
+#define MAX_DIR_BYTES   (64 << 20)
+#define MAX_HELD_BYTES  (128 << 20)    // directory buffers alive at once, across the recursion
+
+// UDF descriptor tags (ECMA-167 3/7.2.1, 4/7.2.1)
+#define TAG_AVDP        2
+#define TAG_PARTITION   5
+#define TAG_LOGICAL_VOL 6
+#define TAG_TERMINATOR  8
+#define TAG_FILE_SET    256
+#define TAG_FILE_ID     257
+#define TAG_FILE_ENTRY  261
+#define TAG_EXT_ENTRY   266
+
+typedef struct {
+    int fd;
+    int format;
+    IsoTreeFn fn;
+    void *ctx;
+    int nextId;
+    int entries;
+    int stopped;
+    int overflow;
+    long long held;         // bytes of directory buffers currently allocated
+    long long partStart;    // UDF partition start, bytes
+    unsigned blockSize;     // UDF logical block size
+} Walker;
+
+static const char *formatNames[] = {"ISO9660", "Joliet", "UDF"};
+
+const char *isoTreeFormatName(int format)
+{
+    return format >= 0 && format <= ISOTREE_UDF ? formatNames[format] : "none";
+}
+
+static uint16_t le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t le64(const unsigned char *p)
+{
+    return le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+// Emits one entry; returns the id a directory's children will carry, or -1 to stop
+static int emit(Walker *w, const char *prefix, const char *name, int nameChars,
+                int dir, int parent, long long size)
+{
+    char path[PATH_MAX];
+
+    if (w->stopped)
+        return -1;
+
+    if (++w->entries > MAX_ENTRIES)
+    {
+        w->stopped = w->overflow = 1;
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s%s%s", prefix, prefix[0] ? "/" : "", name);
+
+    IsoTreeEntry e = {
+        .path = path,
+        .nameChars = nameChars,
+        .dir = dir,
+        .parent = parent,
+        .id = dir ? ++w->nextId : 0,
+        .size = size
+    };
+
+    if (w->fn(&e, w->ctx) != 0)
+    {
+        w->stopped = 1;
+        return -1;
+    }
+
+    return e.id;
+}
+
+// UCS-2 big endian (Joliet, UDF 16-bit) down to ASCII; returns the character count
+static int foldUcs2(const unsigned char *src, int bytes, char *out, size_t outSize)
+{
+    int chars = bytes / 2;
+    int n = 0;
+
+    for (int i = 0; i < chars && (size_t)n + 1 < outSize; i++)
+    {
+        unsigned c = src[2 * i] << 8 | src[2 * i + 1];
+        out[n++] = c >= 0x20 && c < 0x7f && c != '/' ? (char)c : '_';
+    }
+
+    out[n] = '\0';
+    return chars;
+}
+
+static int walk9660(Walker *w, uint32_t lba, uint32_t len, const char *prefix, int dirId, int depth)
+{
+    size_t cap = ((size_t)len + ISO_BLOCK - 1) / ISO_BLOCK * ISO_BLOCK;
+
+    if (depth > MAX_DEPTH || len > MAX_DIR_BYTES || w->held + (long long)cap > MAX_HELD_BYTES)
+        return -1;
+
+    unsigned char *buf = malloc(cap ? cap : ISO_BLOCK);
+
+    if (!buf || readFull(w->fd, (char *)buf, cap, (off_t)lba * ISO_BLOCK) != 0)
+    {
+        free(buf);
+        return -1;
+    }
+
+    w->held += cap;
+
+    long long pending = 0;
+    int res = 0;
+
+    for (uint32_t off = 0; off < len && !w->stopped; )
+    {
+        const unsigned char *rec = buf + off;
+        unsigned rl = rec[0];
+
+        // Records never straddle a sector; a zero length pads to the next one
+        if (rl == 0)
+        {
+            off = (off / ISO_BLOCK + 1) * ISO_BLOCK;
+            continue;
+        }
+
+        if (rl < 34 || off + rl > len)
+            break;
+
+        off += rl;
+
+        unsigned nameLen = rec[32];
+        const unsigned char *raw = rec + 33;
+        unsigned flags = rec[25];
+
+        // The name must fit in its own record
+        if (33 + nameLen > rl)
+            break;
+
+        if (nameLen == 1 && (raw[0] == 0 || raw[0] == 1))
+            continue;
+
+        // Files over 4 GiB are stored as several extents under one name
+        if (flags & 0x80)
+        {
+            pending += le32(rec + 10);
+            continue;
+        }
+
+        long long size = pending + le32(rec + 10);
+        char name[256];
+        int chars;
+
+        pending = 0;
+
+        if (w->format == ISOTREE_JOLIET)
+            chars = foldUcs2(raw, nameLen, name, sizeof(name));
+        else
+        {
+            snprintf(name, sizeof(name), "%.*s", (int)nameLen, raw);
+
+            char *version = strchr(name, ';');
+
+            if (version)
+                *version = '\0';
+
+            size_t n = strlen(name);
+
+            if (n > 0 && name[n - 1] == '.')
+                name[n - 1] = '\0';
+
+            chars = strlen(name);
+        }
+
+        char *version = w->format == ISOTREE_JOLIET ? strchr(name, ';') : NULL;
+
+        if (version)
+        {
+            chars -= strlen(version);
+            *version = '\0';
+        }
+
+        int dir = (flags & 0x02) != 0;
+        int id = emit(w, prefix, name, chars, dir, dirId, dir ? 0 : size);
+
+        if (id < 0)
+            break;
+
+        if (dir)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s%s%s", prefix, prefix[0] ? "/" : "", name);
+
+            if (walk9660(w, le32(rec + 2), le32(rec + 10), path, id, depth + 1) != 0)
+                res = -1;
+        }
+    }
+
+    w->held -= cap;
+    free(buf);
+    return res;
+}
+
+// Primary volume, or the Joliet supplementary one when present for its long names
+static int open9660(Walker *w, uint32_t *rootLba, uint32_t *rootLen)
+{
+    unsigned char desc[ISO_BLOCK];
+    int found = 0;
+
+    for (int sector = 16; sector < 32; sector++)
+    {
+        if (readFull(w->fd, (char *)desc, ISO_BLOCK, (off_t)sector * ISO_BLOCK) != 0 ||
+            memcmp(desc + 1, "CD001", 5) != 0 || desc[0] == 255)
+            break;
+
+        int joliet = desc[0] == 2 && desc[88] == 0x25 && desc[89] == 0x2f &&
+                     (desc[90] == 0x40 || desc[90] == 0x43 || desc[90] == 0x45);
+
+        if ((desc[0] == 1 && !found) || joliet)
+        {
+            w->format = joliet ? ISOTREE_JOLIET : ISOTREE_ISO9660;
+            *rootLba = le32(desc + 156 + 2);
+            *rootLen = le32(desc + 156 + 10);
+            found = 1;
+        }
+    }
+
+    return found ? 0 : -1;
+}
+
+static int readUdfBlock(Walker *w, uint32_t lb, unsigned char *buf)
+{
+    return readFull(w->fd, (char *)buf, w->blockSize, w->partStart + (off_t)lb * w->blockSize);
+}
+
+static int udfTag(const unsigned char *buf)
+{
+    return le16(buf);
+}
+
+// Reads a (extended) file entry: its type, size, and with data set, its content
+static int readUdfEntry(Walker *w, uint32_t lb, int *isDir, long long *size, unsigned char **data)
+{
+    unsigned char *fe = malloc(w->blockSize);
+
+    if (!fe || readUdfBlock(w, lb, fe) != 0)
+    {
+        free(fe);
+        return -1;
+    }
+
+    int tag = udfTag(fe);
+    unsigned hdr = tag == TAG_EXT_ENTRY ? 216 : 176;
+
+    if (tag != TAG_FILE_ENTRY && tag != TAG_EXT_ENTRY)
+    {
+        free(fe);
+        return -1;
+    }
+
+    uint32_t lea = le32(fe + (tag == TAG_EXT_ENTRY ? 208 : 168));
+    uint32_t lad = le32(fe + (tag == TAG_EXT_ENTRY ? 212 : 172));
+
+    *isDir = fe[16 + 11] == 4;
+    *size = (long long)le64(fe + 56);
+
+    if (*size < 0)
+    {
+        free(fe);
+        return -1;
+    }
+
+    if (!data)
+    {
+        free(fe);
+        return 0;
+    }
+
+    if (*size > MAX_DIR_BYTES || w->held + *size > MAX_HELD_BYTES ||
+        (uint64_t)hdr + lea + lad > w->blockSize)
+    {
+        free(fe);
+        return -1;
+    }
+
+    unsigned char *out = calloc(1, *size ? *size : 1);
+    const unsigned char *ad = fe + hdr + lea;
+    int adType = le16(fe + 16 + 18) & 7;
+    long long done = 0;
+    int res = out ? 0 : -1;
+
+    if (res == 0 && adType == 3)
+        memcpy(out, ad, *size < lad ? *size : lad);
+
+    // short_ad (8 bytes) or long_ad (16 bytes); the top two length bits give the extent type
+    for (unsigned off = 0; res == 0 && adType != 3 && off + (adType == 0 ? 8 : 16) <= lad && done < *size; off += adType == 0 ? 8 : 16)
+    {
+        uint32_t len = le32(ad + off) & 0x3fffffff;
+        uint32_t pos = le32(ad + off + 4);
+
+        if (len == 0)
+            break;
+
+        if (len > *size - done)
+            len = *size - done;
+
+        if ((le32(ad + off) >> 30) == 0 &&
+            readFull(w->fd, (char *)out + done, len, w->partStart + (off_t)pos * w->blockSize) != 0)
+            res = -1;
+
+        done += len;
+    }
+
+    free(fe);
+
+    if (res != 0)
+    {
+        free(out);
+        return -1;
+    }
+
+    w->held += *size;
+    *data = out;
+    return 0;
+}
+
+static int walkUdf(Walker *w, uint32_t lb, const char *prefix, int dirId, int depth)
+{
+    unsigned char *data = NULL;
+    long long len;
+    int isDir;
+
+    if (depth > MAX_DEPTH || readUdfEntry(w, lb, &isDir, &len, &data) != 0)
+        return -1;
+
+    int res = 0;
+
+    // File identifier descriptors, each padded to four bytes
+    for (long long off = 0; off + 38 <= len && !w->stopped; )
+    {
+        const unsigned char *fid = data + off;
+
+        if (udfTag(fid) != TAG_FILE_ID)
+            break;
+
+        unsigned traits = fid[18];
+        unsigned lfi = fid[19];
+        uint32_t child = le32(fid + 20 + 4);
+        unsigned liu = le16(fid + 36);
+        const unsigned char *ident = fid + 38 + liu;
+
+        off += (38 + liu + lfi + 3) & ~3u;
+
+        if (off > len)
+            break;
+
+        // skip the parent link and deleted entries
+        if ((traits & 0x08) || (traits & 0x04) || lfi == 0)
+            continue;
+
+        char name[256];
+        int chars;
+
+        // The first byte says 8- or 16-bit characters
+        if (ident[0] == 16)
+            chars = foldUcs2(ident + 1, lfi - 1, name, sizeof(name));
+        else
+        {
+            chars = lfi - 1;
+            snprintf(name, sizeof(name), "%.*s", chars, ident + 1);
+
+            for (char *p = name; *p; p++)
+            {
+                if ((unsigned char)*p < 0x20 || (unsigned char)*p >= 0x7f || *p == '/')
+                    *p = '_';
+            }
+        }
+
+        long long size = 0;
+        int childDir = (traits & 0x02) != 0;
+
+        if (!childDir && readUdfEntry(w, child, &isDir, &size, NULL) != 0)
+        {
+            res = -1;
+            continue;
+        }
+
+        int id = emit(w, prefix, name, chars, childDir, dirId, size);
+
+        if (id < 0)
+            break;
+
+        if (childDir)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s%s%s", prefix, prefix[0] ? "/" : "", name);
+
+            if (walkUdf(w, child, path, id, depth + 1) != 0)
+                res = -1;
+        }
+    }
+
+    w->held -= len;
+    free(data);
+    return res;
+}
+
+// Follows anchor -> volume descriptors -> file set -> root; only plain type 1 partitions
+static int openUdf(Walker *w, uint32_t *rootLb)
+{
+    unsigned char buf[ISO_BLOCK];
+    int nsr = 0;
+
+    for (int sector = 16; sector < 32 && !nsr; sector++)
+    {
+        if (readFull(w->fd, (char *)buf, ISO_BLOCK, (off_t)sector * ISO_BLOCK) != 0)
+            return -1;
+
+        nsr = memcmp(buf + 1, "NSR02", 5) == 0 || memcmp(buf + 1, "NSR03", 5) == 0;
+    }
+
+    if (!nsr || readFull(w->fd, (char *)buf, ISO_BLOCK, 256LL * ISO_BLOCK) != 0 || udfTag(buf) != TAG_AVDP)
+        return -1;
+
+    uint32_t vdsLen = le32(buf + 16);
+    uint32_t vdsLoc = le32(buf + 20);
+    long long partStart = -1;
+    uint32_t fsdLb = 0;
+    unsigned blockSize = 0;
+
+    for (uint32_t i = 0; i < vdsLen / ISO_BLOCK && i < 64; i++)
+    {
+        if (readFull(w->fd, (char *)buf, ISO_BLOCK, (off_t)(vdsLoc + i) * ISO_BLOCK) != 0)
+            return -1;
+
+        int tag = udfTag(buf);
+
+        if (tag == TAG_PARTITION)
+            partStart = le32(buf + 188);
+        else if (tag == TAG_LOGICAL_VOL)
+        {
+            // Metadata and virtual partitions (UDF 2.5, packet writing) are not handled
+            if (le32(buf + 268) != 1 || buf[440] != 1)
+                return -1;
+
+            blockSize = le32(buf + 212);
+            fsdLb = le32(buf + 248 + 4);
+        }
+        else if (tag == TAG_TERMINATOR)
+            break;
+    }
+
+    if (partStart < 0 || blockSize != ISO_BLOCK)
+        return -1;
+
+    w->blockSize = blockSize;
+    w->partStart = partStart * blockSize;
+
+    if (readUdfBlock(w, fsdLb, buf) != 0 || udfTag(buf) != TAG_FILE_SET)
+        return -1;
+
+    *rootLb = le32(buf + 400 + 4);
+    return 0;
+}
+
+// Lists every file and directory of the image without mounting it: UDF first, as Windows
+// images keep their files there and only a stub in ISO9660. Returns the format walked, or -1.
+int walkIsoTree(const char *iso, IsoTreeFn fn, void *ctx)
+{
+    Walker w = {.fn = fn, .ctx = ctx};
+    uint32_t root, rootLen;
+    int res = -1;
+
+    w.fd = open(iso, O_RDONLY | O_CLOEXEC);
+
+    if (w.fd < 0)
+        return -1;
+
+    if (openUdf(&w, &root) == 0)
+    {
+        w.format = ISOTREE_UDF;
+        res = walkUdf(&w, root, "", 0, 0);
+    }
+
+    // A damaged UDF side may still have a usable ISO9660 tree
+    if (res != 0 && !w.stopped && w.entries == 0 && open9660(&w, &root, &rootLen) == 0)
+        res = walk9660(&w, root, rootLen, "", 0, 0);
+
+    close(w.fd);
+
+    return (res == 0 || w.stopped) && !w.overflow ? w.format : -1;
+}
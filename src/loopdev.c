@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/loop.h>
+
+#include "loopdev.h"
+
+static int configure(int loopFd, int fileFd, const char *file, unsigned flags, unsigned blockSize)
+{
+    struct loop_config config;
+    memset(&config, 0, sizeof(config));
+    config.fd = fileFd;
+    config.block_size = blockSize;
+    config.info.lo_flags = flags;
+    snprintf((char *)config.info.lo_file_name, LO_NAME_SIZE, "%s", file);
+
+    if (ioctl(loopFd, LOOP_CONFIGURE, &config) == 0)
+        return 0;
+
+    // Backing filesystems without O_DIRECT support refuse direct I/O; buffered still works
+    if ((flags & LO_FLAGS_DIRECT_IO) && errno == EINVAL)
+        return configure(loopFd, fileFd, file, flags & ~LO_FLAGS_DIRECT_IO, blockSize);
+
+    return -1;
+}
+
+// Binds a free loop device to file in one LOOP_CONFIGURE call and returns it open; flags are LO_FLAGS_*.
+// With LO_FLAGS_AUTOCLEAR the device goes away once this fd and every later user have closed it.
+int loopAttachFd(const char *file, unsigned flags, unsigned blockSize, char *devPath, size_t len)
+{
+    int ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+
+    if (ctl < 0)
+    {
+        perror("Failed to open /dev/loop-control");
+        return -1;
+    }
+
+    int fileFd = open(file, ((flags & LO_FLAGS_READ_ONLY) ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+
+    if (fileFd < 0)
+    {
+        perror("Failed to open loop backing file");
+        close(ctl);
+        return -1;
+    }
+
+    int res = -1;
+    int loopFd = -1;
+
+    // Another process can grab the same free device between the two calls, so retry a few times
+    for (int attempt = 0; attempt < 8 && res != 0; attempt++)
+    {
+        int nr = ioctl(ctl, LOOP_CTL_GET_FREE);
+
+        if (nr < 0)
+        {
+            perror("No free loop device");
+            break;
+        }
+
+        snprintf(devPath, len, "/dev/loop%d", nr);
+
+        loopFd = open(devPath, ((flags & LO_FLAGS_READ_ONLY) ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+
+        if (loopFd < 0)
+            continue;
+
+        if (configure(loopFd, fileFd, file, flags, blockSize) == 0)
+        {
+            res = 0;
+            break;
+        }
+
+        int err = errno;
+
+        if (err != EBUSY)
+            perror("LOOP_CONFIGURE failed");
+
+        close(loopFd);
+        loopFd = -1;
+
+        if (err != EBUSY)
+            break;
+    }
+
+    close(fileFd);
+    close(ctl);
+
+    return res == 0 ? loopFd : -1;
+}
+
+int loopAttach(const char *file, unsigned flags, unsigned blockSize, char *devPath, size_t len)
+{
+    int fd = loopAttachFd(file, flags, blockSize, devPath, len);
+
+    if (fd < 0)
+        return -1;
+
+    close(fd);
+    return 0;
+}
+
+// kb of read-ahead on the loop device itself, on top of whatever the backing file gets
+int loopSetReadAhead(int loopFd, unsigned kb)
+{
+    return ioctl(loopFd, BLKRASET, (unsigned long)kb * 2);
+}
+
+// 1 when the device really bypasses the page cache of its backing file
+int loopUsesDirectIO(const char *devPath)
+{
+    const char *name = strrchr(devPath, '/');
+    char path[128];
+    char value = '0';
+
+    snprintf(path, sizeof(path), "/sys/block/%s/loop/dio", name ? name + 1 : devPath);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return 0;
+
+    if (read(fd, &value, 1) != 1)
+        value = '0';
+
+    close(fd);
+    return value == '1';
+}
+
+int loopDetach(const char *devPath)
+{
+    int fd = open(devPath, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    int res = ioctl(fd, LOOP_CLR_FD, 0);
+    close(fd);
+
+    return res;
+}
\ No newline at end of file
@@ -1,36 +1,143 @@
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include "utils.h"
 #include "devices.h"
 #include "ui.h"
 #include "iso.h"
+#include "options.h"
+#include "throttle.h"
+#include "write.h"
+#include "target.h"
+#include "trace.h"
+#include "mounts.h"
+#include "queue.h"
+#include "backup.h"
+#include "history.h"
 
-int main(int argc, char* argv[]) 
+static int runBenchmark(UsbDevice *dev)
 {
-    checkRoot();
+    IsoType isoType;
+
+    if (finishIsoValidation(&isoType) != 0)
+        return 1;
 
-    if (argc != 3)
+    if (dev->name[0] == '\0')
     {
-        printf("Usage: %s path/to/.iso /dev/sdX (or \"0\" if not known)\n", argv[0]);
+        fprintf(stderr, "The benchmark needs an explicit target device\n");
         return 1;
     }
 
-    IsoType isoType = ISO_UNKNOWN;
+    printf("\033[1;31m!!! WARNING: THE BENCHMARK OVERWRITES DATA ON %s !!!\033[0m\n", dev->dev_path);
+    printf("Continue? [Y/N]: ");
+
+    int input = getCharInput();
+
+    if (input != 'y' && input != 'Y')
+        return 1;
 
-    if (validateISOArgument(argv[1], &isoType) == 1)
+    if (prepareTarget(dev) != 0)
         return 1;
 
-    checkDependencies(isoType);
+    return benchWriteMethods(options.iso, dev, options.benchBytes) == 0 ? 0 : 1;
+}
 
-    UsbDevice dev_data = {0};
-    char *dev = NULL;
+static int runRestore()
+{
+    UsbDevice dev = {0};
+    long long size = backupImageSize(options.restorePath);
+
+    if (size < 0)
+    {
+        fprintf(stderr, "Not a usable backup: %s\n", options.restorePath);
+        return 1;
+    }
+
+    // Image targets are sized for the stick the backup came from
+    int spec = parseTarget(options.device, size, &dev);
+
+    if (spec < 0 || (spec == 0 && !findUsbByName(options.device, &dev)))
+    {
+        fprintf(stderr, "Target device not found: %s\n", options.device);
+        return 1;
+    }
+
+    printf("\033[1;31m!!! WARNING: ALL DATA ON %s WILL BE REPLACED BY %s !!!\033[0m\n", dev.dev_path, options.restorePath);
+    printf("Continue? [Y/N]: ");
+
+    int input = getCharInput();
+    int res = 1;
+
+    if (input == 'y' || input == 'Y')
+    {
+        ProgressSlot progress;
+        progressInit(&progress, dev.name, 0);
+
+        res = restoreStick(options.restorePath, &dev, &progress) == 0 ? 0 : 1;
+    }
+
+    if (spec > 0)
+        releaseTarget(&dev);
+
+    return res;
+}
 
-    if (strcmp(argv[2], "0") != 0) 
+int main(int argc, char* argv[]) 
+{
+    if (parseOptions(argc, argv) != 0)
     {
-        dev = argv[2];
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Reading the history touches no device, so it needs no root
+    if (options.historyPath)
+        return historyReport(options.historyPath) == 0 ? 0 : 1;
+
+    checkRoot();
+
+    // Mounts then vanish with the process however it ends; needs to happen before any thread exists
+    enterPrivateMounts();
+    sweepJobMounts();
+
+    if (options.tracePath && traceOpen(options.tracePath) != 0)
+        fprintf(stderr, "Tracing disabled\n");
+
+    throttleSetup(options.ioprioClass, options.ioprioLevel, options.bwlimit);
+    queueRestoreOnExit();
+
+    if (options.ioprioClass != 0 && options.iso)
+        queueWarnPriority(options.iso, "the ISO's disk", 0);
+
+    if (options.restorePath)
+        return runRestore();
+
+    IsoType isoType = ISO_UNKNOWN;
+    int isoChecked = 0;
+
+    // Nothing is forked before the menu: the ISO is checked in the background
+    startIsoValidation(options.iso);
+
+    UsbDevice dev_data = {0};
+    UsbDevice target = {0};
+    struct stat st;
+
+    // file:, loop: and null targets are set up here; anything else names a disk
+    int spec = parseTarget(options.device, stat(options.iso, &st) == 0 ? st.st_size : 0, &target);
+
+    if (spec < 0)
+        return 1;
 
-        if (!findUsbByName(dev, &dev_data))
-            dev = NULL;
+    if (spec > 0)
+        dev_data = target;
+    else if (strcmp(options.device, "0") != 0)
+        findUsbByName(options.device, &dev_data);
+
+    if (options.benchBytes > 0)
+    {
+        int res = runBenchmark(&dev_data);
+        releaseTarget(&target);
+        return res;
     }
 
     Screen current = MENU;
@@ -49,6 +156,12 @@ int main(int argc, char* argv[])
                 current = showDevices(&dev_data);
                 break;
             case BEGIN:
+                if (!isoChecked && finishIsoValidation(&isoType) != 0)
+                {
+                    releaseTarget(&target);
+                    return 1;
+                }
+                isoChecked = 1;
                 current = showBeginCreation(&dev_data, isoType);
                 break;
             case START:
@@ -57,13 +170,18 @@ int main(int argc, char* argv[])
                     current = DEVICES;
                     break;
                 }
-                current = showStartCreation(&dev_data, argv[1], isoType);
+                current = showStartCreation(&dev_data, options.iso, isoType);
                 break;
             default:
                 current = EXIT;
         }
     }
 
+    releaseTarget(&target);
+
+    if (!isoChecked && finishIsoValidation(&isoType) != 0)
+        return 1;
+
     clearScreen();
     printf("Thank you, goodbye =)\n");
     
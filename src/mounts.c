@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+
+#include "mounts.h"
+
+#define MOUNT_BASE "/run/grapeusb"
+
+// Gives the process its own copy of the mount table: nothing mounted from here on is
+// visible to the host, and the kernel unmounts all of it when the process exits or crashes.
+// Must run before any thread is started, unshare refuses to split a shared fs context.
+int enterPrivateMounts()
+{
+    if (unshare(CLONE_NEWNS) != 0)
+    {
+        perror("Private mount namespace unavailable");
+        return -1;
+    }
+
+    // Without this, mounts would still propagate back into the host's shared subtrees
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0)
+    {
+        perror("Failed to make mounts private");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Removes directories left by processes that died. A live job's mount may sit in another
+// namespace, where rmdir would not see it and detach it, so those are never touched.
+void sweepJobMounts()
+{
+    DIR *dir = opendir(MOUNT_BASE);
+
+    if (!dir)
+        return;
+
+    struct dirent *ent;
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        int pid;
+
+        if (sscanf(ent->d_name, "job-%d-", &pid) != 1 || pid <= 0 ||
+            kill(pid, 0) == 0 || errno != ESRCH)
+            continue;
+
+        JobMounts m;
+
+        snprintf(m.root, sizeof(m.root), "%s/%.32s", MOUNT_BASE, ent->d_name);
+        snprintf(m.iso, sizeof(m.iso), "%s/iso", m.root);
+        snprintf(m.usb, sizeof(m.usb), "%s/usb", m.root);
+
+        removeJobMounts(&m);
+    }
+
+    closedir(dir);
+}
+
+int createJobMounts(JobMounts *m)
+{
+    if (mkdir(MOUNT_BASE, 0700) != 0 && errno != EEXIST)
+    {
+        perror("Failed to create " MOUNT_BASE);
+        return -1;
+    }
+
+    snprintf(m->root, sizeof(m->root), "%s/job-%d-XXXXXX", MOUNT_BASE, (int)getpid());
+
+    if (!mkdtemp(m->root))
+    {
+        perror("Failed to create job mount directory");
+        return -1;
+    }
+
+    snprintf(m->iso, sizeof(m->iso), "%s/iso", m->root);
+    snprintf(m->usb, sizeof(m->usb), "%s/usb", m->root);
+
+    if (mkdir(m->iso, 0755) != 0 || mkdir(m->usb, 0755) != 0)
+    {
+        perror("Failed to create job mount directory");
+        removeJobMounts(m);
+        return -1;
+    }
+
+    return 0;
+}
+
+void removeJobMounts(JobMounts *m)
+{
+    rmdir(m->iso);
+    rmdir(m->usb);
+    rmdir(m->root);
+}
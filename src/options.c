@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <linux/ioprio.h>
+
+#include "options.h"
+#include "history.h"
+
+__thread Options options;
+
+void printUsage(const char *prog)
+{
+    printf("Usage: %s [options] path/to/.iso /dev/sdX (or \"0\" if not known)\n", prog);
+    printf("       %s --restore=FILE /dev/sdX\n", prog);
+    printf("       %s history [FILE]   throughput by model, host and strategy from past jobs,\n", prog);
+    printf("                           and sticks that got slower (default %s)\n", HISTORY_PATH);
+    printf("       the target may also be file:PATH[:SIZE], loop:PATH[:SIZE] or null\n\n");
+    printf("Options:\n");
+    printf("  --ioprio=CLASS     I/O priority: idle, or be[:0-7] (best effort, 0 is highest)\n");
+    printf("  --bwlimit=MB       cap read and write bandwidth to MB per second\n");
+    printf("                     (SIGUSR1 doubles, SIGUSR2 halves it while a job runs)\n");
+    printf("  --write-method=M   raw write path: buffered (default), direct (O_DIRECT) or splice\n");
+    printf("  --no-probe         skip the sampled fake-capacity probe before writing\n");
+    printf("  --no-tune          keep raw writes at 4 MiB chunks, one in flight, instead of\n");
+    printf("                     adapting chunk size and concurrency to the stick\n");
+    printf("  --keep-queue       do not switch the stick's block queue to a throughput profile\n");
+    printf("                     (no scheduler, largest requests, 4 MiB read-ahead) for the job\n");
+    printf("  --refresh          update a stick written earlier from another release of the ISO,\n");
+    printf("                     rewriting only files (copy layouts) or 1 MiB chunks (raw) that differ\n");
+    printf("  --backup=FILE      image the stick to FILE before erasing it: zero chunks are\n");
+    printf("                     skipped, the rest compressed by all cores (zstd, seekable)\n");
+    printf("  --restore=FILE     write a backup made with --backup back to the device\n");
+    printf("  --trace=FILE       record phases, I/O batches and commands and write them to FILE\n");
+    printf("                     on exit as Chrome trace JSON (open in ui.perfetto.dev)\n");
+    printf("  --bench[=MB]       write the first MB (default 256) of the image with every\n");
+    printf("                     method and report the fastest; destroys data on the device\n");
+}
+
+static int parseIoprio(const char *arg)
+{
+    if (strcmp(arg, "idle") == 0)
+    {
+        options.ioprioClass = IOPRIO_CLASS_IDLE;
+        options.ioprioLevel = 0;
+        return 0;
+    }
+
+    if (strncmp(arg, "be", 2) == 0)
+    {
+        options.ioprioClass = IOPRIO_CLASS_BE;
+        options.ioprioLevel = IOPRIO_NORM;
+
+        if (arg[2] == '\0')
+            return 0;
+
+        if (arg[2] == ':' && arg[3] >= '0' && arg[3] <= '7' && arg[4] == '\0')
+        {
+            options.ioprioLevel = arg[3] - '0';
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Invalid --ioprio value: %s\n", arg);
+    return -1;
+}
+
+int parseOptions(int argc, char *argv[])
+{
+    static struct option longOpts[] = {
+        {"ioprio", required_argument, NULL, 'p'},
+        {"bwlimit", required_argument, NULL, 'b'},
+        {"write-method", required_argument, NULL, 'm'},
+        {"bench", optional_argument, NULL, 'B'},
+        {"no-probe", no_argument, NULL, 'P'},
+        {"no-tune", no_argument, NULL, 'T'},
+        {"keep-queue", no_argument, NULL, 'Q'},
+        {"refresh", no_argument, NULL, 'R'},
+        {"trace", required_argument, NULL, 't'},
+        {"backup", required_argument, NULL, 'k'},
+        {"restore", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    memset(&options, 0, sizeof(options));
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "h", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                if (parseIoprio(optarg) != 0)
+                    return -1;
+                break;
+            case 'b':
+            {
+                char *end;
+                double mb = strtod(optarg, &end);
+
+                if (*end != '\0' || mb <= 0)
+                {
+                    fprintf(stderr, "Invalid --bwlimit value: %s\n", optarg);
+                    return -1;
+                }
+
+                options.bwlimit = (unsigned long long)(mb * 1048576);
+                break;
+            }
+            case 'm':
+                if (parseWriteMethod(optarg, &options.writeMethod) != 0)
+                {
+                    fprintf(stderr, "Invalid --write-method value: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'P':
+                options.skipProbe = 1;
+                break;
+            case 'T':
+                options.fixedIo = 1;
+                break;
+            case 'Q':
+                options.keepQueue = 1;
+                break;
+            case 'R':
+                options.refresh = 1;
+                break;
+            case 't':
+                options.tracePath = optarg;
+                break;
+            case 'k':
+                options.backupPath = optarg;
+                break;
+            case 'r':
+                options.restorePath = optarg;
+                break;
+            case 'B':
+            {
+                char *end = "";
+                long mb = optarg ? strtol(optarg, &end, 10) : 256;
+
+                // Up to 1 TiB; anything larger is no longer a sample
+                if (*end != '\0' || mb <= 0 || mb > 1048576)
+                {
+                    fprintf(stderr, "Invalid --bench value: %s\n", optarg);
+                    return -1;
+                }
+
+                options.benchBytes = mb * 1048576LL;
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+
+    if (argc - optind >= 1 && argc - optind <= 2 && strcmp(argv[optind], "history") == 0)
+    {
+        options.historyPath = argc - optind == 2 ? argv[optind + 1] : HISTORY_PATH;
+        return 0;
+    }
+
+    // A restore needs no ISO
+    if (options.restorePath && argc - optind == 1)
+    {
+        options.device = argv[optind];
+        return 0;
+    }
+
+    if (argc - optind != 2)
+        return -1;
+
+    options.iso = argv[optind];
+    options.device = argv[optind + 1];
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,578 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <linux/fs.h>
+
+#include "partition.h"
+#include "target.h"
+#include "utils.h"
+#include "trace.h"
+
+#define GPT_ENTRIES       128
+#define GPT_ENTRY_SIZE    128
+#define GPT_ENTRY_BYTES   (GPT_ENTRIES * GPT_ENTRY_SIZE)
+#define PART_ALIGN        (1LL << 20)
+#define MAX_WIPE_AREAS    128
+#define REREAD_TRIES      20
+#define PART_WAIT_MS      5000
+
+// EFI System Partition, in the mixed-endian byte order GPT stores GUIDs in
+static const uint8_t espType[16] = {
+    0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11,
+    0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b
+};
+
+typedef struct {
+    long long off;
+    long long len;
+} WipeArea;
+
+typedef struct {
+    WipeArea areas[MAX_WIPE_AREAS];
+    int count;
+    long long devSize;
+    long long sectorSize;
+} WipePlan;
+
+static double nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void addArea(WipePlan *p, long long off, long long len)
+{
+    long long ss = p->sectorSize;
+    long long end = off + len;
+
+    // Whole logical blocks, clamped to the disk
+    off = off < 0 ? 0 : off / ss * ss;
+    end = end > p->devSize ? p->devSize : (end + ss - 1) / ss * ss;
+
+    if (end <= off || p->count == MAX_WIPE_AREAS)
+        return;
+
+    p->areas[p->count].off = off;
+    p->areas[p->count].len = end - off;
+    p->count++;
+}
+
+// Where partition tables, filesystems and image formats keep the magic blkid and firmware look for
+static void addVolume(WipePlan *p, long long start, long long size)
+{
+    long long ss = p->sectorSize;
+    long long end = start + size;
+    long long tail = 34 * ss > 128 * 1024 ? 34 * ss : 128 * 1024;
+
+    // MBR and boot sectors (FAT, NTFS, exFAT, XFS, LUKS), GPT header and entries, ext/f2fs at 1 KiB, swap
+    addArea(p, start, 34 * ss > 8192 ? 34 * ss : 8192);
+    // ISO9660 and UDF volume descriptors from sector 16
+    addArea(p, start + 32768, 32768);
+    // btrfs
+    addArea(p, start + 65536, 4096);
+    // UDF anchors at sector 256, N - 256 and N
+    addArea(p, start + 256 * 2048, 2048);
+    addArea(p, end - 257 * 2048, 2048);
+    // Backup GPT, NTFS backup boot sector, md 0.90/1.0 superblocks
+    addArea(p, end - tail, tail);
+}
+
+static int cmpArea(const void *a, const void *b)
+{
+    const WipeArea *x = a, *y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+// Sorted and merged, so overlapping volumes cost one request each
+static void mergeAreas(WipePlan *p)
+{
+    int n = 0;
+
+    qsort(p->areas, p->count, sizeof(WipeArea), cmpArea);
+
+    for (int i = 0; i < p->count; i++)
+    {
+        WipeArea *last = n ? &p->areas[n - 1] : NULL;
+
+        if (last && p->areas[i].off <= last->off + last->len)
+        {
+            long long end = p->areas[i].off + p->areas[i].len;
+
+            if (end > last->off + last->len)
+                last->len = end - last->off;
+        }
+        else
+            p->areas[n++] = p->areas[i];
+    }
+
+    p->count = n;
+}
+
+static void addPartitions(WipePlan *p, const char *name)
+{
+    char path[512];
+    DIR *dir;
+    struct dirent *ent;
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+
+    if ((dir = opendir(path)) == NULL)
+        return;
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        long long start, size;
+
+        if (strncmp(ent->d_name, name, strlen(name)) != 0)
+            continue;
+
+        // sysfs reports both in 512-byte units
+        snprintf(path, sizeof(path), "/sys/class/block/%s/%s/start", name, ent->d_name);
+        if (readSysfsLL(path, &start) != 0)
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/class/block/%s/%s/size", name, ent->d_name);
+        if (readSysfsLL(path, &size) != 0)
+            continue;
+
+        addVolume(p, start * 512, size * 512);
+    }
+
+    closedir(dir);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+// The table on the disk may list partitions the kernel never saw, after a raw write for one
+static void addTablePartitions(WipePlan *p, int fd)
+{
+    long long ss = p->sectorSize;
+    uint8_t *buf = malloc(2 * ss > GPT_ENTRY_BYTES ? 2 * ss : GPT_ENTRY_BYTES);
+
+    if (!buf || readFull(fd, (char *)buf, 2 * ss, 0) != 0)
+    {
+        free(buf);
+        return;
+    }
+
+    if (buf[510] == 0x55 && buf[511] == 0xaa)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            const uint8_t *e = buf + 446 + i * 16;
+
+            if (e[4] != 0 && e[4] != 0xee)
+                addVolume(p, get32(e + 8) * ss, get32(e + 12) * ss);
+        }
+    }
+
+    if (memcmp(buf + ss, "EFI PART", 8) == 0)
+    {
+        uint64_t lba = get64(buf + ss + 72);
+        uint32_t count = get32(buf + ss + 80);
+        uint32_t size = get32(buf + ss + 84);
+
+        if (size >= 128 && (uint64_t)count * size <= GPT_ENTRY_BYTES &&
+            readFull(fd, (char *)buf, count * size, lba * ss) == 0)
+        {
+            for (uint32_t i = 0; i < count; i++)
+            {
+                const uint8_t *e = buf + i * size;
+                uint64_t first = get64(e + 32), last = get64(e + 40);
+
+                if (last >= first && memcmp(e, (uint8_t[16]){0}, 16) != 0)
+                    addVolume(p, first * ss, (last - first + 1) * ss);
+            }
+        }
+    }
+
+    free(buf);
+}
+
+static int zeroArea(int fd, const WipeArea *a, int *offloaded)
+{
+    uint64_t range[2] = {a->off, a->len};
+
+    // Lets the device zero it without data crossing the bus where it can
+    if (ioctl(fd, BLKZEROOUT, range) == 0)
+    {
+        (*offloaded)++;
+        return 0;
+    }
+
+    static const char zeros[64 * 1024];
+    long long done = 0;
+
+    while (done < a->len)
+    {
+        long long chunk = a->len - done < (long long)sizeof(zeros) ? a->len - done : (long long)sizeof(zeros);
+
+        if (writeFull(fd, zeros, chunk, a->off + done) != 0)
+            return -1;
+
+        done += chunk;
+    }
+
+    return 0;
+}
+
+static int deviceGeometry(int fd, long long *size, long long *sectorSize)
+{
+    uint64_t bytes;
+    int ss;
+
+    if (ioctl(fd, BLKGETSIZE64, &bytes) != 0)
+        return -1;
+
+    *size = bytes;
+    *sectorSize = ioctl(fd, BLKSSZGET, &ss) == 0 && ss > 0 ? ss : 512;
+    return 0;
+}
+
+static int wipeOpen(int fd, const UsbDevice *dev)
+{
+    WipePlan plan = {0};
+    double start = nowMs();
+    unsigned long long traced = traceNow();
+    int offloaded = 0;
+
+    if (deviceGeometry(fd, &plan.devSize, &plan.sectorSize) != 0)
+    {
+        perror("Failed to read device size");
+        return -1;
+    }
+
+    addVolume(&plan, 0, plan.devSize);
+    addPartitions(&plan, dev->name);
+    addTablePartitions(&plan, fd);
+    mergeAreas(&plan);
+
+    long long bytes = 0;
+
+    for (int i = 0; i < plan.count; i++)
+    {
+        if (zeroArea(fd, &plan.areas[i], &offloaded) != 0)
+        {
+            perror("Failed to clear signatures");
+            return -1;
+        }
+
+        bytes += plan.areas[i].len;
+    }
+
+    if (fdatasync(fd) != 0)
+    {
+        perror("Failed to flush the wipe");
+        return -1;
+    }
+
+    traceSpan("job", "wipe signatures", traced, bytes);
+
+    printf("Cleared %d signature areas (%lld KiB%s) on %s in %.0f ms\n", plan.count, bytes / 1024,
+           offloaded ? ", zeroed by the device" : "", dev->dev_path, nowMs() - start);
+    return 0;
+}
+
+// Partition tables, filesystem superblocks and image descriptors on the disk and every partition on it
+int wipeSignatures(const UsbDevice *dev)
+{
+    int fd = targetOps(dev)->open(dev, O_RDWR);
+
+    if (fd < 0)
+    {
+        perror("Failed to open device for wiping");
+        return -1;
+    }
+
+    int res = wipeOpen(fd, dev);
+
+    close(fd);
+    return res;
+}
+
+static uint32_t crc32(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t crc = 0xffffffff;
+
+    while (len--)
+    {
+        crc ^= *p++;
+
+        for (int k = 0; k < 8; k++)
+            crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+    }
+
+    return ~crc;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+    put32(p, v);
+    put32(p + 4, v >> 32);
+}
+
+static void randomGuid(uint8_t *guid)
+{
+    if (getrandom(guid, 16, 0) != 16)
+    {
+        for (int i = 0; i < 16; i++)
+            guid[i] = rand();
+    }
+
+    // Version 4, RFC 4122 variant; the first three fields are little-endian
+    guid[7] = (guid[7] & 0x0f) | 0x40;
+    guid[8] = (guid[8] & 0x3f) | 0x80;
+}
+
+static void gptHeader(uint8_t *h, uint64_t self, uint64_t other, uint64_t entries, uint64_t first,
+                      uint64_t last, const uint8_t *diskGuid, uint32_t entriesCrc)
+{
+    memcpy(h, "EFI PART", 8);
+    put32(h + 8, 0x00010000);
+    put32(h + 12, 92);
+    put64(h + 24, self);
+    put64(h + 32, other);
+    put64(h + 40, first);
+    put64(h + 48, last);
+    memcpy(h + 56, diskGuid, 16);
+    put64(h + 72, entries);
+    put32(h + 80, GPT_ENTRIES);
+    put32(h + 84, GPT_ENTRY_SIZE);
+    put32(h + 88, entriesCrc);
+    put32(h + 16, crc32(h, 92));
+}
+
+typedef struct {
+    uint64_t lastLba;
+    uint64_t firstUsable;
+    uint64_t lastUsable;
+    uint64_t partFirst;
+    uint64_t partLast;
+} GptLayout;
+
+// The partition starts at 1 MiB and ends on a 1 MiB boundary before the backup GPT
+static int gptLayout(long long devSize, long long ss, GptLayout *l)
+{
+    uint64_t entrySectors = GPT_ENTRY_BYTES / ss;
+    uint64_t align = PART_ALIGN / ss;
+
+    if (devSize / ss < (long long)(3 * align))
+        return -1;
+
+    l->lastLba = devSize / ss - 1;
+    l->firstUsable = 2 + entrySectors;
+    l->lastUsable = l->lastLba - 1 - entrySectors;
+    l->partFirst = align;
+    l->partLast = (l->lastUsable + 1) / align * align - 1;
+
+    return l->partLast > l->partFirst && l->partLast <= l->lastUsable ? 0 : -1;
+}
+
+// Size of the partition partitionStick will create, for estimates made before anything is wiped
+long long gptPartitionBytes(long long devSize, long long sectorSize)
+{
+    GptLayout l;
+
+    if (gptLayout(devSize, sectorSize, &l) != 0)
+        return 0;
+
+    return (long long)(l.partLast - l.partFirst + 1) * sectorSize;
+}
+
+// Protective MBR plus primary and backup GPT holding one EFI System Partition over the whole disk
+static int writeGpt(int fd, long long devSize, long long ss)
+{
+    GptLayout l;
+
+    if (gptLayout(devSize, ss, &l) != 0)
+    {
+        fprintf(stderr, "Device too small for a partition\n");
+        return -1;
+    }
+
+    uint64_t lastLba = l.lastLba;
+    uint64_t firstUsable = l.firstUsable;
+    uint64_t lastUsable = l.lastUsable;
+    uint64_t partFirst = l.partFirst;
+    uint64_t partLast = l.partLast;
+
+    uint8_t *buf = calloc(1, ss * 2);
+    uint8_t *entries = calloc(1, GPT_ENTRY_BYTES);
+    uint8_t diskGuid[16];
+    int res = -1;
+
+    if (!buf || !entries)
+        goto out;
+
+    randomGuid(diskGuid);
+
+    memcpy(entries, espType, 16);
+    randomGuid(entries + 16);
+    put64(entries + 32, partFirst);
+    put64(entries + 40, partLast);
+
+    const char *label = "GRAPEUSB";
+
+    for (int i = 0; label[i]; i++)
+        put16(entries + 56 + i * 2, label[i]);
+
+    uint32_t entriesCrc = crc32(entries, GPT_ENTRY_BYTES);
+
+    // LBA 0: one 0xEE partition covering as much of the disk as 32 bits can say
+    uint8_t *pmbr = buf + 446;
+    pmbr[4] = 0xee;
+    put32(pmbr + 8, 1);
+    put32(pmbr + 12, lastLba > 0xffffffff ? 0xffffffff : lastLba);
+    pmbr[1] = 0x00;
+    pmbr[2] = 0x02;
+    pmbr[5] = pmbr[6] = pmbr[7] = 0xff;
+    buf[510] = 0x55;
+    buf[511] = 0xaa;
+
+    gptHeader(buf + ss, 1, lastLba, 2, firstUsable, lastUsable, diskGuid, entriesCrc);
+
+    // Backup entries and header first, so a torn write never leaves a primary without its backup
+    if (writeFull(fd, (char *)entries, GPT_ENTRY_BYTES, (lastUsable + 1) * ss) != 0)
+        goto out;
+
+    uint8_t *backup = calloc(1, ss);
+
+    if (!backup)
+        goto out;
+
+    gptHeader(backup, lastLba, 1, lastUsable + 1, firstUsable, lastUsable, diskGuid, entriesCrc);
+
+    int written = writeFull(fd, (char *)backup, ss, lastLba * ss);
+    free(backup);
+
+    if (written != 0 || writeFull(fd, (char *)entries, GPT_ENTRY_BYTES, 2 * ss) != 0 ||
+        writeFull(fd, (char *)buf, ss * 2, 0) != 0 || fdatasync(fd) != 0)
+        goto out;
+
+    res = 0;
+
+out:
+    if (res != 0)
+        perror("Failed to write partition table");
+
+    free(buf);
+    free(entries);
+    return res;
+}
+
+// udev may still hold the disk open from the wipe; the kernel refuses to re-read until it lets go
+static int rereadPartitions(const UsbDevice *dev)
+{
+    for (int i = 0; i < REREAD_TRIES; i++)
+    {
+        int fd = open(dev->dev_path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+            break;
+
+        int res = ioctl(fd, BLKRRPART);
+        int err = errno;
+        close(fd);
+
+        if (res == 0)
+            return 0;
+
+        if (err != EBUSY)
+        {
+            errno = err;
+            break;
+        }
+
+        usleep(100 * 1000);
+    }
+
+    perror("Failed to re-read partition table");
+    return -1;
+}
+
+static int waitForPartition(const UsbDevice *dev)
+{
+    const char *part = strrchr(dev->part_path, '/');
+    char path[256];
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/size", part ? part + 1 : dev->part_path);
+
+    for (int waited = 0; waited < PART_WAIT_MS; waited += 50)
+    {
+        if (access(path, R_OK) == 0 && access(dev->part_path, F_OK) == 0)
+            return 0;
+
+        usleep(50 * 1000);
+    }
+
+    fprintf(stderr, "Partition %s did not appear\n", dev->part_path);
+    return -1;
+}
+
+// Everything a previous layout left behind goes first, then a fresh GPT with one FAT32-sized partition
+int partitionStick(UsbDevice *dev)
+{
+    int fd = targetOps(dev)->open(dev, O_RDWR);
+    long long devSize, sectorSize;
+
+    if (fd < 0)
+    {
+        perror("Failed to open device for partitioning");
+        return -1;
+    }
+
+    unsigned long long traced = traceNow();
+    int res = wipeOpen(fd, dev);
+
+    if (res == 0 && deviceGeometry(fd, &devSize, &sectorSize) != 0)
+    {
+        perror("Failed to read device size");
+        res = -1;
+    }
+
+    if (res == 0)
+        res = writeGpt(fd, devSize, sectorSize);
+
+    close(fd);
+
+    if (res == 0)
+        res = rereadPartitions(dev);
+
+    if (res == 0)
+        res = waitForPartition(dev);
+
+    if (res == 0)
+        traceSpan("job", "partition", traced, -1);
+
+    return res;
+}
\ No newline at end of file
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "progress.h"
+#include "trace.h"
+
+#define REDRAW_INTERVAL_MS 250
+
+static ProgressSlot *slots[MAX_PROGRESS_SLOTS];
+static unsigned long long lastWritten[MAX_PROGRESS_SLOTS];
+static double rates[MAX_PROGRESS_SLOTS];
+static pthread_mutex_t slotLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t displayThread;
+static atomic_int displayRunning = 0;
+static int displayEnabled = 1;
+static int linesDrawn = 0;
+
+static double monotonic()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void progressInit(ProgressSlot *slot, const char *label, unsigned long long total)
+{
+    memset(slot, 0, sizeof(*slot));
+    snprintf(slot->label, sizeof(slot->label), "%s", label);
+    atomic_store(&slot->total, total);
+    atomic_store(&slot->phase, "starting");
+    slot->phaseStarted = monotonic();
+    slot->traceTrack = traceTrack(label);
+    tracePhase(slot->traceTrack, "starting");
+}
+
+// Phases repeat (writing, then writing again after a retry), so time is summed per name
+static void addPhaseTime(ProgressSlot *slot, const char *name, double seconds)
+{
+    int i = 0;
+
+    while (i < slot->phaseCount && strcmp(slot->phaseTimes[i].name, name) != 0)
+        i++;
+
+    if (i == MAX_PHASE_TIMES)
+        return;
+
+    if (i == slot->phaseCount)
+    {
+        slot->phaseTimes[i].name = name;
+        slot->phaseCount++;
+    }
+
+    slot->phaseTimes[i].seconds += seconds;
+}
+
+// One thread at a time moves a slot through its phases; the others only read the current one
+void progressPhase(ProgressSlot *slot, const char *phase)
+{
+    const char *prev = atomic_exchange_explicit(&slot->phase, phase, memory_order_relaxed);
+
+    if (prev != phase)
+    {
+        double now = monotonic();
+
+        addPhaseTime(slot, prev, now - slot->phaseStarted);
+        slot->phaseStarted = now;
+    }
+
+    // Each target gets a row in the trace showing how long every phase took
+    if (slot->traceTrack && prev != phase)
+        tracePhase(slot->traceTrack, phase);
+}
+
+void progressRequestStop(ProgressSlot *slot)
+{
+    atomic_store(&slot->stopRequested, 1);
+}
+
+int progressStopRequested(ProgressSlot *slot)
+{
+    return atomic_load_explicit(&slot->stopRequested, memory_order_relaxed);
+}
+
+void progressAdd(atomic_ullong *counter, unsigned long long bytes)
+{
+    atomic_fetch_add_explicit(counter, bytes, memory_order_relaxed);
+}
+
+// fields 7 and 9 of the block stat file: sectors written and requests in flight
+int readBlockStat(const char *name, unsigned long long *sectors, unsigned *inflight)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/class/block/%s/stat", name);
+
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        return -1;
+
+    int ok = fscanf(f, "%*u %*u %*u %*u %*u %*u %llu %*u %u", sectors, inflight) == 2;
+    fclose(f);
+
+    return ok ? 0 : -1;
+}
+
+// For phases run by external tools, the kernel's per-device counters stand in for our own
+void progressTrackKernel(ProgressSlot *slot, const char *devName)
+{
+    unsigned inflight;
+
+    snprintf(slot->sysfsName, sizeof(slot->sysfsName), "%s", devName);
+
+    if (readBlockStat(devName, &slot->sysfsBase, &inflight) != 0)
+        return;
+
+    atomic_store(&slot->kernelTracked, 1);
+}
+
+void progressUntrackKernel(ProgressSlot *slot)
+{
+    atomic_store(&slot->kernelTracked, 0);
+}
+
+// Pulls the kernel's counters into a kernel-tracked slot; the view does this every frame
+void progressSample(ProgressSlot *slot)
+{
+    unsigned long long sectors;
+    unsigned inflight;
+
+    if (!atomic_load(&slot->kernelTracked) || readBlockStat(slot->sysfsName, &sectors, &inflight) != 0)
+        return;
+
+    atomic_store_explicit(&slot->bytesWritten, (sectors - slot->sysfsBase) * 512, memory_order_relaxed);
+    atomic_store_explicit(&slot->queueDepth, inflight, memory_order_relaxed);
+}
+
+// Embedders read the slots themselves, so the terminal view stays off
+void progressSetDisplay(int enabled)
+{
+    displayEnabled = enabled;
+}
+
+int progressRegister(ProgressSlot *slot)
+{
+    int res = -1;
+
+    if (!displayEnabled)
+        return 0;
+
+    pthread_mutex_lock(&slotLock);
+
+    for (int i = 0; i < MAX_PROGRESS_SLOTS; i++)
+    {
+        if (slots[i] == NULL)
+        {
+            slots[i] = slot;
+            lastWritten[i] = 0;
+            rates[i] = 0;
+            res = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&slotLock);
+    return res;
+}
+
+void progressUnregister(ProgressSlot *slot)
+{
+    pthread_mutex_lock(&slotLock);
+
+    for (int i = 0; i < MAX_PROGRESS_SLOTS; i++)
+    {
+        if (slots[i] == slot)
+            slots[i] = NULL;
+    }
+
+    pthread_mutex_unlock(&slotLock);
+}
+
+static double gib(unsigned long long bytes)
+{
+    return bytes / 1073741824.0;
+}
+
+static void drawSlot(int i, double dt)
+{
+    ProgressSlot *slot = slots[i];
+
+    progressSample(slot);
+
+    unsigned long long total = atomic_load_explicit(&slot->total, memory_order_relaxed);
+    unsigned long long rd = atomic_load_explicit(&slot->bytesRead, memory_order_relaxed);
+    unsigned long long wr = atomic_load_explicit(&slot->bytesWritten, memory_order_relaxed);
+    unsigned long long fl = atomic_load_explicit(&slot->bytesFlushed, memory_order_relaxed);
+    unsigned long long vf = atomic_load_explicit(&slot->bytesVerified, memory_order_relaxed);
+    unsigned qd = atomic_load_explicit(&slot->queueDepth, memory_order_relaxed);
+    const char *phase = atomic_load_explicit(&slot->phase, memory_order_relaxed);
+
+    if (dt > 0 && wr >= lastWritten[i])
+    {
+        double inst = (wr - lastWritten[i]) / dt;
+        rates[i] = rates[i] == 0 ? inst : rates[i] * 0.7 + inst * 0.3;
+    }
+    lastWritten[i] = wr;
+
+    double mbs = rates[i] / 1048576.0;
+    int pct = total ? (int)(wr * 100 / total) : 0;
+
+    printf("\r\033[K %-8s %-10s %3d%%  R %.2f  W %.2f  F %.2f  V %.2f / %.2f GiB  %6.1f MB/s  q%-3u",
+           slot->label, phase, pct > 100 ? 100 : pct,
+           gib(rd), gib(wr), gib(fl), gib(vf), gib(total), mbs, qd);
+
+    if (rates[i] > 0 && total > wr)
+    {
+        long eta = (long)((total - wr) / rates[i]);
+        printf(" ETA %02ld:%02ld:%02ld", eta / 3600, eta / 60 % 60, eta % 60);
+    }
+
+    printf("\n");
+}
+
+// Moves the cursor back over the previous frame instead of clearing the screen
+static void drawFrame(double dt)
+{
+    pthread_mutex_lock(&slotLock);
+
+    if (linesDrawn > 0)
+        printf("\033[%dA", linesDrawn);
+
+    int lines = 0;
+
+    for (int i = 0; i < MAX_PROGRESS_SLOTS; i++)
+    {
+        if (slots[i])
+        {
+            drawSlot(i, dt);
+            lines++;
+        }
+    }
+
+    for (int i = lines; i < linesDrawn; i++)
+        printf("\r\033[K\n");
+
+    if (lines < linesDrawn)
+        printf("\033[%dA", linesDrawn - lines);
+
+    linesDrawn = lines;
+    fflush(stdout);
+
+    pthread_mutex_unlock(&slotLock);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *displayWorker(void *arg)
+{
+    (void)arg;
+    double last = now();
+
+    while (atomic_load(&displayRunning))
+    {
+        usleep(REDRAW_INTERVAL_MS * 1000);
+
+        double t = now();
+        drawFrame(t - last);
+        last = t;
+    }
+
+    return NULL;
+}
+
+void progressStart()
+{
+    if (!displayEnabled || atomic_exchange(&displayRunning, 1))
+        return;
+
+    linesDrawn = 0;
+
+    if (pthread_create(&displayThread, NULL, displayWorker, NULL) != 0)
+        atomic_store(&displayRunning, 0);
+}
+
+void progressStop()
+{
+    if (!atomic_exchange(&displayRunning, 0))
+        return;
+
+    pthread_join(displayThread, NULL);
+    drawFrame(0);
+    linesDrawn = 0;
+}
\ No newline at end of file
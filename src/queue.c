@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "queue.h"
+#include "trace.h"
+
+#define POLL_MS            100
+#define WARMUP_SECONDS     3.0      // of writing before measuring; the first burst lands in caches
+#define WINDOW_SECONDS     2.0      // each A/B window; ABBA cancels a steady drift like a filling SLC cache
+#define KEEP_MARGIN        0.97     // the profile stays unless it is clearly slower than the defaults
+#define TUNED_NR_REQUESTS  "256"
+#define TUNED_READ_AHEAD   4096     // KiB, for the verify pass
+
+enum { SET_SCHEDULER, SET_MAX_SECTORS, SET_NR_REQUESTS, SET_READ_AHEAD };
+
+static const char *attrs[QUEUE_SETTINGS] = {
+    "queue/scheduler", "queue/max_sectors_kb", "queue/nr_requests", "queue/read_ahead_kb"
+};
+
+// Seen by the signal handler without locking; slots are only claimed and cleared under the lock
+static QueueTune *_Atomic active[MAX_PROGRESS_SLOTS];
+static pthread_mutex_t activeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int readAttr(const char *path, char *out, size_t len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    ssize_t n = read(fd, out, len - 1);
+    close(fd);
+
+    if (n <= 0)
+        return -1;
+
+    out[n] = '\0';
+    out[strcspn(out, "\n")] = '\0';
+    return 0;
+}
+
+// Only open, write and close, so the signal handler can use it too
+static int writeAttr(const char *path, const char *value)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    ssize_t n = write(fd, value, strlen(value));
+    close(fd);
+
+    return n == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+static void applySetting(QueueSetting *s, const char *value)
+{
+    if (s->saved[0] == '\0' || strcmp(s->saved, value) == 0)
+        return;
+
+    if (writeAttr(s->path, value) == 0)
+        atomic_store(&s->changed, 1);
+}
+
+static void restoreRange(QueueTune *q, int from, int to)
+{
+    // In the order they were applied, so nr_requests lands after the scheduler switch
+    for (int i = from; i < to; i++)
+    {
+        QueueSetting *s = &q->settings[i];
+
+        if (atomic_exchange(&s->changed, 0))
+            writeAttr(s->path, s->saved);
+    }
+}
+
+static void restoreSettings(QueueTune *q)
+{
+    restoreRange(q, 0, QUEUE_SETTINGS);
+}
+
+// Everything the write path uses, not the read-ahead
+static void restoreWriteSettings(QueueTune *q)
+{
+    restoreRange(q, 0, SET_READ_AHEAD);
+}
+
+// "mq-deadline kyber [bfq] none": only the bracketed one is in use
+static int parseScheduler(char *list, char *active, size_t len, int *bfqAvailable)
+{
+    char *start = strchr(list, '[');
+    char *end = start ? strchr(start, ']') : NULL;
+
+    if (bfqAvailable)
+        *bfqAvailable = strstr(list, "bfq") != NULL;
+
+    if (!start || !end)
+        return -1;
+
+    snprintf(active, len, "%.*s", (int)(end - start - 1), start + 1);
+    return 0;
+}
+
+// Only bfq acts on I/O priorities, none, mq-deadline and kyber ignore them; path is a block device
+// or any file on one. Returns 1 if its queue honours priorities, 0 if not, -1 if it cannot tell
+int queueHonoursPriority(const char *path, char *scheduler, size_t len, int *bfqAvailable)
+{
+    struct stat st;
+    char attr[128], list[128];
+
+    if (stat(path, &st) != 0)
+        return -1;
+
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+
+    // A partition has no queue of its own, it uses its disk's
+    snprintf(attr, sizeof(attr), "/sys/dev/block/%u:%u/queue/scheduler", major(dev), minor(dev));
+
+    if (readAttr(attr, list, sizeof(list)) != 0)
+    {
+        snprintf(attr, sizeof(attr), "/sys/dev/block/%u:%u/../queue/scheduler", major(dev), minor(dev));
+
+        if (readAttr(attr, list, sizeof(list)) != 0)
+            return -1;
+    }
+
+    if (parseScheduler(list, scheduler, len, bfqAvailable) != 0)
+        return -1;
+
+    return strcmp(scheduler, "bfq") == 0;
+}
+
+// tuned: the job's queue profile will switch the device to bfq if it has it
+void queueWarnPriority(const char *path, const char *what, int tuned)
+{
+    char scheduler[32];
+    int bfq = 0;
+
+    if (queueHonoursPriority(path, scheduler, sizeof(scheduler), &bfq) != 0 || (tuned && bfq))
+        return;
+
+    printf("\033[1;33mWarning: %s (%s) uses the %s scheduler, which ignores I/O priorities; "
+           "--ioprio only has an effect under bfq%s\033[0m\n",
+           what, path, scheduler, bfq ? ", which it offers" : ", which it does not offer, use --bwlimit instead");
+}
+
+static void applyWriteProfile(QueueTune *q)
+{
+    char path[128], value[32], list[128], inUse[32];
+    long long current = atoll(q->settings[SET_MAX_SECTORS].saved);
+    int bfq = 0;
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/queue/scheduler", q->name);
+
+    if (readAttr(path, list, sizeof(list)) != 0 || parseScheduler(list, inUse, sizeof(inUse), &bfq) != 0)
+        bfq = 0;
+
+    // One request per 4 MiB chunk is fine for a stick, no scheduler needs to reorder it; but only
+    // bfq honours I/O priorities, so a job using them keeps or gets it
+    if (!q->priorities)
+        applySetting(&q->settings[SET_SCHEDULER], "none");
+    else if (bfq)
+        applySetting(&q->settings[SET_SCHEDULER], "bfq");
+
+    // Switching schedulers resets nr_requests, so it needs putting back either way
+    if (atomic_load(&q->settings[SET_SCHEDULER].changed) && q->settings[SET_NR_REQUESTS].saved[0])
+        atomic_store(&q->settings[SET_NR_REQUESTS].changed, 1);
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/queue/max_hw_sectors_kb", q->name);
+
+    if (readAttr(path, value, sizeof(value)) == 0 && atoll(value) > current)
+        applySetting(&q->settings[SET_MAX_SECTORS], value);
+
+    if (atoll(q->settings[SET_NR_REQUESTS].saved) < atoll(TUNED_NR_REQUESTS))
+        applySetting(&q->settings[SET_NR_REQUESTS], TUNED_NR_REQUESTS);
+}
+
+static void applyReadAhead(QueueTune *q)
+{
+    char value[32];
+
+    if (atoll(q->settings[SET_READ_AHEAD].saved) < TUNED_READ_AHEAD)
+    {
+        snprintf(value, sizeof(value), "%d", TUNED_READ_AHEAD);
+        applySetting(&q->settings[SET_READ_AHEAD], value);
+    }
+}
+
+static int writePhase(ProgressSlot *slot)
+{
+    const char *phase = atomic_load(&slot->phase);
+    return strcmp(phase, "writing") == 0 || strcmp(phase, "copying") == 0;
+}
+
+static int sectorsWritten(const QueueTune *q, unsigned long long *sectors)
+{
+    unsigned inflight;
+    return readBlockStat(q->name, sectors, &inflight);
+}
+
+static void useProfile(QueueTune *q, int tuned)
+{
+    unsigned long long traced = traceNow();
+
+    if (tuned)
+        applyWriteProfile(q);
+    else
+        restoreWriteSettings(q);
+
+    traceSpan("job", tuned ? "tuned queue" : "default queue", traced, -1);
+}
+
+// Settles which write settings to keep by alternating them over equal windows (defaults, profile,
+// profile, defaults) once the write is past its warm-up, then keeps the faster for the rest
+static void *tuneWorker(void *arg)
+{
+    static const int order[] = {0, 1, 1, 0};
+    QueueTune *q = arg;
+    unsigned long long base = 0, sectors;
+    unsigned long long bytes[2] = {0, 0};
+    double seconds[2] = {0, 0};
+    double since = 0;
+    int window = -1, started = 0;
+
+    traceThreadName("queue tuner");
+
+    while (!atomic_load(&q->stop))
+    {
+        int writing = writePhase(q->slot);
+
+        if (!started && writing && sectorsWritten(q, &base) == 0)
+        {
+            since = now();
+            started = 1;
+        }
+        else if (started && q->verdict == 0 && sectorsWritten(q, &sectors) == 0)
+        {
+            double elapsed = now() - since;
+
+            // A write that ends before the comparison does keeps the defaults, the verify still gets read-ahead
+            if (!writing)
+            {
+                if (window >= 0)
+                    restoreWriteSettings(q);
+
+                q->verdict = -1;
+                applyReadAhead(q);
+            }
+            else if (window < 0 && elapsed >= WARMUP_SECONDS)
+            {
+                window = 0;
+                base = sectors;
+                since = now();
+                useProfile(q, order[window]);
+            }
+            else if (window >= 0 && elapsed >= WINDOW_SECONDS)
+            {
+                bytes[order[window]] += (sectors - base) * 512;
+                seconds[order[window]] += elapsed;
+
+                if (++window < (int)(sizeof(order) / sizeof(order[0])))
+                {
+                    base = sectors;
+                    since = now();
+                    useProfile(q, order[window]);
+                }
+                else
+                {
+                    unsigned long long rateDefault = bytes[0] / seconds[0];
+                    unsigned long long rateTuned = bytes[1] / seconds[1];
+
+                    atomic_store(&q->slot->rateDefault, rateDefault);
+                    atomic_store(&q->slot->rateTuned, rateTuned);
+
+                    q->verdict = rateTuned >= rateDefault * KEEP_MARGIN ? 1 : -1;
+                    useProfile(q, q->verdict > 0);
+                    applyReadAhead(q);
+                }
+            }
+        }
+
+        usleep(POLL_MS * 1000);
+    }
+
+    return NULL;
+}
+
+int startQueueTune(QueueTune *q, const char *name, ProgressSlot *slot, int priorities)
+{
+    memset(q, 0, sizeof(*q));
+    snprintf(q->name, sizeof(q->name), "%s", name);
+    q->slot = slot;
+    q->priorities = priorities;
+
+    for (int i = 0; i < QUEUE_SETTINGS; i++)
+    {
+        QueueSetting *s = &q->settings[i];
+        snprintf(s->path, sizeof(s->path), "/sys/class/block/%s/%s", name, attrs[i]);
+
+        if (readAttr(s->path, s->saved, sizeof(s->saved)) != 0)
+            s->saved[0] = '\0';
+    }
+
+    char *sched = q->settings[SET_SCHEDULER].saved;
+    char inUse[sizeof(q->settings[SET_SCHEDULER].saved)];
+
+    if (parseScheduler(sched, inUse, sizeof(inUse), NULL) == 0)
+        memcpy(sched, inUse, sizeof(inUse));
+    else
+        sched[0] = '\0';
+
+    int slotIndex = -1;
+
+    pthread_mutex_lock(&activeLock);
+
+    for (int i = 0; i < MAX_PROGRESS_SLOTS && slotIndex < 0; i++)
+    {
+        if (atomic_load(&active[i]) == NULL)
+        {
+            atomic_store(&active[i], q);
+            slotIndex = i;
+        }
+    }
+
+    pthread_mutex_unlock(&activeLock);
+
+    // Without a way to put the settings back on a signal, leave them alone
+    if (slotIndex < 0)
+        return -1;
+
+    if (pthread_create(&q->thread, NULL, tuneWorker, q) != 0)
+    {
+        atomic_store(&active[slotIndex], NULL);
+        return -1;
+    }
+
+    q->running = 1;
+    return 0;
+}
+
+void stopQueueTune(QueueTune *q)
+{
+    if (!q->running)
+        return;
+
+    atomic_store(&q->stop, 1);
+    pthread_join(q->thread, NULL);
+    q->running = 0;
+
+    restoreSettings(q);
+
+    pthread_mutex_lock(&activeLock);
+
+    for (int i = 0; i < MAX_PROGRESS_SLOTS; i++)
+    {
+        if (atomic_load(&active[i]) == q)
+            atomic_store(&active[i], NULL);
+    }
+
+    pthread_mutex_unlock(&activeLock);
+
+    unsigned long long before = atomic_load(&q->slot->rateDefault);
+    unsigned long long after = atomic_load(&q->slot->rateTuned);
+
+    if (before > 0 && after > 0)
+        printf("Queue tuning on %s: %.1f MB/s with kernel defaults, %.1f MB/s tuned (%+.0f%%), %s\n",
+               q->name, before / 1048576.0, after / 1048576.0, (after - (double)before) * 100 / before,
+               q->verdict > 0 ? "kept the profile" : "went back to the defaults");
+}
+
+static void restoreAll()
+{
+    for (int i = 0; i < MAX_PROGRESS_SLOTS; i++)
+    {
+        QueueTune *q = atomic_load(&active[i]);
+
+        if (q)
+            restoreSettings(q);
+    }
+}
+
+static void onFatalSignal(int sig)
+{
+    restoreAll();
+
+    // atexit handlers never run once the default action kills the process
+    traceFlush();
+
+    // SA_RESETHAND has put the default action back
+    raise(sig);
+}
+
+// A job killed mid-write must not leave the stick with the tuned queue
+void queueRestoreOnExit()
+{
+    struct sigaction sa = {0};
+    sa.sa_handler = onFatalSignal;
+    sa.sa_flags = SA_RESETHAND;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    atexit(restoreAll);
+}
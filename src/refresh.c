@@ -0,0 +1,784 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "utils.h"
+#include "hash.h"
+#include "throttle.h"
+#include "refresh.h"
+#include "trace.h"
+
+#define HASH_BUF     (1024 * 1024)
+#define COPY_BUF     (4 * 1024 * 1024)  // one FAT cluster run and one stick erase block per write
+#define MAX_HASHERS  8
+#define MAX_COPIERS  4
+
+typedef enum {
+    ENTRY_KEEP,
+    ENTRY_ADD,
+    ENTRY_REPLACE,
+    ENTRY_DELETE
+} EntryAction;
+
+typedef struct {
+    char *path;                 // relative to the tree root
+    long long size;
+    int dir;
+    struct timespec mtime;
+    EntryAction action;
+} Entry;
+
+typedef struct {
+    const char *root;
+    const char *const *skip;
+    Entry *items;
+    int count;
+    int cap;
+    int failed;
+} Manifest;
+
+typedef struct {
+    Entry *src;
+    Entry *dst;
+} Pair;
+
+typedef struct {
+    const char *srcRoot;
+    const char *dstRoot;
+    Pair *pairs;
+    int count;
+    atomic_int next;
+    atomic_int failed;
+    atomic_llong hashed;
+    ProgressSlot *progress;
+} HashJob;
+
+typedef struct {
+    Entry *entry;
+    long long physical;         // where the data starts in the image, -1 if unknown
+    int order;                  // position in the manifest, for files that could not be mapped
+} CopyItem;
+
+typedef struct {
+    const char *srcRoot;
+    const char *dstRoot;
+    CopyItem *items;
+    int count;
+    atomic_int next;
+    atomic_int failed;
+    atomic_llong written;
+    ProgressSlot *progress;
+} CopyJob;
+
+static int isSkipped(const char *const *skip, const char *path)
+{
+    for (int i = 0; skip && skip[i]; i++)
+    {
+        if (fnmatch(skip[i], path, FNM_PATHNAME | FNM_CASEFOLD) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int addEntry(Manifest *m, const char *path, const struct stat *st)
+{
+    if (m->count == m->cap)
+    {
+        int cap = m->cap ? m->cap * 2 : 256;
+        Entry *items = realloc(m->items, cap * sizeof(Entry));
+
+        if (!items)
+            return -1;
+
+        m->items = items;
+        m->cap = cap;
+    }
+
+    Entry *e = &m->items[m->count];
+
+    e->path = strdup(path);
+    e->size = st->st_size;
+    e->dir = S_ISDIR(st->st_mode);
+    e->mtime = st->st_mtim;
+    e->action = ENTRY_KEEP;
+
+    if (!e->path)
+        return -1;
+
+    m->count++;
+    return 0;
+}
+
+static void scanDir(Manifest *m, int dirfd, const char *prefix)
+{
+    DIR *dir = fdopendir(dirfd);
+
+    if (!dir)
+    {
+        close(dirfd);
+        m->failed = 1;
+        return;
+    }
+
+    struct dirent *ent;
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        char path[PATH_MAX];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s%s%s", prefix, prefix[0] ? "/" : "", ent->d_name);
+
+        if (isSkipped(m->skip, path) || fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+        // FAT has nothing but files and directories, so nothing else is compared
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+            continue;
+
+        if (addEntry(m, path, &st) != 0)
+        {
+            m->failed = 1;
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            int sub = openat(dirfd, ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if (sub < 0)
+                m->failed = 1;
+            else
+                scanDir(m, sub, path);
+        }
+    }
+
+    closedir(dir);
+}
+
+// FAT matches names without regard to case, so both sides sort and pair up the same way
+static int compareEntries(const void *a, const void *b)
+{
+    return strcasecmp(((const Entry *)a)->path, ((const Entry *)b)->path);
+}
+
+static void *scanWorker(void *arg)
+{
+    Manifest *m = arg;
+    int fd = open(m->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        perror(m->root);
+        m->failed = 1;
+        return NULL;
+    }
+
+    scanDir(m, fd, "");
+    qsort(m->items, m->count, sizeof(Entry), compareEntries);
+
+    return NULL;
+}
+
+static void freeManifest(Manifest *m)
+{
+    for (int i = 0; i < m->count; i++)
+        free(m->items[i].path);
+
+    free(m->items);
+}
+
+static int hashFile(HashJob *job, const char *root, const char *rel, char *buf, uint64_t *out)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    unsigned long long traced = traceNow();
+    HashState h;
+    ssize_t n;
+    int res = 0;
+
+    hashInit(&h);
+
+    while ((n = read(fd, buf, HASH_BUF)) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 || progressStopRequested(job->progress))
+        {
+            res = -1;
+            break;
+        }
+
+        throttleRead(n);
+        hashUpdate(&h, buf, n);
+        atomic_fetch_add(&job->hashed, n);
+        progressAdd(&job->progress->bytesRead, n);
+    }
+
+    close(fd);
+    *out = hashFinal(&h);
+
+    traceSpan("io", rel, traced, -1);
+
+    return res;
+}
+
+// Equal sizes still have to be read on both sides; a pair that differs is queued for copying
+static void *hashWorker(void *arg)
+{
+    HashJob *job = arg;
+    char *buf = malloc(HASH_BUF);
+    int i;
+
+    if (!buf)
+    {
+        atomic_store(&job->failed, 1);
+        return NULL;
+    }
+
+    traceThreadName("refresh hash");
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count && !atomic_load(&job->failed))
+    {
+        Pair *p = &job->pairs[i];
+        uint64_t srcHash, dstHash;
+
+        if (hashFile(job, job->srcRoot, p->src->path, buf, &srcHash) != 0)
+        {
+            fprintf(stderr, "Failed to read %s/%s\n", job->srcRoot, p->src->path);
+            atomic_store(&job->failed, 1);
+            break;
+        }
+
+        // An unreadable copy on the stick is simply replaced
+        if (hashFile(job, job->dstRoot, p->dst->path, buf, &dstHash) != 0 || srcHash != dstHash)
+            p->src->action = ENTRY_REPLACE;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static int hashPairs(HashJob *job)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus < 1 ? 1 : cpus > MAX_HASHERS ? MAX_HASHERS : (int)cpus;
+    pthread_t threads[MAX_HASHERS];
+    int started = 0;
+
+    if (workers > job->count)
+        workers = job->count;
+
+    while (started < workers && pthread_create(&threads[started], NULL, hashWorker, job) == 0)
+        started++;
+
+    if (started == 0 && job->count > 0)
+        hashWorker(job);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    return atomic_load(&job->failed) ? -1 : 0;
+}
+
+// Marks what each side needs; pairs with equal sizes are left for hashing
+static int diffManifests(Manifest *src, Manifest *dst, Pair *pairs)
+{
+    int i = 0, j = 0, n = 0;
+
+    while (i < src->count || j < dst->count)
+    {
+        int c = i == src->count ? 1 : j == dst->count ? -1
+              : strcasecmp(src->items[i].path, dst->items[j].path);
+
+        if (c < 0)
+        {
+            src->items[i++].action = ENTRY_ADD;
+            continue;
+        }
+
+        if (c > 0)
+        {
+            dst->items[j++].action = ENTRY_DELETE;
+            continue;
+        }
+
+        Entry *s = &src->items[i++];
+        Entry *d = &dst->items[j++];
+
+        if (s->dir != d->dir)
+        {
+            // A file became a directory or the other way round
+            d->action = ENTRY_DELETE;
+            s->action = ENTRY_ADD;
+        }
+        else if (!s->dir && s->size != d->size)
+        {
+            s->action = ENTRY_REPLACE;
+        }
+        else if (!s->dir)
+        {
+            pairs[n].src = s;
+            pairs[n].dst = d;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static int removeEntry(const char *root, const Entry *e)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", root, e->path);
+
+    int res = e->dir ? rmdir(path) : unlink(path);
+
+    if (res != 0 && errno != ENOENT)
+    {
+        perror(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Directories and empty files first, so their entries sit together ahead of the bulk data
+static int createEntry(const char *dstRoot, const Entry *e)
+{
+    char dstPath[PATH_MAX];
+    snprintf(dstPath, sizeof(dstPath), "%s/%s", dstRoot, e->path);
+
+    if (e->dir)
+    {
+        if (mkdir(dstPath, 0755) != 0 && errno != EEXIST)
+        {
+            perror(dstPath);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    int fd = open(dstPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        perror(dstPath);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int copyEntry(const char *srcRoot, const char *dstRoot, const Entry *e, char *buf,
+                     ProgressSlot *progress, long long *written)
+{
+    char srcPath[PATH_MAX];
+    char dstPath[PATH_MAX];
+
+    snprintf(srcPath, sizeof(srcPath), "%s/%s", srcRoot, e->path);
+    snprintf(dstPath, sizeof(dstPath), "%s/%s", dstRoot, e->path);
+
+    unsigned long long traced = traceNow();
+    int in = open(srcPath, O_RDONLY | O_CLOEXEC);
+    int out = open(dstPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int res = in >= 0 && out >= 0 ? 0 : -1;
+
+    // Claims the whole file's clusters in one go, so vfat hands out one contiguous run instead of
+    // extending the chain on every write; KEEP_SIZE because vfat zero-fills a plain fallocate
+    if (res == 0 && e->size > 0 && fallocate(out, FALLOC_FL_KEEP_SIZE, 0, e->size) != 0 &&
+        errno != EOPNOTSUPP)
+    {
+        res = -1;
+    }
+
+    if (in >= 0)
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (long long off = 0; res == 0 && off < e->size; off += COPY_BUF)
+    {
+        size_t len = e->size - off < COPY_BUF ? (size_t)(e->size - off) : COPY_BUF;
+
+        throttleRead(len);
+
+        if (progressStopRequested(progress) || readFull(in, buf, len, off) != 0)
+        {
+            res = -1;
+            break;
+        }
+
+        throttleWrite(len);
+
+        if (writeFull(out, buf, len, off) != 0)
+        {
+            res = -1;
+            break;
+        }
+
+        progressAdd(&progress->bytesWritten, len);
+        *written += len;
+    }
+
+    if (res == 0)
+    {
+        // Same as rsync -a: later refreshes and file managers see the release's timestamps
+        struct timespec times[2] = {e->mtime, e->mtime};
+        futimens(out, times);
+    }
+
+    if (res != 0)
+        perror(dstPath);
+
+    if (in >= 0)
+        close(in);
+    if (out >= 0 && close(out) != 0 && res == 0)
+    {
+        perror(dstPath);
+        res = -1;
+    }
+
+    traceSpan("copy", e->path, traced, e->size);
+
+    return res;
+}
+
+// FIEMAP where the filesystem has it; isofs and udf only answer FIBMAP, in their own block size
+static long long physicalOffset(const char *root, const char *rel)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm = {.map = {.fm_length = FIEMAP_MAX_OFFSET, .fm_extent_count = 1}};
+
+    long long physical = -1;
+    int block = 0, blockSize;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm) == 0 && fm.map.fm_mapped_extents > 0)
+        physical = fm.extent.fe_physical;
+    else if (ioctl(fd, FIGETBSZ, &blockSize) == 0 && ioctl(fd, FIBMAP, &block) == 0 && block > 0)
+        physical = (long long)block * blockSize;
+
+    close(fd);
+    return physical;
+}
+
+// Mapped files by where they sit in the image, the rest after them in manifest order
+static int compareItems(const void *a, const void *b)
+{
+    const CopyItem *x = a, *y = b;
+
+    if ((x->physical < 0) != (y->physical < 0))
+        return x->physical < 0 ? 1 : -1;
+
+    if (x->physical != y->physical)
+        return x->physical < y->physical ? -1 : 1;
+
+    return x->order - y->order;
+}
+
+static void *copyWorker(void *arg)
+{
+    CopyJob *job = arg;
+    char *buf = NULL;
+    int i;
+
+    if (posix_memalign((void **)&buf, 4096, COPY_BUF) != 0)
+    {
+        atomic_store(&job->failed, 1);
+        return NULL;
+    }
+
+    traceThreadName("copy");
+
+    // Each worker takes the next file up the image, so together they read it in one sweep
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count && !atomic_load(&job->failed))
+    {
+        long long written = 0;
+
+        if (copyEntry(job->srcRoot, job->dstRoot, job->items[i].entry, buf, job->progress, &written) != 0)
+            atomic_store(&job->failed, 1);
+
+        atomic_fetch_add(&job->written, written);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static int copyItems(CopyJob *job)
+{
+    unsigned long long traced = traceNow();
+    int mapped = 0;
+
+    for (int i = 0; i < job->count; i++)
+    {
+        job->items[i].physical = physicalOffset(job->srcRoot, job->items[i].entry->path);
+        // Empty files have nothing to read, wherever they end up
+        mapped += job->items[i].physical >= 0 || job->items[i].entry->size == 0;
+    }
+
+    qsort(job->items, job->count, sizeof(CopyItem), compareItems);
+    traceSpan("copy", "map extents", traced, -1);
+
+    if (job->count > 0 && mapped < job->count)
+        printf("Copy order: %d of %d files mapped in the image, the rest follow in directory order\n",
+               mapped, job->count);
+
+    // Preallocated files keep their own cluster runs, so concurrent writers do not interleave them
+    int workers = job->count < MAX_COPIERS ? job->count : MAX_COPIERS;
+    pthread_t threads[MAX_COPIERS];
+    int started = 0;
+
+    while (started < workers && pthread_create(&threads[started], NULL, copyWorker, job) == 0)
+        started++;
+
+    if (started == 0 && job->count > 0)
+        copyWorker(job);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    return atomic_load(&job->failed) ? -1 : 0;
+}
+
+static int applyChanges(Manifest *src, Manifest *dst, ProgressSlot *progress, RefreshStats *stats)
+{
+    // Deepest first, so directories are empty by the time they go
+    for (int j = dst->count - 1; j >= 0; j--)
+    {
+        if (dst->items[j].action != ENTRY_DELETE)
+            continue;
+
+        if (removeEntry(dst->root, &dst->items[j]) != 0)
+            return -1;
+
+        stats->deleted++;
+    }
+
+    CopyJob job = {.srcRoot = src->root, .dstRoot = dst->root, .progress = progress};
+
+    job.items = malloc((src->count ? src->count : 1) * sizeof(CopyItem));
+
+    if (!job.items)
+        return -1;
+
+    int res = 0;
+
+    // Sorted order creates every directory before its contents
+    for (int i = 0; i < src->count && res == 0; i++)
+    {
+        if (src->items[i].action != ENTRY_KEEP)
+            res = createEntry(dst->root, &src->items[i]);
+    }
+
+    for (int i = 0; i < src->count && res == 0; i++)
+    {
+        Entry *e = &src->items[i];
+
+        if (e->action == ENTRY_KEEP)
+        {
+            if (!e->dir)
+            {
+                stats->unchanged++;
+                stats->unchangedBytes += e->size;
+            }
+            continue;
+        }
+
+        if (!e->dir)
+        {
+            job.items[job.count].entry = e;
+            job.items[job.count].order = job.count;
+            job.count++;
+        }
+
+        if (e->action == ENTRY_ADD)
+            stats->added++;
+        else
+            stats->replaced++;
+    }
+
+    if (res == 0)
+        res = copyItems(&job);
+
+    stats->writtenBytes = atomic_load(&job.written);
+
+    free(job.items);
+    return res;
+}
+
+// One flush for the whole tree instead of one per file
+int flushTree(const char *dst)
+{
+    unsigned long long traced = traceNow();
+    int fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int res = 0;
+
+    if (fd >= 0)
+    {
+        if (syncfs(fd) != 0)
+        {
+            perror("Failed to flush the stick");
+            res = -1;
+        }
+        close(fd);
+    }
+
+    traceSpan("io", "syncfs", traced, -1);
+    return res;
+}
+
+// Brings dst in line with src, touching only what differs; skip lists fnmatch patterns left alone on both sides
+int refreshTree(const char *src, const char *dst, const char *const *skip,
+                ProgressSlot *progress, RefreshStats *stats)
+{
+    Manifest srcTree = {.root = src, .skip = skip};
+    Manifest dstTree = {.root = dst, .skip = skip};
+    pthread_t scanner;
+    Pair *pairs = NULL;
+    int res = -1;
+
+    memset(stats, 0, sizeof(*stats));
+    progressPhase(progress, "comparing");
+
+    // The image and the stick are different devices, so both listings run at once
+    int threaded = pthread_create(&scanner, NULL, scanWorker, &dstTree) == 0;
+
+    scanWorker(&srcTree);
+
+    if (threaded)
+        pthread_join(scanner, NULL);
+    else
+        scanWorker(&dstTree);
+
+    if (srcTree.failed || dstTree.failed)
+    {
+        fprintf(stderr, "Failed to list %s\n", srcTree.failed ? src : dst);
+        goto out;
+    }
+
+    pairs = malloc((srcTree.count ? srcTree.count : 1) * sizeof(Pair));
+
+    if (!pairs)
+        goto out;
+
+    HashJob job = {
+        .srcRoot = src,
+        .dstRoot = dst,
+        .pairs = pairs,
+        .count = diffManifests(&srcTree, &dstTree, pairs),
+        .progress = progress,
+    };
+
+    if (hashPairs(&job) != 0)
+        goto out;
+
+    stats->hashedBytes = atomic_load(&job.hashed);
+
+    unsigned long long toWrite = 0;
+
+    for (int i = 0; i < srcTree.count; i++)
+    {
+        if (srcTree.items[i].action != ENTRY_KEEP && !srcTree.items[i].dir)
+            toWrite += srcTree.items[i].size;
+    }
+
+    atomic_store(&progress->total, toWrite);
+    progressPhase(progress, "copying");
+
+    res = applyChanges(&srcTree, &dstTree, progress, stats);
+
+    if (flushTree(dst) != 0)
+        res = -1;
+
+out:
+    free(pairs);
+    freeManifest(&srcTree);
+    freeManifest(&dstTree);
+
+    return res;
+}
+
+// Copies src into an empty dst: every directory and file entry first, then the data file by file
+int copyTree(const char *src, const char *dst, const char *const *skip,
+             ProgressSlot *progress, RefreshStats *stats)
+{
+    Manifest srcTree = {.root = src, .skip = skip};
+    Manifest dstTree = {.root = dst};
+
+    memset(stats, 0, sizeof(*stats));
+    scanWorker(&srcTree);
+
+    if (srcTree.failed)
+    {
+        fprintf(stderr, "Failed to list %s\n", src);
+        freeManifest(&srcTree);
+        return -1;
+    }
+
+    unsigned long long toWrite = 0;
+
+    for (int i = 0; i < srcTree.count; i++)
+    {
+        srcTree.items[i].action = ENTRY_ADD;
+
+        if (!srcTree.items[i].dir)
+            toWrite += srcTree.items[i].size;
+    }
+
+    // Added rather than stored, so a caller can count work done beside the tree
+    progressAdd(&progress->total, toWrite);
+
+    int res = applyChanges(&srcTree, &dstTree, progress, stats);
+
+    if (flushTree(dst) != 0)
+        res = -1;
+
+    freeManifest(&srcTree);
+    return res;
+}
+
+void printRefreshStats(const RefreshStats *stats)
+{
+    printf("Refresh: %lld files unchanged (%.1f MiB kept), %lld replaced, %lld added, %lld removed\n",
+           stats->unchanged, stats->unchangedBytes / 1048576.0,
+           stats->replaced, stats->added, stats->deleted);
+    printf("Compared %.1f MiB, wrote %.1f MiB\n",
+           stats->hashedBytes / 1048576.0, stats->writtenBytes / 1048576.0);
+}
\ No newline at end of file
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/loop.h>
+
+#include "utils.h"
+#include "loopdev.h"
+#include "options.h"
+#include "target.h"
+
+#define MIB (1024LL * 1024)
+
+static int openBlock(const UsbDevice *dev, int flags)
+{
+    // O_EXCL fails if anything on the disk is still mounted
+    return open(dev->dev_path, flags | O_EXCL | O_CLOEXEC);
+}
+
+static int openFile(const UsbDevice *dev, int flags)
+{
+    return open(dev->dev_path, flags | O_CLOEXEC);
+}
+
+static int openNull(const UsbDevice *dev, int flags)
+{
+    (void)dev;
+
+    // splice still needs a real descriptor to move data into
+    return open("/dev/null", (flags & ~(O_DIRECT | O_RDWR)) | O_WRONLY | O_CLOEXEC);
+}
+
+static int isZero(const char *buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+// Zero chunks become holes, so the image stays sparse even when overwriting an old one
+static int writeSparse(int fd, const char *buf, size_t len, off_t off)
+{
+    if (isZero(buf, len) && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+        return 0;
+
+    return writeFull(fd, buf, len, off);
+}
+
+static int writeNull(int fd, const char *buf, size_t len, off_t off)
+{
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)off;
+    return 0;
+}
+
+static int flushNull(int fd)
+{
+    (void)fd;
+    return 0;
+}
+
+static const TargetOps backends[] = {
+    [TARGET_BLOCK] = {"",      openBlock, writeFull,   fdatasync, 1, 1},
+    [TARGET_FILE]  = {"file:", openFile,  writeSparse, fdatasync, 1, 0},
+    [TARGET_LOOP]  = {"loop:", openBlock, writeFull,   fdatasync, 1, 1},
+    [TARGET_NULL]  = {"null",  openNull,  writeNull,   flushNull, 0, 0},
+};
+
+const TargetOps *targetOps(const UsbDevice *dev)
+{
+    return &backends[dev->kind];
+}
+
+static long long parseSize(const char *s)
+{
+    char *end;
+    double value = strtod(s, &end);
+
+    switch (*end)
+    {
+        case 'K': case 'k': value *= 1024; break;
+        case 'M': case 'm': value *= MIB; break;
+        case 'G': case 'g': value *= 1024 * MIB; break;
+        case 'T': case 't': value *= 1024.0 * 1024 * MIB; break;
+        case '\0': break;
+        default: return -1;
+    }
+
+    return value > 0 ? (long long)value : -1;
+}
+
+// Only looks at an existing image: nothing in it may change before the job is confirmed
+static int inspectImage(UsbDevice *dev)
+{
+    struct stat st;
+
+    if (stat(dev->image, &st) != 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+
+        perror(dev->image);
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Not a regular file: %s\n", dev->image);
+        return -1;
+    }
+
+    // A loop device cannot shrink its file without destroying it, and a kept image keeps its size
+    if (st.st_size > dev->capacity && (dev->kind == TARGET_LOOP || options.refresh || options.backupPath))
+        dev->capacity = st.st_size;
+
+    return 0;
+}
+
+// A loop device needs its file before it can be attached; growing it leaves the old contents alone
+static int growImage(const UsbDevice *dev)
+{
+    int fd = open(dev->image, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    int res = 0;
+
+    if (fd < 0)
+    {
+        perror("Failed to create image file");
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || (st.st_size < dev->capacity && ftruncate(fd, dev->capacity) != 0))
+    {
+        perror("Failed to size image file");
+        res = -1;
+    }
+
+    close(fd);
+    return res;
+}
+
+// The loop driver punches the holes and the kernel drops the device's cached pages with them
+static int discardLoop(const UsbDevice *dev)
+{
+    int fd = open(dev->dev_path, O_WRONLY | O_CLOEXEC);
+    uint64_t range[2] = {0, dev->capacity};
+    int res = -1;
+
+    if (fd >= 0)
+    {
+        res = ioctl(fd, BLKDISCARD, range);
+        close(fd);
+    }
+
+    return res;
+}
+
+// Called once the job is confirmed. The image is emptied at its final size, so unwritten ranges stay
+// holes; a refresh compares against the old contents and a backup images them, so those are kept whole.
+int prepareTarget(UsbDevice *dev)
+{
+    if (dev->kind != TARGET_FILE && dev->kind != TARGET_LOOP)
+        return 0;
+
+    int keep = options.refresh || options.backupPath;
+
+    if (dev->kind == TARGET_LOOP && !keep && discardLoop(dev) == 0)
+        return 0;
+
+    // Without discard the attached loop sees the file emptied underneath; its size does not change
+    int fd = open(dev->image, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+
+    if (fd < 0)
+    {
+        perror("Failed to create image file");
+        return -1;
+    }
+
+    if (keep && fstat(fd, &st) == 0 && st.st_size > dev->capacity)
+        dev->capacity = st.st_size;
+
+    int res = (keep ? 0 : ftruncate(fd, 0)) != 0 ? -1 : ftruncate(fd, dev->capacity);
+
+    if (res != 0)
+        perror("Failed to size image file");
+
+    close(fd);
+    return res;
+}
+
+// "file:PATH[:SIZE]", "loop:PATH[:SIZE]" or "null". Returns 0 when spec names none of them.
+int parseTarget(const char *spec, long long imageSize, UsbDevice *dev)
+{
+    TargetKind kind;
+
+    if (strncmp(spec, "file:", 5) == 0)
+        kind = TARGET_FILE;
+    else if (strncmp(spec, "loop:", 5) == 0)
+        kind = TARGET_LOOP;
+    else if (strcmp(spec, "null") == 0 || strcmp(spec, "null:") == 0)
+        kind = TARGET_NULL;
+    else
+        return 0;
+
+    memset(dev, 0, sizeof(*dev));
+    dev->kind = kind;
+
+    if (kind == TARGET_NULL)
+    {
+        dev->capacity = LLONG_MAX;
+        snprintf(dev->name, sizeof(dev->name), "null");
+        snprintf(dev->dev_path, sizeof(dev->dev_path), "null");
+        snprintf(dev->size, sizeof(dev->size), "-");
+        snprintf(dev->model, sizeof(dev->model), "null sink");
+        return 1;
+    }
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s", spec + 5);
+
+    char *sizeArg = strrchr(path, ':');
+
+    if (sizeArg)
+    {
+        *sizeArg++ = '\0';
+        dev->capacity = parseSize(sizeArg);
+
+        if (dev->capacity <= 0)
+        {
+            fprintf(stderr, "Invalid target size: %s\n", sizeArg);
+            return -1;
+        }
+    }
+    else
+    {
+        // A loop target may get a filesystem, leave room for its overhead
+        dev->capacity = kind == TARGET_LOOP ? imageSize + imageSize / 10 + 64 * MIB : imageSize;
+    }
+
+    dev->capacity = (dev->capacity + MIB - 1) / MIB * MIB;
+    snprintf(dev->dev_path, sizeof(dev->dev_path), "%s", path);
+    snprintf(dev->image, sizeof(dev->image), "%s", path);
+
+    if (inspectImage(dev) != 0)
+        return -1;
+
+    snprintf(dev->size, sizeof(dev->size), "%lldM", dev->capacity / MIB);
+    snprintf(dev->model, sizeof(dev->model), "%s", kind == TARGET_LOOP ? "loop-attached image" : "image file");
+
+    if (kind == TARGET_FILE)
+    {
+        const char *base = strrchr(path, '/');
+        snprintf(dev->name, sizeof(dev->name), "%.63s", base ? base + 1 : path);
+        return 1;
+    }
+
+    char loopPath[64];
+
+    if (growImage(dev) != 0)
+        return -1;
+
+    if (loopAttach(path, LO_FLAGS_PARTSCAN, 0, loopPath, sizeof(loopPath)) != 0)
+        return -1;
+
+    snprintf(dev->name, sizeof(dev->name), "%s", loopPath + 5);
+    formatPartPath(dev);
+
+    return 1;
+}
+
+void releaseTarget(UsbDevice *dev)
+{
+    if (dev->kind == TARGET_LOOP && dev->dev_path[0] != '\0')
+    {
+        loopDetach(dev->dev_path);
+        dev->dev_path[0] = '\0';
+    }
+}
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+
+#include "throttle.h"
+
+#define BURST_SECONDS 0.25
+#define MIN_RATE      (256 * 1024ULL)
+
+typedef struct {
+    pthread_mutex_t lock;
+    double tokens;
+    double last;
+    atomic_ullong throttledNs;
+} Bucket;
+
+// One cap, applied separately to each direction
+static atomic_ullong rate = 0;
+static Bucket readBucket = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0};
+static Bucket writeBucket = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void onAdjust(int sig)
+{
+    unsigned long long r = atomic_load(&rate);
+
+    if (r == 0)
+        return;
+
+    r = sig == SIGUSR1 ? r * 2 : r / 2;
+    atomic_store(&rate, r < MIN_RATE ? MIN_RATE : r);
+}
+
+void throttleSetup(int ioprioClass, int ioprioLevel, unsigned long long bytesPerSec)
+{
+    // Threads and commands started afterwards inherit the priority
+    if (ioprioClass != 0 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(ioprioClass, ioprioLevel)) != 0)
+        perror("ioprio_set failed");
+
+    throttleSetRate(bytesPerSec);
+
+    struct sigaction sa = {0};
+    sa.sa_handler = onAdjust;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+void throttleSetRate(unsigned long long bytesPerSec)
+{
+    atomic_store(&rate, bytesPerSec);
+}
+
+unsigned long long throttleRate()
+{
+    return atomic_load(&rate);
+}
+
+static void acquire(Bucket *b, size_t bytes)
+{
+    unsigned long long r = atomic_load_explicit(&rate, memory_order_relaxed);
+
+    if (r == 0)
+        return;
+
+    double burst = r * BURST_SECONDS;
+    double wait = 0;
+
+    pthread_mutex_lock(&b->lock);
+
+    double t = now();
+
+    if (b->last == 0)
+        b->tokens = burst;
+    else
+        b->tokens += (t - b->last) * r;
+
+    if (b->tokens > burst)
+        b->tokens = burst;
+
+    b->last = t;
+    b->tokens -= bytes;
+
+    // Going into debt lets a chunk larger than the burst through after one sleep
+    if (b->tokens < 0)
+        wait = -b->tokens / r;
+
+    pthread_mutex_unlock(&b->lock);
+
+    if (wait > 0)
+    {
+        struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&ts, NULL);
+        atomic_fetch_add(&b->throttledNs, (unsigned long long)(wait * 1e9));
+    }
+}
+
+void throttleRead(size_t bytes)
+{
+    acquire(&readBucket, bytes);
+}
+
+void throttleWrite(size_t bytes)
+{
+    acquire(&writeBucket, bytes);
+}
+
+void throttleReport()
+{
+    unsigned long long rd = atomic_exchange(&readBucket.throttledNs, 0);
+    unsigned long long wr = atomic_exchange(&writeBucket.throttledNs, 0);
+    unsigned long long r = atomic_load(&rate);
+
+    if (r == 0 && rd == 0 && wr == 0)
+        return;
+
+    printf("Bandwidth cap: %.1f MB/s, throttled %.1f s reading, %.1f s writing\n",
+           r / 1048576.0, rd / 1e9, wr / 1e9);
+}
\ No newline at end of file
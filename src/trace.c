@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define TRACE_RING_EVENTS 8192      // per thread; the oldest are overwritten
+#define TRACE_MAX_RINGS   256       // in use at once; an exited thread's ring goes to the next one
+#define TRACE_MAX_TRACKS  64
+#define TRACE_MAX_RETIRED 1024      // names of exited threads whose events may still be in a ring
+#define TRACE_TRACK_BASE  (1 << 22) // virtual tids for per-target phase rows, above any real tid
+#define TRACE_EXEC_BASE   (1 << 23) // plus the pid, one row per external command
+
+typedef struct {
+    char name[40];
+    const char *cat;                // always a literal
+    unsigned long long ts;
+    unsigned long long dur;
+    long long bytes;                // < 0 when not an I/O span
+    int tid;
+} TraceEvent;
+
+typedef struct TraceRing {
+    int tid;
+    char name[40];
+    atomic_ullong head;             // events ever recorded
+    struct TraceRing *nextFree;
+    TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+typedef struct {
+    char name[40];
+    _Atomic(const char *) phase;    // open phase, a literal
+    atomic_ullong since;
+} TraceTrack;
+
+typedef struct {
+    int tid;
+    char name[40];
+} ThreadName;
+
+typedef struct {
+    int fd;
+    int failed;
+    size_t len;
+    char buf[8192];
+} TraceOut;
+
+static atomic_int enabled = 0;
+static atomic_int flushed = 0;
+static char tracePath[256];
+static double origin;
+
+static TraceRing *rings[TRACE_MAX_RINGS];
+static atomic_int ringCount = 0;
+static TraceRing *freeRings;
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+static ThreadName retired[TRACE_MAX_RETIRED];
+static atomic_int retiredCount = 0;
+
+static atomic_int tracks = 0;
+static TraceTrack trackTable[TRACE_MAX_TRACKS];
+
+static __thread TraceRing *ring;
+static __thread int ringFull;
+
+static double monotonic()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int traceEnabled()
+{
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+unsigned long long traceNow()
+{
+    if (!traceEnabled())
+        return 0;
+
+    return (unsigned long long)((monotonic() - origin) * 1e6);
+}
+
+// Runs as the thread exits: its events stay in the ring, the next new thread appends after them
+static void releaseRing(void *arg)
+{
+    TraceRing *r = arg;
+    int n = atomic_fetch_add(&retiredCount, 1) % TRACE_MAX_RETIRED;
+
+    retired[n].tid = r->tid;
+    snprintf(retired[n].name, sizeof(retired[n].name), "%s", r->name);
+
+    pthread_mutex_lock(&ringLock);
+    r->nextFree = freeRings;
+    freeRings = r;
+    pthread_mutex_unlock(&ringLock);
+
+    // Anything the thread still traces from here on would land in a ring it no longer owns
+    ring = NULL;
+    ringFull = 1;
+}
+
+static void createRingKey()
+{
+    pthread_key_create(&ringKey, releaseRing);
+}
+
+// Rings are claimed on a thread's first event and handed on when it exits, so a long-running
+// process cycles through them instead of running out
+static TraceRing *threadRing()
+{
+    if (ring || ringFull)
+        return ring;
+
+    pthread_once(&ringKeyOnce, createRingKey);
+    pthread_mutex_lock(&ringLock);
+
+    TraceRing *r = freeRings;
+
+    if (r)
+        freeRings = r->nextFree;
+
+    pthread_mutex_unlock(&ringLock);
+
+    if (!r)
+    {
+        int slot = atomic_load(&ringCount);
+
+        r = slot < TRACE_MAX_RINGS ? calloc(1, sizeof(TraceRing)) : NULL;
+
+        if (!r)
+        {
+            ringFull = 1;
+            return NULL;
+        }
+
+        pthread_mutex_lock(&ringLock);
+        slot = atomic_load(&ringCount);
+
+        if (slot < TRACE_MAX_RINGS)
+        {
+            rings[slot] = r;
+            atomic_store(&ringCount, slot + 1);
+        }
+
+        pthread_mutex_unlock(&ringLock);
+
+        if (slot >= TRACE_MAX_RINGS)
+        {
+            free(r);
+            ringFull = 1;
+            return NULL;
+        }
+    }
+
+    r->tid = (int)syscall(SYS_gettid);
+    snprintf(r->name, sizeof(r->name), "thread %d", r->tid);
+    r->nextFree = NULL;
+
+    ring = r;
+    pthread_setspecific(ringKey, r);
+
+    return r;
+}
+
+void traceThreadName(const char *name)
+{
+    TraceRing *r = traceEnabled() ? threadRing() : NULL;
+
+    if (r)
+        snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+// A named row for spans that start and end on different threads, like a target's phases
+int traceTrack(const char *name)
+{
+    if (!traceEnabled())
+        return 0;
+
+    int n = atomic_fetch_add(&tracks, 1);
+
+    if (n < TRACE_MAX_TRACKS)
+        snprintf(trackTable[n].name, sizeof(trackTable[n].name), "%s", name);
+
+    return TRACE_TRACK_BASE + n;
+}
+
+// A row of its own for a child process, apart from real threads and phase tracks
+int traceExecTrack(int pid)
+{
+    return TRACE_EXEC_BASE + pid;
+}
+
+// Ends the track's open phase with a span and starts the next one; phase must be a literal
+void tracePhase(int track, const char *phase)
+{
+    int n = track - TRACE_TRACK_BASE;
+
+    if (!traceEnabled() || n < 0 || n >= TRACE_MAX_TRACKS)
+        return;
+
+    TraceTrack *t = &trackTable[n];
+    unsigned long long since = atomic_exchange(&t->since, traceNow());
+    const char *prev = atomic_exchange(&t->phase, phase);
+
+    if (prev)
+        traceSpanOn(track, "phase", prev, since, -1);
+}
+
+void traceSpanOn(int track, const char *cat, const char *name, unsigned long long start, long long bytes)
+{
+    TraceRing *r = traceEnabled() ? threadRing() : NULL;
+
+    if (!r)
+        return;
+
+    unsigned long long end = traceNow();
+    unsigned long long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    TraceEvent *e = &r->events[head % TRACE_RING_EVENTS];
+
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->cat = cat;
+    e->ts = start;
+    e->dur = end > start ? end - start : 0;
+    e->bytes = bytes;
+    e->tid = track ? track : r->tid;
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void traceSpan(const char *cat, const char *name, unsigned long long start, long long bytes)
+{
+    traceSpanOn(0, cat, name, start, bytes);
+}
+
+static void outFlush(TraceOut *o)
+{
+    size_t done = 0;
+
+    while (!o->failed && done < o->len)
+    {
+        ssize_t n = write(o->fd, o->buf + done, o->len - done);
+
+        if (n <= 0)
+            o->failed = 1;
+        else
+            done += n;
+    }
+
+    o->len = 0;
+}
+
+// No stdio from here on: the writers below format by hand, since the flush may run in a signal handler
+static void outText(TraceOut *o, const char *s)
+{
+    for (; *s; s++)
+    {
+        if (o->len == sizeof(o->buf))
+            outFlush(o);
+
+        o->buf[o->len++] = *s;
+    }
+}
+
+static void outNumber(TraceOut *o, unsigned long long v)
+{
+    char digits[24];
+    int n = sizeof(digits) - 1;
+
+    digits[n] = '\0';
+
+    do
+        digits[--n] = '0' + v % 10;
+    while ((v /= 10) != 0);
+
+    outText(o, digits + n);
+}
+
+// A complete span event up to its name, which follows as a string
+static void outSpan(TraceOut *o, int pid, int tid, unsigned long long ts, unsigned long long dur, const char *cat)
+{
+    outText(o, ",\n{\"ph\":\"X\",\"pid\":");
+    outNumber(o, pid);
+    outText(o, ",\"tid\":");
+    outNumber(o, tid);
+    outText(o, ",\"ts\":");
+    outNumber(o, ts);
+    outText(o, ",\"dur\":");
+    outNumber(o, dur);
+    outText(o, ",\"cat\":\"");
+    outText(o, cat);
+    outText(o, "\",\"name\":");
+}
+
+static void errorText(const char *s)
+{
+    ssize_t n = write(STDERR_FILENO, s, strlen(s));
+    (void)n;
+}
+
+static void writeString(TraceOut *o, const char *s)
+{
+    if (sizeof(o->buf) - o->len < 200)
+        outFlush(o);
+
+    o->buf[o->len++] = '"';
+
+    for (int i = 0; s[i] && i < 80; i++)
+    {
+        if (s[i] == '"' || s[i] == '\\')
+            o->buf[o->len++] = '\\';
+
+        if ((unsigned char)s[i] >= 0x20)
+            o->buf[o->len++] = s[i];
+    }
+
+    o->buf[o->len++] = '"';
+}
+
+static void writeThreadName(TraceOut *o, int pid, int tid, const char *name, int *first)
+{
+    outText(o, *first ? "\n" : ",\n");
+    outText(o, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":");
+    outNumber(o, pid);
+    outText(o, ",\"tid\":");
+    outNumber(o, tid);
+    outText(o, ",\"args\":{\"name\":");
+    writeString(o, name);
+    outText(o, "}}");
+    *first = 0;
+}
+
+// Chrome trace-event format, readable by Perfetto and chrome://tracing. Only async-signal-safe
+// calls (open, write, close, clock_gettime), so the fatal-signal handler can call it too
+void traceFlush()
+{
+    if (!traceEnabled() || atomic_exchange(&flushed, 1))
+        return;
+
+    unsigned long long end = traceNow();
+    TraceOut o = {.fd = open(tracePath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+
+    atomic_store(&enabled, 0);
+
+    if (o.fd < 0)
+    {
+        errorText("Failed to write trace to ");
+        errorText(tracePath);
+        errorText("\n");
+        return;
+    }
+
+    int pid = getpid();
+    int first = 1;
+    int count = atomic_load(&ringCount);
+    unsigned long long dropped = 0;
+
+    outText(&o, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for (int i = 0; i < count; i++)
+    {
+        TraceRing *r = rings[i];
+
+        if (!r)
+            continue;
+
+        unsigned long long head = atomic_load_explicit(&r->head, memory_order_acquire);
+        unsigned long long from = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        dropped += from;
+        writeThreadName(&o, pid, r->tid, r->name, &first);
+
+        for (unsigned long long n = from; n < head; n++)
+        {
+            TraceEvent *e = &r->events[n % TRACE_RING_EVENTS];
+
+            outSpan(&o, pid, e->tid, e->ts, e->dur, e->cat);
+            writeString(&o, e->name);
+
+            if (e->bytes >= 0)
+            {
+                outText(&o, ",\"args\":{\"bytes\":");
+                outNumber(&o, e->bytes);
+                outText(&o, "}");
+            }
+
+            outText(&o, "}");
+        }
+    }
+
+    // Threads that exited have handed their ring on, but their events can still be in it
+    int retiredTotal = atomic_load(&retiredCount);
+
+    for (int i = retiredTotal > TRACE_MAX_RETIRED ? retiredTotal - TRACE_MAX_RETIRED : 0; i < retiredTotal; i++)
+        writeThreadName(&o, pid, retired[i % TRACE_MAX_RETIRED].tid, retired[i % TRACE_MAX_RETIRED].name, &first);
+
+    int trackCount = atomic_load(&tracks);
+
+    for (int i = 0; i < trackCount && i < TRACE_MAX_TRACKS; i++)
+    {
+        TraceTrack *t = &trackTable[i];
+        const char *phase = atomic_load(&t->phase);
+        unsigned long long since = atomic_load(&t->since);
+
+        writeThreadName(&o, pid, TRACE_TRACK_BASE + i, t->name, &first);
+
+        // The phase a target is still in has not been closed by a later one
+        if (phase)
+        {
+            outSpan(&o, pid, TRACE_TRACK_BASE + i, since, end > since ? end - since : 0, "phase");
+            writeString(&o, phase);
+            outText(&o, "}");
+        }
+    }
+
+    outText(&o, "\n]}\n");
+    outFlush(&o);
+
+    int failed = o.failed || close(o.fd) != 0;
+
+    errorText(failed ? "Failed to write trace to " : "Trace written to ");
+    errorText(tracePath);
+    errorText(!failed && dropped ? " (oldest events dropped)\n" : "\n");
+}
+
+// Starts recording; the trace file is written when the process exits
+int traceOpen(const char *path)
+{
+    if (traceEnabled())
+        return 0;
+
+    snprintf(tracePath, sizeof(tracePath), "%s", path);
+    origin = monotonic();
+
+    if (atexit(traceFlush) != 0)
+        return -1;
+
+    atomic_store(&enabled, 1);
+    traceThreadName("main");
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "tune.h"
+
+#define TUNE_WINDOW        0.5     // seconds of completions per decision
+#define TUNE_HYSTERESIS    0.05    // changes smaller than this are noise
+#define TUNE_DROP          0.15    // a fall this large means the stick slowed down
+#define TUNE_LATENCY_LIMIT 1.0     // mean seconds per write before backing off
+#define TUNE_REPROBE       8       // quiet windows before trying to grow again
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void addEvent(Tuner *t, double at, double rate, const char *reason)
+{
+    if (t->eventCount == TUNE_MAX_EVENTS)
+    {
+        // Keep the first half for the ramp-up, shift out the oldest of the rest
+        memmove(&t->events[TUNE_MAX_EVENTS / 2], &t->events[TUNE_MAX_EVENTS / 2 + 1],
+                (TUNE_MAX_EVENTS / 2 - 1) * sizeof(TuneEvent));
+        t->eventCount--;
+        t->dropped++;
+    }
+
+    TuneEvent *e = &t->events[t->eventCount++];
+
+    e->at = at - t->start;
+    e->chunk = atomic_load(&t->chunk);
+    e->depth = atomic_load(&t->depth);
+    e->rate = rate;
+    e->reason = reason;
+}
+
+void tunerInit(Tuner *t, unsigned minChunk, unsigned maxChunk)
+{
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+
+    t->active = 1;
+    t->minChunk = minChunk;
+    t->maxChunk = maxChunk;
+    t->lastAxis = -1;
+    t->start = t->windowStart = now();
+
+    // Start from the fixed defaults, so tuning only ever moves away from them on evidence
+    atomic_init(&t->chunk, maxChunk);
+    atomic_init(&t->depth, 1);
+
+    addEvent(t, t->start, 0, "start");
+}
+
+void tunerDestroy(Tuner *t)
+{
+    pthread_mutex_destroy(&t->lock);
+}
+
+unsigned tunerChunk(Tuner *t)
+{
+    return atomic_load_explicit(&t->chunk, memory_order_relaxed);
+}
+
+int tunerDepth(Tuner *t)
+{
+    return atomic_load_explicit(&t->depth, memory_order_relaxed);
+}
+
+// Additive step on one knob; returns 0 when it is already at its limit
+static int grow(Tuner *t, int axis)
+{
+    if (axis == 0 && atomic_load(&t->depth) < TUNE_MAX_DEPTH)
+    {
+        atomic_fetch_add(&t->depth, 1);
+        return 1;
+    }
+
+    if (axis == 1 && atomic_load(&t->chunk) + t->minChunk <= t->maxChunk)
+    {
+        atomic_fetch_add(&t->chunk, t->minChunk);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void increase(Tuner *t, double at, double rate, const char *reason)
+{
+    int axis = t->axis;
+
+    if (!grow(t, axis) && !grow(t, axis ^= 1))
+    {
+        t->lastAxis = -1;
+        return;
+    }
+
+    t->lastAxis = axis;
+    addEvent(t, at, rate, reason);
+}
+
+// Multiplicative step: concurrency goes first, the chunk size only once depth is down to one
+static void decrease(Tuner *t, double at, double rate, const char *reason)
+{
+    int depth = atomic_load(&t->depth);
+    unsigned chunk = atomic_load(&t->chunk);
+
+    t->lastAxis = -1;
+
+    if (depth > 1)
+        atomic_store(&t->depth, depth / 2);
+    else if (chunk / 2 >= t->minChunk)
+        atomic_store(&t->chunk, chunk / 2 / t->minChunk * t->minChunk);
+    else
+        return;
+
+    addEvent(t, at, rate, reason);
+}
+
+// Drops the last additive step when it bought nothing
+static void undo(Tuner *t, double at, double rate)
+{
+    if (t->lastAxis == 0)
+        atomic_fetch_sub(&t->depth, 1);
+    else
+        atomic_fetch_sub(&t->chunk, t->minChunk);
+
+    t->axis = t->lastAxis ^ 1;
+    t->lastAxis = -1;
+    addEvent(t, at, rate, "no gain, undone");
+}
+
+static void step(Tuner *t, double at, double rate, double latency)
+{
+    double prev = t->lastRate;
+    int probing = t->lastAxis >= 0;
+
+    t->lastRate = rate;
+
+    if (latency > TUNE_LATENCY_LIMIT)
+        decrease(t, at, rate, "latency spike");
+    else if (prev > 0 && rate < prev * (1 - TUNE_DROP))
+        decrease(t, at, rate, "throughput dropped");
+    else if (probing && rate < prev * (1 + TUNE_HYSTERESIS))
+        undo(t, at, rate);
+    else if (prev == 0 || rate > prev * (1 + TUNE_HYSTERESIS))
+    {
+        t->plateaus = 0;
+        increase(t, at, rate, prev == 0 ? "ramp up" : "throughput rose");
+    }
+    else if (++t->plateaus >= TUNE_REPROBE)
+    {
+        // The best setting drifts as the stick's cache fills, so look again now and then
+        t->plateaus = 0;
+        t->axis ^= 1;
+        increase(t, at, rate, "reprobe");
+    }
+}
+
+void tunerRecord(Tuner *t, long long bytes, double latency)
+{
+    pthread_mutex_lock(&t->lock);
+
+    t->windowBytes += bytes;
+    t->windowLatency += latency;
+    t->windowOps++;
+
+    double at = now();
+    double elapsed = at - t->windowStart;
+
+    if (elapsed >= TUNE_WINDOW && t->windowOps >= atomic_load(&t->depth))
+    {
+        step(t, at, t->windowBytes / 1048576.0 / elapsed, t->windowLatency / t->windowOps);
+
+        t->windowStart = at;
+        t->windowBytes = 0;
+        t->windowLatency = 0;
+        t->windowOps = 0;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+void tunerReport(const Tuner *t)
+{
+    if (!t->active)
+        return;
+
+    const TuneEvent *last = &t->events[t->eventCount - 1];
+
+    int changes = t->eventCount - 1 + t->dropped;
+
+    printf("Write tuning settled on %u KiB chunks, %d in flight (%d change%s)\n",
+           last->chunk / 1024, last->depth, changes, changes == 1 ? "" : "s");
+
+    for (int i = 0; i < t->eventCount; i++)
+    {
+        const TuneEvent *e = &t->events[i];
+
+        if (t->dropped && i == TUNE_MAX_EVENTS / 2)
+            printf("  ... %d more\n", t->dropped);
+
+        printf("  %7.1fs  %5u KiB x %d", e->at, e->chunk / 1024, e->depth);
+
+        if (e->rate > 0)
+            printf("  at %7.1f MB/s", e->rate);
+
+        printf("  %s\n", e->reason);
+    }
+}
\ No newline at end of file
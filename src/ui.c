@@ -1,31 +1,80 @@
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "utils.h"
 #include "ui.h"
 #include "devices.h"
+#include "hotplug.h"
+#include "options.h"
+#include "write.h"
 
 void clearScreen()
 {
     printf("\033c");
 }
 
+// Returns the entered key, or 0 when a hotplug event changed the device table
+static int waitInputOrHotplug()
+{
+    fflush(stdout);
+
+    struct pollfd fds[2] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {deviceTableFd(), POLLIN, 0}
+    };
+    int nfds = fds[1].fd >= 0 ? 2 : 1;
+
+    while (1)
+    {
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return getCharInput();
+        }
+
+        if (fds[0].revents)
+            return getCharInput();
+
+        if (nfds == 2 && fds[1].revents && deviceTableProcess())
+            return 0;
+    }
+}
+
 Screen showDevices(UsbDevice *dev_data) 
 {
+    deviceTableInit();
+    deviceTableProcess();
+
+    UsbDevice devs[MAX_DEVICES];
+    int n = deviceTableSnapshot(devs, MAX_DEVICES);
+    int selected = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (strcmp(devs[i].name, dev_data->name) == 0)
+            selected = 1;
+    }
+
+    // The selected stick was unplugged; image targets never show up here
+    if (!selected && dev_data->kind == TARGET_BLOCK)
+        dev_data->name[0] = '\0';
+
     clearScreen();
 
     printf("\033[47;30m  ★ DEVICES ★  \n\033[0m\n");
 
-    UsbDevice devs[16];
-    int n = getUsbDevices(devs, 16);
-
     if (n == 0) 
     {
-        printf("No USB flash drives detected.\n\n");
+        printf("No USB flash drives detected.\n");
+        printf("Plug one in, the list updates automatically.\n\n");
         printf(" [Z] Back to Menu\n");
         printf("\nEnter choice: ");
 
-        int input = getCharInput();
+        int input = waitInputOrHotplug();
         if (input == 'z' || input == 'Z') return MENU;
         return DEVICES;
     }
@@ -47,7 +96,7 @@ Screen showDevices(UsbDevice *dev_data)
     }
 
     printf("\n [1-%d] Select device\n [Z] Back to Menu\n\nEnter choice: ", n);
-    int input = getCharInput();
+    int input = waitInputOrHotplug();
 
     if (input >= '1' && input <= '0' + n) 
     {
@@ -120,7 +169,19 @@ Screen showBeginCreation(UsbDevice *dev_data, IsoType isoType)
 
 Screen showStartCreation(UsbDevice *dev_data, const char* iso, IsoType isoType)
 {
-    if (!hasEnoughSpace(iso, dev_data)) 
+    int hybrid = isoType == ISO_LINUX && isHybridISO(iso);
+
+    // Raw writes run no external tools, only copy layouts need them
+    if (!hybrid && !checkDependencies(isoType))
+    {
+        printf("\033[1;31mError: Required tools are missing!\033[0m\n");
+        printf("Press Enter to go back...");
+        getchar();
+
+        return MENU;
+    }
+
+    if (!options.refresh && !hasEnoughSpace(iso, dev_data, isoType))
     {
         printf("\033[1;31mError: Not enough space on %s!\033[0m\n", dev_data->dev_path);
         printf("Press Enter to go back...");
@@ -130,7 +191,10 @@ Screen showStartCreation(UsbDevice *dev_data, const char* iso, IsoType isoType)
     }
 
     clearScreen();
-    printf("\033[1;31m!!! WARNING: ALL DATA ON %s WILL BE ERASED !!!\033[0m\n\n", dev_data->dev_path);
+    if (options.refresh)
+        printf("\033[1;33m!!! Files on %s that differ from the ISO will be replaced or removed !!!\033[0m\n\n", dev_data->dev_path);
+    else
+        printf("\033[1;31m!!! WARNING: ALL DATA ON %s WILL BE ERASED !!!\033[0m\n\n", dev_data->dev_path);
 
     const char* isoStr = (isoType == ISO_WINDOWS) ? "Windows" : "Linux";
 
@@ -144,10 +208,38 @@ Screen showStartCreation(UsbDevice *dev_data, const char* iso, IsoType isoType)
     
     if (input == 'y' || input == 'Y') 
     {
+        static char backupName[128];
+
+        // Nothing has touched the stick yet, this is the last chance to keep what is on it
+        if (!options.refresh && !options.backupPath && dev_data->kind == TARGET_BLOCK)
+        {
+            printf("Back up %s to a file in the current directory first? [Y/N]: ", dev_data->dev_path);
+            input = getCharInput();
+
+            if (input == 'y' || input == 'Y')
+            {
+                char stamp[32];
+                time_t t = time(NULL);
+
+                strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+                snprintf(backupName, sizeof(backupName), "grapeusb-%s-%s.backup", dev_data->name, stamp);
+                options.backupPath = backupName;
+            }
+        }
+
         printTime();
         printf("\n>>> Starting the process. This may take a while...\n");
 
-        if (create_bootable(iso, dev_data, isoType) != 0)
+        ProgressSlot progress;
+        progressInit(&progress, dev_data->name, 0);
+
+        int failed = create_bootable(iso, dev_data, isoType, hybrid, &progress) != 0;
+
+        // A later run in this session asks again instead of reusing the file name
+        if (options.backupPath == backupName)
+            options.backupPath = NULL;
+
+        if (failed)
         {
             printf("\n\033[1;31mError occurred during creation!\033[0m\n");
             printf("Press Enter to return...");
@@ -1,14 +1,29 @@
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "exec.h"
 #include "usb.h"
 #include "iso.h"
 #include "utils.h"
+#include "fat.h"
+#include "hotplug.h"
+#include "progress.h"
+#include "write.h"
+#include "throttle.h"
+#include "options.h"
+#include "health.h"
+#include "target.h"
+#include "delta.h"
+#include "trace.h"
+#include "queue.h"
+#include "backup.h"
+#include "partition.h"
+#include "history.h"
 
-#define MNT_USB_PATH "/mnt/grapeusb_usb"
-
-int formatUSB(UsbDevice *dev)
+int formatUSB(UsbDevice *dev, const char *srcRoot)
 {
     if (dev->part_path[0] == '\0')
     {
@@ -16,9 +31,36 @@ int formatUSB(UsbDevice *dev)
         return -1;
     }
 
+    FatGeometry geo;
+
+    if (planFatGeometry(srcRoot, dev, &geo) != 0)
+    {
+        fprintf(stderr, "Could not plan FAT32 geometry, using mkfs defaults\n");
+
+        char *cmd[] = {
+            "mkfs.vfat",
+            "-F32",
+            dev->part_path,
+            NULL
+        };
+
+        return run_checked(cmd);
+    }
+
+    char sectorSize[16], clusterSectors[16], reserved[16];
+    snprintf(sectorSize, sizeof(sectorSize), "%u", geo.sectorSize);
+    snprintf(clusterSectors, sizeof(clusterSectors), "%u", geo.clusterSize / geo.sectorSize);
+    snprintf(reserved, sizeof(reserved), "%u", geo.reservedSectors);
+
+    // -a keeps mkfs from re-aligning to clusters, the planned reserved area already aligns the data
     char *cmd[] = {
         "mkfs.vfat",
         "-F32",
+        "-a",
+        "-f", "2",
+        "-S", sectorSize,
+        "-s", clusterSectors,
+        "-R", reserved,
         dev->part_path,
         NULL
     };
@@ -26,57 +68,343 @@ int formatUSB(UsbDevice *dev)
     return run_checked(cmd);
 }
 
-int mountUSB(UsbDevice *dev)
+int mountUSB(UsbDevice *dev, const char *dir)
 {
-    if (access(MNT_USB_PATH, F_OK) != 0)
-        mkdir(MNT_USB_PATH, 0755);
-
-    char *cmd[] = {"mount", dev->part_path, MNT_USB_PATH, NULL};
+    char *cmd[] = {"mount", dev->part_path, (char *)dir, NULL};
     return run_checked(cmd);
 }
 
-int unmountUSB()
+// In-process like unmountISO: after a cancel or a removal no command may start, but cleanup still has to run
+int unmountUSB(const char *dir, int lazy)
+{
+    // A vanished stick cannot be flushed, so detach instead of blocking on it
+    if (umount2(dir, lazy ? MNT_DETACH : 0) == 0 || errno == EINVAL || errno == ENOENT)
+        return 0;
+
+    perror("Failed to unmount USB");
+
+    // Still busy: detach it so the job's mount directory can go and the disk can be reused
+    if (!lazy && umount2(dir, MNT_DETACH) == 0)
+        return 0;
+
+    return -1;
+}
+
+static void startProgress(ProgressSlot *progress, unsigned long long total)
+{
+    atomic_store(&progress->total, total);
+    progressRegister(progress);
+    progressStart();
+}
+
+static void stopProgress(ProgressSlot *progress)
+{
+    progressStop();
+    progressUnregister(progress);
+}
+
+static int writeBootable(const char *iso, UsbDevice *dev, ProgressSlot *progress)
+{
+    struct stat st;
+
+    if (stat(iso, &st) != 0)
+    {
+        perror("stat ISO failed");
+        return -1;
+    }
+
+    printf("Hybrid ISO detected, writing the image directly to %s\n", dev->dev_path);
+
+    startProgress(progress, st.st_size);
+
+    PoolStats stats = {0};
+    Tuner tuner = {0};
+    int res = writeImage(iso, dev, progress, options.writeMethod, options.fixedIo ? NULL : &tuner, &stats);
+
+    stopProgress(progress);
+
+    if (stats.count > 0)
+        printPoolStats(&stats);
+
+    tunerReport(&tuner);
+
+    latencyReport(dev->dev_path, &progress->latency);
+
+    return res;
+}
+
+static int backupStick(UsbDevice *dev, ProgressSlot *progress)
 {
-    char *cmd[] = {"umount", MNT_USB_PATH, NULL};
-    return run(cmd);
+    if (!targetOps(dev)->readable)
+    {
+        printf("Nothing to back up on %s\n", dev->dev_path);
+        return 0;
+    }
+
+    startProgress(progress, 0);
+
+    int res = backupDevice(dev, options.backupPath, progress);
+
+    stopProgress(progress);
+
+    return res;
 }
 
-int create_bootable(const char *iso, UsbDevice *dev, IsoType isoType) 
+// Compares the stick with the image and rewrites only the chunks that changed
+static int deltaBootable(const char *iso, UsbDevice *dev, ProgressSlot *progress)
+{
+    printf("Hybrid ISO detected, updating %s in place\n", dev->dev_path);
+
+    DeltaStats stats;
+    startProgress(progress, 0);
+
+    int res = deltaWriteImage(iso, dev, progress, &stats);
+
+    stopProgress(progress);
+
+    if (stats.chunks > 0)
+        printDeltaStats(&stats);
+
+    return res;
+}
+
+static int copyBootable(const char *iso, UsbDevice *dev, IsoType isoType, const JobMounts *m,
+                        ProgressSlot *progress)
 {
     int iso_mounted = 0;
     int usb_mounted = 0;
+    int res = -1;
 
-    unmountISO();
-    unmountUSB();
-
-    if (mountISO(iso) != 0)
-        goto error;
+    if (mountISO(iso, m->iso) != 0)
+        goto out;
     iso_mounted = 1;
 
-    if (formatUSB(dev) != 0)
-        goto error;
+    progressPhase(progress, "partitioning");
+
+    if (partitionStick(dev) != 0)
+        goto out;
+
+    unsigned long long traced = traceNow();
+    progressPhase(progress, "formatting");
+
+    if (formatUSB(dev, m->iso) != 0)
+        goto out;
 
-    if (mountUSB(dev) != 0)
-        goto error;
+    traceSpan("job", "format", traced, -1);
+
+    if (mountUSB(dev, m->usb) != 0)
+        goto out;
     usb_mounted = 1;
 
-    if (copyFiles(isoType) != 0)
-        goto error;
+    // The copy counts its own writes and sizes the total from its own listing, skip list included
+    startProgress(progress, 0);
+    progressPhase(progress, "copying");
+    setQuietChildren(1);
+
+    res = copyFiles(isoType, m, progress);
 
+    setQuietChildren(0);
+    progressPhase(progress, res == 0 ? "done" : "failed");
+    stopProgress(progress);
+
+out:
     if (usb_mounted)
-        unmountUSB();
+        unmountUSB(m->usb, atomic_load(&progress->targetGone));
 
     if (iso_mounted)
-        unmountISO();
+        unmountISO(m->iso);
 
-    return 0;
+    return res;
+}
 
-error:
+// Keeps the stick's partition and filesystem and only rewrites the files that changed
+static int refreshBootable(const char *iso, UsbDevice *dev, IsoType isoType, const JobMounts *m,
+                           ProgressSlot *progress)
+{
+    int iso_mounted = 0;
+    int usb_mounted = 0;
+    int res = -1;
+
+    if (mountISO(iso, m->iso) != 0)
+        goto out;
+    iso_mounted = 1;
+
+    if (mountUSB(dev, m->usb) != 0)
+    {
+        fprintf(stderr, "No copy layout to refresh on %s, run without --refresh\n", dev->dev_path);
+        goto out;
+    }
+    usb_mounted = 1;
+
+    RefreshStats stats;
+    startProgress(progress, 0);
+
+    res = refreshFiles(isoType, m, progress, &stats);
+
+    progressPhase(progress, res == 0 ? "done" : "failed");
+    stopProgress(progress);
+
+    if (res == 0)
+        printRefreshStats(&stats);
+
+out:
     if (usb_mounted)
-        unmountUSB(dev);
+        unmountUSB(m->usb, atomic_load(&progress->targetGone));
 
     if (iso_mounted)
-        unmountISO();
+        unmountISO(m->iso);
 
-    return -1;
+    return res;
+}
+
+// sysfs only knows what the controller claims; counterfeit sticks lie about it
+static int checkCapacity(UsbDevice *dev, ProgressSlot *progress)
+{
+    ProbeResult probe;
+    unsigned long long traced = traceNow();
+
+    progressPhase(progress, "probing");
+
+    if (probeCapacity(dev->dev_path, &probe) != 0)
+        return -1;
+
+    traceSpan("job", "capacity probe", traced, -1);
+
+    printProbeResult(dev->dev_path, &probe);
+
+    return probe.bad == 0 && probe.firstBad < 0 ? 0 : -1;
+}
+
+// A raw write covers the start of the disk, not the backup GPT or signatures past the image
+static int wipeStick(UsbDevice *dev, ProgressSlot *progress)
+{
+    progressPhase(progress, "wiping");
+    return wipeSignatures(dev);
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// progress must be initialised by the caller, which may poll it or request a stop from any thread;
+// hybrid is isHybridISO's answer, which long-running callers already have cached
+int create_bootable(const char *iso, UsbDevice *dev, IsoType isoType, int hybrid, ProgressSlot *progress)
+{
+    unsigned long long traced = traceNow();
+    double started = seconds();
+    const TargetOps *ops = targetOps(dev);
+    int watched = dev->kind != TARGET_FILE && dev->kind != TARGET_NULL;
+    int tuned = ops->blockDevice && !options.keepQueue;
+    TargetWatch watch;
+    QueueTune tune;
+
+    resetAbort();
+
+    if (watched)
+        startTargetWatch(&watch, dev->name, progress);
+
+    // --ioprio, and the wim split running at a higher level than the tree copy, need a scheduler
+    // that honours priorities
+    int priorities = options.ioprioClass != 0 || (isoType == ISO_WINDOWS && !hybrid);
+
+    if (tuned)
+        startQueueTune(&tune, dev->name, progress, priorities);
+
+    if (options.ioprioClass != 0 && ops->blockDevice)
+        queueWarnPriority(dev->dev_path, "the target", tuned);
+
+    int res;
+    const char *strategy = hybrid ? (options.refresh && ops->readable ? "delta" : "raw")
+                                  : (options.refresh ? "refresh" : "copy");
+
+    // A stop requested before the watch started would otherwise go unnoticed until the first chunk
+    if (progressStopRequested(progress))
+        res = -1;
+    // Image targets were only looked at until the job was confirmed
+    else if (prepareTarget(dev) != 0)
+        res = -1;
+    // Before the probe, which already overwrites samples all over the stick
+    else if (options.backupPath && backupStick(dev, progress) != 0)
+        res = -1;
+    // The probe overwrites samples all over the stick, which a refresh has to keep
+    else if (dev->kind == TARGET_BLOCK && !options.skipProbe && !options.refresh && checkCapacity(dev, progress) != 0)
+        res = -1;
+    else if (hybrid && options.refresh && ops->readable)
+        res = deltaBootable(iso, dev, progress);
+    else if (hybrid && ops->blockDevice && wipeStick(dev, progress) != 0)
+        res = -1;
+    else if (hybrid)
+        res = writeBootable(iso, dev, progress);
+    else if (!ops->blockDevice)
+    {
+        // Copy layouts need a partition table and a mountable filesystem
+        fprintf(stderr, "Only hybrid images can be written to %s, use a loop: target for this ISO\n", dev->dev_path);
+        res = -1;
+    }
+    else
+    {
+        // Every job mounts under its own directories, so parallel jobs never meet
+        JobMounts mounts;
+
+        if (createJobMounts(&mounts) != 0)
+            res = -1;
+        else
+        {
+            if (options.refresh)
+                res = refreshBootable(iso, dev, isoType, &mounts, progress);
+            else
+                res = copyBootable(iso, dev, isoType, &mounts, progress);
+
+            removeJobMounts(&mounts);
+        }
+    }
+
+    if (tuned)
+        stopQueueTune(&tune);
+    if (watched)
+        stopTargetWatch(&watch);
+    throttleReport();
+
+    if (res != 0 && atomic_load(&progress->targetGone))
+        fprintf(stderr, "Target %s disappeared during the write\n", dev->dev_path);
+
+    traceSpan("job", res == 0 ? "create bootable" : "create bootable (failed)", traced, -1);
+
+    // The null target measures the pipeline, not a stick
+    if (dev->kind != TARGET_NULL)
+        historyRecord(iso, strategy, dev, progress, seconds() - started, res == 0);
+
+    return res;
+}
+
+// Puts a backup taken with --backup back; the stick is watched for removal like any job
+int restoreStick(const char *archive, UsbDevice *dev, ProgressSlot *progress)
+{
+    int watched = dev->kind != TARGET_FILE && dev->kind != TARGET_NULL;
+    TargetWatch watch;
+
+    resetAbort();
+
+    if (prepareTarget(dev) != 0)
+        return -1;
+
+    if (watched)
+        startTargetWatch(&watch, dev->name, progress);
+
+    startProgress(progress, 0);
+
+    int res = restoreDevice(archive, dev, progress);
+
+    stopProgress(progress);
+
+    if (watched)
+        stopTargetWatch(&watch);
+
+    if (res != 0 && atomic_load(&progress->targetGone))
+        fprintf(stderr, "Target %s disappeared during the restore\n", dev->dev_path);
+
+    return res;
 }
\ No newline at end of file
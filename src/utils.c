@@ -1,17 +1,22 @@
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <glob.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "exec.h"
 #include "iso.h"
+#include "refresh.h"
 
-#define MNT_USB_PATH "/mnt/grapeusb_usb"
-#define MNT_ISO_PATH "/mnt/grapeusb_iso"
+
+// The split runs beside the in-process copy and gets the larger share of the stick
+#define WIM_IOPRIO_LEVEL  0
 
 int fileExists(const char *path)
 {
@@ -27,41 +32,126 @@ void checkRoot()
     }
 }
 
-int commandExists(const char *cmd)
+int readSysfsLL(const char *path, long long *value)
 {
-    char *path = getenv("PATH");
-    if (!path) return 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        return -1;
+
+    int ok = fscanf(f, "%lld", value) == 1;
+    fclose(f);
+
+    return ok ? 0 : -1;
+}
 
-    char *path_copy = strdup(path);
-    char *dir = strtok(path_copy, ":");
+typedef struct {
+    char name[32];
+    char path[512];
+    int found;
+} ToolEntry;
 
-    while (dir)
+#define TOOL_CACHE_SIZE 16
+
+static ToolEntry toolCache[TOOL_CACHE_SIZE];
+static int toolCount = 0;
+static pthread_mutex_t toolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *lookupCommand(const char *cmd)
+{
+    for (int i = 0; i < toolCount; i++)
     {
-        char full[512];
-        snprintf(full, sizeof(full), "%s/%s", dir, cmd);
+        if (strcmp(toolCache[i].name, cmd) == 0)
+            return toolCache[i].found ? toolCache[i].path : NULL;
+    }
+
+    // The last slot is recycled if the cache ever fills up
+    ToolEntry *entry = &toolCache[toolCount < TOOL_CACHE_SIZE ? toolCount++ : TOOL_CACHE_SIZE - 1];
+
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->name, sizeof(entry->name), "%s", cmd);
+
+    const char *dir = getenv("PATH");
 
-        if (access(full, X_OK) == 0)
+    while (dir && *dir && !entry->found)
+    {
+        const char *end = strchr(dir, ':');
+        size_t len = end ? (size_t)(end - dir) : strlen(dir);
+
+        if (len > 0)
         {
-            free(path_copy);
-            return 1;
+            snprintf(entry->path, sizeof(entry->path), "%.*s/%s", (int)len, dir, cmd);
+
+            if (access(entry->path, X_OK) == 0)
+                entry->found = 1;
         }
 
-        dir = strtok(NULL, ":");
+        dir = end ? end + 1 : NULL;
+    }
+
+    return entry->found ? entry->path : NULL;
+}
+
+// Walks $PATH once per tool; later lookups hit the cache, which concurrent jobs share
+const char *resolveCommand(const char *cmd)
+{
+    pthread_mutex_lock(&toolLock);
+    const char *path = lookupCommand(cmd);
+    pthread_mutex_unlock(&toolLock);
+
+    return path;
+}
+
+// pread/pwrite until the whole range is done; short transfers and EINTR are retried
+int readFull(int fd, char *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t n = pread(fd, buf + done, len - done, off + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        done += n;
+    }
+
+    return 0;
+}
+
+int writeFull(int fd, const char *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t n = pwrite(fd, buf + done, len - done, off + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        done += n;
     }
 
-    free(path_copy);
     return 0;
 }
 
+int commandExists(const char *cmd)
+{
+    return resolveCommand(cmd) != NULL;
+}
+
 int checkDependencies(IsoType iso)
 {
-    const char *common_deps[] = {
-        "lsblk",
-        "mkfs.fat",
+    // What a file copy layout runs; raw writes need none of it
+    const char *copy_deps[] = {
+        "mkfs.vfat",
         "mount",
-        "umount",
-        "rsync",
-        "sync",
         NULL
     };
 
@@ -70,12 +160,14 @@ int checkDependencies(IsoType iso)
         NULL
     };
 
-    for (int i = 0; common_deps[i] != NULL; i++)
+    int ok = 1;
+
+    for (int i = 0; copy_deps[i] != NULL; i++)
     {
-        if (!commandExists(common_deps[i]))
+        if (!commandExists(copy_deps[i]))
         {
-            fprintf(stderr, "Missing dependency: %s\n", common_deps[i]);
-            return 0;
+            fprintf(stderr, "Missing dependency: %s\n", copy_deps[i]);
+            ok = 0;
         }
     }
 
@@ -86,12 +178,12 @@ int checkDependencies(IsoType iso)
             if (!commandExists(windows_deps[i]))
             {
                 fprintf(stderr, "Missing dependency (Windows .iso only): %s\n", windows_deps[i]);
-                return 0;
+                ok = 0;
             }
         }
     }
 
-    return 1;
+    return ok;
 }
 
 void printTime() 
@@ -119,90 +211,147 @@ int getCharInput()
     return c;
 }
 
-int splitWimIfNeeded() 
+static pid_t startWimSplit(const JobMounts *m, int ioprioLevel)
 {
-    char *split[] = 
+    char wim[128], swm[128];
+    snprintf(wim, sizeof(wim), "%s/sources/install.wim", m->iso);
+    snprintf(swm, sizeof(swm), "%s/sources/install.swm", m->usb);
+
+    char *cmd[] = {"wimlib-imagex", "split", wim, swm, "3800", NULL};
+    return run_async(cmd, ioprioLevel);
+}
+
+int splitWimIfNeeded(const JobMounts *m)
+{
+    pid_t pid = startWimSplit(m, -1);
+
+    if (pid < 0 || run_wait(pid, "wimlib-imagex") != 0)
     {
-        "wimlib-imagex", "split",
-        MNT_ISO_PATH "/sources/install.wim",
-        MNT_USB_PATH "/sources/install.swm",
-        "3800", NULL
-    };
+        fprintf(stderr, "Failed: command failed: wimlib-imagex\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Starts splitting install.wim into the stick's sources directory without waiting for it
+static pid_t startWimCopy(const JobMounts *m)
+{
+    char sources[128];
+    snprintf(sources, sizeof(sources), "%s/sources/", m->usb);
 
-    return run_checked(split);
+    if (mkdir(sources, 0755) != 0 && errno != EEXIST)
+    {
+        perror("Failed to create sources directory on USB");
+        return -1;
+    }
+
+    return startWimSplit(m, WIM_IOPRIO_LEVEL);
 }
 
-int copyFiles(IsoType type) 
+int copyFiles(IsoType type, const JobMounts *m, ProgressSlot *progress)
 {
-    if (access(MNT_ISO_PATH, R_OK) != 0)
+    char path[128];
+    struct stat st;
+
+    if (access(m->iso, R_OK) != 0)
     {
         fprintf(stderr, "ISO not mounted or not readable\n");
         return -1;
     }
 
-    if (access(MNT_USB_PATH, R_OK) != 0)
+    if (access(m->usb, R_OK) != 0)
     {
         fprintf(stderr, "USB not mounted or not readable\n");
         return -1;
     }
 
-    if (type == ISO_WINDOWS)
-    {
-        char *copy_base[] = {
-            "rsync", "-ah", "--progress", 
-            "--no-perms", "--no-owner", "--no-group",
-            "--exclude", "sources/install.wim", 
-            "--exclude", "sources/install.esd",
-            MNT_ISO_PATH "/", MNT_USB_PATH "/", NULL
-        };
-
-        if (run_checked(copy_base) != 0)
-            return -1;
+    snprintf(path, sizeof(path), "%s/sources/install.wim", m->iso);
 
-        char wim_path[256];
-        snprintf(wim_path, sizeof(wim_path), "%s/sources/install.wim", MNT_ISO_PATH);
+    int splitWim = type == ISO_WINDOWS && stat(path, &st) == 0 && st.st_size > 4294967295LL;
 
-        if (access(wim_path, F_OK) == 0)
-        {
-            struct stat st;
-            stat(wim_path, &st);
-            if (st.st_size > 4294967295LL)
-            {
-                if (splitWimIfNeeded() != 0)
-                    return -1;
-            }
-            else
-            {
-                char *copy_wim[] = {"cp", wim_path, MNT_USB_PATH "/sources/", NULL};
+    // install.esd never goes on the stick; a wim too big for FAT32 is left to wimlib
+    const char *windowsSkip[] = {"sources/install.esd", "sources/install.wim", NULL};
 
-                if (run_checked(copy_wim) != 0)
-                    return -1;
-            }
-        }
-    }
-    else
-    {
-        char *copy_linux[] = {"rsync", "-ah", "--progress", MNT_ISO_PATH "/", MNT_USB_PATH "/", NULL};
-        
-        if (run_checked(copy_linux) != 0)
-            return -1;
+    if (!splitWim)
+        windowsSkip[1] = NULL;
+
+    // The split is the longest item, so it starts first and the tree copy fills in around it
+    pid_t wim = splitWim ? startWimCopy(m) : 0;
 
+    if (wim < 0)
+        return -1;
+
+    // copyTree adds what it copies; the skipped files never count
+    if (wim > 0)
+        progressAdd(&progress->total, st.st_size);
+
+    RefreshStats stats;
+    int res = copyTree(m->iso, m->usb, type == ISO_WINDOWS ? windowsSkip : NULL, progress, &stats);
+
+    if (wim > 0 && run_wait(wim, "wimlib-imagex") != 0)
+        res = -1;
+    // wimlib reports nothing while it runs, so the split counts once it is done
+    else if (wim > 0)
+        progressAdd(&progress->bytesWritten, st.st_size);
+
+    // The tree copy flushed its own writes; the split's still need to reach the stick
+    if (wim > 0 && res == 0 && flushTree(m->usb) != 0)
+        res = -1;
+
+    if (res != 0)
+        fprintf(stderr, "Failed: copying files to %s\n", m->usb);
+
+    return res;
+}
+
+// Updates a stick that already holds a copy layout, rewriting only files that changed
+int refreshFiles(IsoType type, const JobMounts *m, ProgressSlot *progress, RefreshStats *stats)
+{
+    char path[128];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/sources/install.wim", m->iso);
+
+    int splitWim = type == ISO_WINDOWS && stat(path, &st) == 0 && st.st_size > 4294967295LL;
+
+    // copyFiles never puts install.esd on the stick; a split wim cannot be compared file by file
+    const char *windowsSkip[] = {"sources/install.esd", "sources/install.wim", "sources/install*.swm", NULL};
+
+    if (!splitWim)
+        windowsSkip[1] = NULL;
+
+    if (refreshTree(m->iso, m->usb, type == ISO_WINDOWS ? windowsSkip : NULL, progress, stats) != 0)
+        return -1;
+
+    if (!splitWim)
         return 0;
+
+    glob_t parts;
+
+    snprintf(path, sizeof(path), "%s/sources/install*.swm", m->usb);
+
+    if (glob(path, GLOB_NOSORT, NULL, &parts) == 0)
+    {
+        for (size_t i = 0; i < parts.gl_pathc; i++)
+            unlink(parts.gl_pathv[i]);
+
+        globfree(&parts);
     }
 
-    char *sync_cmd[] = {"sync", NULL};
-    
-    if (run_checked(sync_cmd) != 0)
-        return -1;
+    snprintf(path, sizeof(path), "%s/sources/install.wim", m->usb);
+    unlink(path);
 
-    return 0;
+    progressPhase(progress, "splitting install.wim");
+
+    return splitWimIfNeeded(m);
 }
 
 void formatPartPath(UsbDevice *dev)
 {
     snprintf(dev->dev_path, sizeof(dev->dev_path), "/dev/%s", dev->name);
 
-    size_t len = strlen(dev->name);
+    size_t len = strlen(dev->dev_path);
 
     if (len + 2 >= sizeof(dev->part_path))
     {
@@ -0,0 +1,776 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "bufpool.h"
+#include "hash.h"
+#include "target.h"
+#include "throttle.h"
+#include "tune.h"
+#include "trace.h"
+#include "utils.h"
+#include "write.h"
+
+#define CHUNK_SIZE  (4 * 1024 * 1024)
+#define MIN_CHUNK   (256 * 1024)
+#define FLUSH_EVERY (64LL * 1024 * 1024)
+#define POOL_BUFFERS 16
+#define DIRECT_ALIGN 4096
+#define SPLICE_CHUNK (1024 * 1024)
+
+// isohybrid images carry an MBR with at least one partition entry
+int isHybridISO(const char *iso)
+{
+    int fd = open(iso, O_RDONLY);
+
+    if (fd < 0)
+        return 0;
+
+    unsigned char mbr[512];
+    ssize_t n = pread(fd, mbr, sizeof(mbr), 0);
+    close(fd);
+
+    if (n != sizeof(mbr) || mbr[510] != 0x55 || mbr[511] != 0xAA)
+        return 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned char *entry = mbr + 446 + i * 16;
+
+        if (entry[4] != 0) // partition type
+            return 1;
+    }
+
+    return 0;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    BufferPool pool;
+    long long size;
+    WriteMethod method;
+    int verify;
+    Tuner *tuner;           // NULL writes CHUNK_SIZE chunks one at a time
+    atomic_int aborted;
+} WriteJob;
+
+typedef struct {
+    WriteJob *job;
+    UsbDevice *dev;
+    const TargetOps *ops;
+    ProgressSlot *progress;
+    int fd;
+    int directFd;
+    BufQueue queue;
+    pthread_t thread;
+    int started;
+    atomic_int failed;
+    uint64_t deviceHash;
+    pthread_mutex_t gateLock;   // guards inflight and the latency histogram
+    pthread_cond_t gateCond;
+    int inflight;
+    pthread_mutex_t flushLock;
+    atomic_llong written;
+    long long flushed;
+} WriteTarget;
+
+typedef struct {
+    BufQueue queue;
+    HashState state;
+    pthread_t thread;
+} Hasher;
+
+static const char *methodNames[] = {"buffered", "direct", "splice"};
+
+const char *writeMethodName(WriteMethod method)
+{
+    return methodNames[method];
+}
+
+int parseWriteMethod(const char *name, WriteMethod *method)
+{
+    for (int i = 0; i < WRITE_METHOD_COUNT; i++)
+    {
+        if (strcmp(name, methodNames[i]) == 0)
+        {
+            *method = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Hashes [0, size) of fd through a single pool buffer, until progress is asked to stop
+static int hashRange(WriteJob *job, int fd, uint64_t *out, ProgressSlot *progress, atomic_ullong *counter)
+{
+    IoBuffer *buf = poolAcquire(&job->pool);
+    HashState h;
+    int res = 0;
+
+    hashInit(&h);
+
+    for (long long off = 0; off < job->size; off += buf->cap)
+    {
+        size_t len = job->size - off < (long long)buf->cap ? (size_t)(job->size - off) : buf->cap;
+
+        if (progressStopRequested(progress) || atomic_load(&job->aborted))
+        {
+            res = -1;
+            break;
+        }
+
+        throttleRead(len);
+
+        unsigned long long traced = traceNow();
+
+        if (readFull(fd, buf->data, len, off) != 0)
+        {
+            perror("Verify read failed");
+            res = -1;
+            break;
+        }
+
+        traceSpan("io", counter ? "verify read" : "image hash read", traced, len);
+
+        hashUpdate(&h, buf->data, len);
+
+        if (counter)
+            progressAdd(counter, len);
+    }
+
+    bufferRelease(buf);
+    *out = hashFinal(&h);
+
+    return res;
+}
+
+// Flushes everything after the last periodic flush, then reads the device back
+static void finishTarget(WriteTarget *t)
+{
+    atomic_store_explicit(&t->progress->queueDepth, 0, memory_order_relaxed);
+
+    if (atomic_load(&t->failed) || atomic_load(&t->job->aborted))
+        return;
+
+    progressPhase(t->progress, "flushing");
+
+    unsigned long long traced = traceNow();
+
+    if (t->ops->flush(t->fd) != 0)
+    {
+        perror("Device flush failed");
+        atomic_store(&t->failed, 1);
+        return;
+    }
+
+    traceSpan("io", "final flush", traced, -1);
+    progressAdd(&t->progress->bytesFlushed, t->job->size - t->flushed);
+
+    if (!t->job->verify || !t->ops->readable)
+        return;
+
+    progressPhase(t->progress, "verifying");
+
+    // Drop the page cache so the compare reads what actually reached the stick
+    posix_fadvise(t->fd, 0, t->job->size, POSIX_FADV_DONTNEED);
+
+    if (hashRange(t->job, t->fd, &t->deviceHash, t->progress, &t->progress->bytesVerified) != 0)
+        atomic_store(&t->failed, 1);
+}
+
+// Periodic flushes keep dirty pages bounded and the flushed counter honest
+static void flushIfDue(WriteTarget *t)
+{
+    long long done = atomic_load(&t->written);
+
+    // Whichever lane gets here first flushes, the others keep writing
+    if (done - t->flushed < FLUSH_EVERY || pthread_mutex_trylock(&t->flushLock) != 0)
+        return;
+
+    if (done - t->flushed >= FLUSH_EVERY)
+    {
+        unsigned long long traced = traceNow();
+        double start = now();
+
+        if (t->ops->flush(t->fd) != 0)
+        {
+            perror("Device flush failed");
+            atomic_store(&t->failed, 1);
+        }
+        else
+        {
+            progressAdd(&t->progress->bytesFlushed, done - t->flushed);
+            traceSpan("io", "flush", traced, done - t->flushed);
+            t->flushed = done;
+
+            // Buffered writes only reach the page cache, so the flush is where the device shows
+            if (t->progress->latency.flushes)
+            {
+                pthread_mutex_lock(&t->gateLock);
+                latencyRecord(&t->progress->latency, (unsigned long long)((now() - start) * 1e6));
+                pthread_mutex_unlock(&t->gateLock);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&t->flushLock);
+}
+
+static int writeDepth(WriteJob *job)
+{
+    return job->tuner ? tunerDepth(job->tuner) : 1;
+}
+
+static int writeLanes(WriteJob *job)
+{
+    return job->tuner ? TUNE_MAX_DEPTH : 1;
+}
+
+// Every lane pops from the target's queue; the gate caps how many are writing at once
+static void *laneWorker(void *arg)
+{
+    WriteTarget *t = arg;
+    IoBuffer *buf;
+
+    traceThreadName("writer lane");
+
+    // Keeps draining after a failure so the reader never blocks on a dead target
+    while ((buf = queuePop(&t->queue)) != NULL)
+    {
+        if (!atomic_load(&t->failed) && progressStopRequested(t->progress))
+            atomic_store(&t->failed, 1);
+
+        if (!atomic_load(&t->failed))
+        {
+            // An unaligned tail goes through the page cache instead
+            int direct = t->directFd >= 0 && buf->len % DIRECT_ALIGN == 0;
+
+            throttleWrite(buf->len);
+
+            pthread_mutex_lock(&t->gateLock);
+            while (t->inflight >= writeDepth(t->job))
+                pthread_cond_wait(&t->gateCond, &t->gateLock);
+            t->inflight++;
+            atomic_store_explicit(&t->progress->queueDepth, queueLength(&t->queue) + t->inflight,
+                                  memory_order_relaxed);
+            pthread_mutex_unlock(&t->gateLock);
+
+            unsigned long long traced = traceNow();
+            double start = now();
+            int werr = direct ? writeFull(t->directFd, buf->data, buf->len, buf->offset)
+                              : t->ops->write(t->fd, buf->data, buf->len, buf->offset);
+            double elapsed = now() - start;
+
+            traceSpan("io", direct ? "direct write" : "write", traced, buf->len);
+
+            pthread_mutex_lock(&t->gateLock);
+            t->inflight--;
+            if (direct)
+                latencyRecord(&t->progress->latency, (unsigned long long)(elapsed * 1e6));
+            pthread_cond_broadcast(&t->gateCond);
+            pthread_mutex_unlock(&t->gateLock);
+
+            if (werr != 0)
+            {
+                perror("Device write failed");
+                atomic_store(&t->failed, 1);
+            }
+            else
+            {
+                if (t->job->tuner)
+                    tunerRecord(t->job->tuner, buf->len, elapsed);
+
+                progressAdd(&t->progress->bytesWritten, buf->len);
+                atomic_fetch_add(&t->written, buf->len);
+                flushIfDue(t);
+            }
+        }
+
+        bufferRelease(buf);
+    }
+
+    return NULL;
+}
+
+static void *writerWorker(void *arg)
+{
+    WriteTarget *t = arg;
+    pthread_t lanes[TUNE_MAX_DEPTH];
+    int started = 0;
+
+    traceThreadName("target writer");
+    progressPhase(t->progress, "writing");
+
+    while (started < writeLanes(t->job) && pthread_create(&lanes[started], NULL, laneWorker, t) == 0)
+        started++;
+
+    // Without any extra thread this one drains the queue by itself
+    if (started == 0)
+        laneWorker(t);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(lanes[i], NULL);
+
+    finishTarget(t);
+    return NULL;
+}
+
+static void *hasherWorker(void *arg)
+{
+    Hasher *h = arg;
+    IoBuffer *buf;
+
+    traceThreadName("image hasher");
+
+    while ((buf = queuePop(&h->queue)) != NULL)
+    {
+        hashUpdate(&h->state, buf->data, buf->len);
+        bufferRelease(buf);
+    }
+
+    return NULL;
+}
+
+// Reads each chunk once into a pool buffer that every target writer and the hasher share
+static int readImage(WriteJob *job, int isoFd, WriteTarget *targets, int count, Hasher *hasher)
+{
+    size_t len;
+
+    for (long long off = 0; off < job->size; off += len)
+    {
+        int alive = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (!atomic_load(&targets[i].failed))
+                alive++;
+        }
+
+        if (alive == 0)
+            return -1;
+
+        IoBuffer *buf = poolAcquire(&job->pool);
+        size_t chunk = job->tuner ? tunerChunk(job->tuner) : buf->cap;
+
+        len = job->size - off < (long long)chunk ? (size_t)(job->size - off) : chunk;
+
+        throttleRead(len);
+
+        unsigned long long traced = traceNow();
+
+        if (readFull(isoFd, buf->data, len, off) != 0)
+        {
+            perror("Image read failed");
+            bufferRelease(buf);
+            return -1;
+        }
+
+        traceSpan("io", "image read", traced, len);
+
+        buf->len = len;
+        buf->offset = off;
+        bufferShare(buf, count + 1);
+
+        for (int i = 0; i < count; i++)
+        {
+            progressAdd(&targets[i].progress->bytesRead, len);
+            queuePush(&targets[i].queue, buf);
+        }
+
+        queuePush(&hasher->queue, buf);
+    }
+
+    return 0;
+}
+
+static int runPipeline(WriteJob *job, int isoFd, WriteTarget *targets, int count, uint64_t *imageHash)
+{
+    Hasher hasher = {0};
+    int hasherStarted = 0;
+
+    if (queueInit(&hasher.queue, POOL_BUFFERS) != 0)
+        return -1;
+    hashInit(&hasher.state);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (pthread_create(&targets[i].thread, NULL, writerWorker, &targets[i]) != 0)
+        {
+            atomic_store(&job->aborted, 1);
+            break;
+        }
+        targets[i].started = 1;
+    }
+
+    if (pthread_create(&hasher.thread, NULL, hasherWorker, &hasher) == 0)
+        hasherStarted = 1;
+    else
+        atomic_store(&job->aborted, 1);
+
+    if (!atomic_load(&job->aborted) && readImage(job, isoFd, targets, count, &hasher) != 0)
+        atomic_store(&job->aborted, 1);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (targets[i].started)
+        {
+            // One end marker per lane
+            for (int l = 0; l < writeLanes(job); l++)
+                queuePush(&targets[i].queue, NULL);
+
+            pthread_join(targets[i].thread, NULL);
+        }
+    }
+
+    if (hasherStarted)
+    {
+        queuePush(&hasher.queue, NULL);
+        pthread_join(hasher.thread, NULL);
+    }
+
+    *imageHash = hashFinal(&hasher.state);
+    queueDestroy(&hasher.queue);
+
+    return atomic_load(&job->aborted) ? -1 : 0;
+}
+
+// Moves the image to the device through a pipe; returns 1 if the kernel refuses at the start
+static int runSplice(WriteJob *job, int isoFd, WriteTarget *t, uint64_t *imageHash)
+{
+    int pipefd[2];
+
+    if (pipe(pipefd) != 0)
+        return 1;
+
+    fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+    progressPhase(t->progress, "writing");
+
+    loff_t inOff = 0;
+    loff_t outOff = 0;
+    int res = 0;
+
+    while (outOff < job->size && !atomic_load(&t->failed))
+    {
+        size_t want = job->size - outOff < SPLICE_CHUNK ? (size_t)(job->size - outOff) : SPLICE_CHUNK;
+
+        if (progressStopRequested(t->progress))
+        {
+            atomic_store(&t->failed, 1);
+            break;
+        }
+
+        throttleRead(want);
+
+        ssize_t in = splice(isoFd, &inOff, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if (in <= 0)
+        {
+            if (in < 0 && errno == EINTR)
+                continue;
+
+            perror("splice from image failed");
+            atomic_store(&t->failed, 1);
+            break;
+        }
+        progressAdd(&t->progress->bytesRead, in);
+
+        throttleWrite(in);
+
+        unsigned long long traced = traceNow();
+        ssize_t moved = in;
+
+        while (in > 0)
+        {
+            // Character devices like the null sink leave the offset alone, so track it here
+            loff_t pos = outOff;
+            ssize_t out = splice(pipefd[0], NULL, t->fd, &pos, in, SPLICE_F_MOVE);
+
+            if (out < 0 && errno == EINTR)
+                continue;
+
+            if (out <= 0)
+            {
+                // Nothing reached the device yet, so the caller can start over another way
+                if (outOff == 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+                    res = 1;
+                else
+                    perror("splice to device failed");
+
+                atomic_store(&t->failed, 1);
+                break;
+            }
+
+            in -= out;
+            outOff += out;
+            atomic_fetch_add(&t->written, out);
+            progressAdd(&t->progress->bytesWritten, out);
+        }
+
+        traceSpan("io", "splice", traced, moved - in);
+
+        flushIfDue(t);
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    if (res == 1)
+    {
+        atomic_store(&t->failed, 0);
+        atomic_store(&t->progress->bytesRead, 0);
+        return 1;
+    }
+
+    finishTarget(t);
+
+    if (atomic_load(&t->failed))
+        return -1;
+
+    // Nothing went through userspace, so the image is hashed on its own for the compare
+    if (job->verify && hashRange(job, isoFd, imageHash, t->progress, NULL) != 0)
+        return -1;
+
+    return 0;
+}
+
+static int runWrite(const char *iso, UsbDevice *devs, ProgressSlot *progress, int count,
+                    WriteMethod *method, long long limit, int verify, Tuner *tuner, PoolStats *stats)
+{
+    WriteJob job = {0};
+    WriteTarget *targets = calloc(count, sizeof(WriteTarget));
+    int isoFd = open(iso, O_RDONLY);
+    int res = -1;
+    struct stat st;
+
+    for (int i = 0; targets && i < count; i++)
+    {
+        targets[i].fd = -1;
+        targets[i].directFd = -1;
+        pthread_mutex_init(&targets[i].gateLock, NULL);
+        pthread_cond_init(&targets[i].gateCond, NULL);
+        pthread_mutex_init(&targets[i].flushLock, NULL);
+    }
+
+    if (!targets || isoFd < 0 || fstat(isoFd, &st) != 0)
+    {
+        perror("Failed to open image");
+        goto out;
+    }
+
+    job.size = limit > 0 && limit < st.st_size ? limit : st.st_size;
+    job.method = *method;
+    job.verify = verify;
+    posix_fadvise(isoFd, 0, job.size, POSIX_FADV_SEQUENTIAL);
+
+    if (poolCreate(&job.pool, POOL_BUFFERS, CHUNK_SIZE, 1) != 0)
+        goto out;
+
+    for (int i = 0; i < count; i++)
+    {
+        WriteTarget *t = &targets[i];
+
+        t->job = &job;
+        t->dev = &devs[i];
+        t->ops = targetOps(&devs[i]);
+        t->progress = &progress[i];
+        t->fd = t->ops->open(&devs[i], O_RDWR);
+
+        if (t->fd < 0)
+        {
+            perror("Failed to open device");
+            goto out;
+        }
+
+        // The null sink has nothing to bypass
+        if (job.method == WRITE_DIRECT && t->ops->readable)
+        {
+            t->directFd = open(devs[i].dev_path, O_WRONLY | O_DIRECT);
+
+            if (t->directFd < 0)
+                perror("O_DIRECT open failed, using buffered writes");
+        }
+
+        // Without O_DIRECT a write returns once it is in the page cache, so the flushes are timed
+        t->progress->latency.flushes = t->directFd < 0 && t->ops->readable;
+
+        if (queueInit(&t->queue, POOL_BUFFERS) != 0)
+            goto out;
+    }
+
+    uint64_t imageHash = 0;
+
+    // splice has a single destination, several targets always use the shared pipeline
+    if (job.method == WRITE_SPLICE && count == 1)
+    {
+        res = runSplice(&job, isoFd, &targets[0], &imageHash);
+
+        if (res == 1)
+        {
+            fprintf(stderr, "Kernel refused splice to %s, falling back to buffered writes\n", devs[0].dev_path);
+            job.method = WRITE_BUFFERED;
+        }
+    }
+    else if (job.method == WRITE_SPLICE)
+    {
+        job.method = WRITE_BUFFERED;
+    }
+
+    if (job.method != WRITE_SPLICE)
+    {
+        // splice moves whole pipe loads with a single writer, so only the pipeline is tuned
+        if (tuner)
+        {
+            tunerInit(tuner, MIN_CHUNK, CHUNK_SIZE);
+            job.tuner = tuner;
+        }
+
+        res = runPipeline(&job, isoFd, targets, count, &imageHash);
+    }
+
+    *method = job.method;
+
+    for (int i = 0; i < count && res == 0; i++)
+    {
+        if (atomic_load(&targets[i].failed))
+        {
+            res = -1;
+        }
+        else if (verify && targets[i].ops->readable && targets[i].deviceHash != imageHash)
+        {
+            fprintf(stderr, "Verify failed on %s: device hash %016llx, image hash %016llx\n",
+                    devs[i].dev_path, (unsigned long long)targets[i].deviceHash,
+                    (unsigned long long)imageHash);
+            res = -1;
+        }
+        else
+        {
+            progressPhase(&progress[i], "done");
+        }
+    }
+
+    if (stats)
+        poolStats(&job.pool, stats);
+
+out:
+    if (targets)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (targets[i].fd >= 0)
+                close(targets[i].fd);
+            if (targets[i].directFd >= 0)
+                close(targets[i].directFd);
+            if (targets[i].queue.items)
+                queueDestroy(&targets[i].queue);
+
+            pthread_mutex_destroy(&targets[i].gateLock);
+            pthread_cond_destroy(&targets[i].gateCond);
+            pthread_mutex_destroy(&targets[i].flushLock);
+        }
+    }
+
+    if (isoFd >= 0)
+        close(isoFd);
+
+    if (job.tuner)
+        tunerDestroy(job.tuner);
+
+    poolDestroy(&job.pool);
+    free(targets);
+
+    return res;
+}
+
+int writeImages(const char *iso, UsbDevice *devs, ProgressSlot *progress, int count,
+                WriteMethod method, Tuner *tuner, PoolStats *stats)
+{
+    return runWrite(iso, devs, progress, count, &method, 0, 1, tuner, stats);
+}
+
+int writeImage(const char *iso, UsbDevice *dev, ProgressSlot *progress, WriteMethod method,
+               Tuner *tuner, PoolStats *stats)
+{
+    return writeImages(iso, dev, progress, 1, method, tuner, stats);
+}
+
+// Writes the head of the image once per method, flush included, and reports the rates
+int benchWriteMethods(const char *iso, UsbDevice *dev, long long bytes)
+{
+    double best = 0;
+    int bestMethod = -1;
+
+    // Warm the image cache first so every method reads it at the same speed
+    int fd = open(iso, O_RDONLY);
+
+    if (fd < 0)
+    {
+        perror("Failed to open image");
+        return -1;
+    }
+
+    char *buf = malloc(CHUNK_SIZE);
+
+    for (long long off = 0; buf && off < bytes; off += CHUNK_SIZE)
+    {
+        if (pread(fd, buf, CHUNK_SIZE, off) <= 0)
+            break;
+    }
+
+    free(buf);
+    close(fd);
+
+    printf("Benchmarking %lld MiB to %s\n\n", bytes / 1048576, dev->dev_path);
+
+    for (int m = 0; m < WRITE_METHOD_COUNT; m++)
+    {
+        ProgressSlot progress;
+        WriteMethod used = m;
+
+        progressInit(&progress, dev->name, bytes);
+
+        double start = now();
+        int res = runWrite(iso, dev, &progress, 1, &used, bytes, 0, NULL, NULL);
+        double elapsed = now() - start;
+        double mbs = atomic_load(&progress.bytesWritten) / 1048576.0 / elapsed;
+
+        if (res != 0)
+        {
+            printf("  %-9s failed\n", methodNames[m]);
+            continue;
+        }
+
+        if ((int)used != m)
+        {
+            printf("  %-9s unavailable (fell back to %s)\n", methodNames[m], methodNames[used]);
+            continue;
+        }
+
+        printf("  %-9s %8.1f MB/s\n", methodNames[m], mbs);
+
+        if (mbs > best)
+        {
+            best = mbs;
+            bestMethod = m;
+        }
+    }
+
+    if (bestMethod < 0)
+        return -1;
+
+    printf("\nFastest on this host: --write-method=%s\n", methodNames[bestMethod]);
+    return 0;
+}
\ No newline at end of file